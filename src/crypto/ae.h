@@ -175,6 +175,49 @@ int ae_decrypt(ae_ctx     *ctx,
  *
  * ----------------------------------------------------------------------- */
 
+typedef struct {
+    const void *nonce;      /* nonce_len bytes                              */
+    const void *pt;         /* Plaintext                                    */
+    int         pt_len;     /* Bytes of plaintext                           */
+    void       *ct;         /* Receives pt_len + tag_len bytes              */
+} ae_batch_item;
+
+int ae_encrypt_batch(ae_ctx              *ctx,
+                     const ae_batch_item *items,
+                     int                  count);
+/* --------------------------------------------------------------------------
+ *
+ * Mosh extension: encrypt several independent messages at once.
+ *
+ * Each item is encrypted exactly as by ae_encrypt(ctx, nonce, pt, pt_len,
+ * NULL, 0, ct, NULL, AE_FINALIZE), with the tag following the ciphertext,
+ * but the AES work of all items is interleaved. An item's pt and ct may be
+ * equal; items must not otherwise overlap. No alignment is required.
+ *
+ * Returns:
+ *  AE_SUCCESS       - All items were encrypted.
+ *
+ * ----------------------------------------------------------------------- */
+
+/* --------------------------------------------------------------------------
+ *
+ * Mosh extension: AES implementation selection
+ *
+ * ----------------------------------------------------------------------- */
+
+#define AE_IMPL_AUTO     (0)   /* AES-NI if the CPU has it, else generic    */
+#define AE_IMPL_GENERIC  (1)   /* Implementation chosen at compile time     */
+#define AE_IMPL_AES_NI   (2)   /* x86 AES instructions                      */
+
+int ae_set_impl(int impl);
+int ae_get_impl(const ae_ctx *ctx);
+/* ae_set_impl() chooses the AES implementation used by contexts passed to
+ * ae_init() afterwards; contexts already initialized keep theirs. It
+ * returns AE_NOT_SUPPORTED if the implementation is not compiled in or
+ * the CPU lacks it. ae_get_impl() reports the one an initialized context
+ * uses. The default is AE_IMPL_AUTO.
+ */
+
 #ifdef __cplusplus
 } /* closing brace for extern "C" */
 #endif
@@ -142,8 +142,7 @@ string Base64Key::printable_key( void ) const
 Session::Session( Base64Key s_key )
   : key( s_key ), ctx_buf( ae_ctx_sizeof() ),
     ctx( (ae_ctx *)ctx_buf.data() ), blocks_encrypted( 0 ),
-    plaintext_buffer( RECEIVE_MTU ),
-    ciphertext_buffer( RECEIVE_MTU ),
+    packet_buffer( BUFFER_SIZE ),
     nonce_buffer( Nonce::NONCE_LEN )
 {
   if ( AE_SUCCESS != ae_init( ctx, key.data(), 16, 12, 16 ) ) {
@@ -194,29 +193,8 @@ Message::Message( Nonce s_nonce, string s_text )
     text( s_text )
 {}
 
-string Session::encrypt( Message plaintext )
+void Session::count_blocks( size_t pt_len )
 {
-  const size_t pt_len = plaintext.text.size();
-  const int ciphertext_len = pt_len + 16;
-
-  assert( (size_t)ciphertext_len <= ciphertext_buffer.len() );
-  assert( pt_len <= plaintext_buffer.len() );
-
-  memcpy( plaintext_buffer.data(), plaintext.text.data(), pt_len );
-  memcpy( nonce_buffer.data(), plaintext.nonce.data(), Nonce::NONCE_LEN );
-
-  if ( ciphertext_len != ae_encrypt( ctx,                                     /* ctx */
-				     nonce_buffer.data(),                     /* nonce */
-				     plaintext_buffer.data(),                 /* pt */
-				     pt_len,                                  /* pt_len */
-				     NULL,                                    /* ad */
-				     0,                                       /* ad_len */
-				     ciphertext_buffer.data(),                /* ct */
-				     NULL,                                    /* tag */
-				     AE_FINALIZE ) ) {                        /* final */
-    throw CryptoException( "ae_encrypt() returned error." );
-  }
-
   blocks_encrypted += pt_len >> 4;
   if ( pt_len & 0xF ) {
     /* partial block */
@@ -238,21 +216,93 @@ string Session::encrypt( Message plaintext )
   if ( blocks_encrypted >> 47 ) {
     throw CryptoException( "Encrypted 2^47 blocks.", true );
   }
+}
+
+size_t Session::gather( const Segment *segments, size_t count, AlignedBuffer &buf )
+{
+  char *text = buf.data() + PACKET_OFFSET + 8;
+  size_t pt_len = 0;
+
+  for ( size_t i = 0; i < count; i++ ) {
+    if ( PACKET_OFFSET + PACKET_OVERHEAD + pt_len + segments[ i ].len > buf.len() ) {
+      throw CryptoException( "Plaintext too long for packet buffer." );
+    }
+    memcpy( text + pt_len, segments[ i ].data, segments[ i ].len );
+    pt_len += segments[ i ].len;
+  }
+
+  return pt_len;
+}
+
+size_t Session::encrypt( uint64_t nonce_val, const Segment *segments, size_t count,
+			 AlignedBuffer &buf )
+{
+  char *packet = buf.data() + PACKET_OFFSET;
+  char *text = packet + 8;
+  size_t pt_len = gather( segments, count, buf );
+
+  Nonce nonce( nonce_val );
+  memcpy( nonce_buffer.data(), nonce.data(), Nonce::NONCE_LEN );
+  memcpy( packet, nonce.data() + 4, 8 );
+
+  const int ciphertext_len = pt_len + 16;
+
+  if ( ciphertext_len != ae_encrypt( ctx,                                     /* ctx */
+				     nonce_buffer.data(),                     /* nonce */
+				     text,                                    /* pt */
+				     pt_len,                                  /* pt_len */
+				     NULL,                                    /* ad */
+				     0,                                       /* ad_len */
+				     text,                                    /* ct */
+				     NULL,                                    /* tag */
+				     AE_FINALIZE ) ) {                        /* final */
+    throw CryptoException( "ae_encrypt() returned error." );
+  }
 
-  string text( ciphertext_buffer.data(), ciphertext_len );
+  count_blocks( pt_len );
 
-  return plaintext.nonce.cc_str() + text;
+  return 8 + ciphertext_len;
+}
+
+void Session::encrypt_batch( BatchPacket *packets, size_t count )
+{
+  batch_items.resize( count );
+
+  for ( size_t i = 0; i < count; i++ ) {
+    /* The full 12-byte nonce is the 8 on the wire after 4 zero bytes,
+       which fit in the spare room before the packet. */
+    char *packet = packets[ i ].buf->data() + PACKET_OFFSET;
+    Nonce nonce( packets[ i ].nonce_val );
+    memcpy( packet - 4, nonce.data(), Nonce::NONCE_LEN );
+
+    batch_items[ i ].nonce = packet - 4;
+    batch_items[ i ].pt = packet + 8;
+    batch_items[ i ].pt_len = packets[ i ].len;
+    batch_items[ i ].ct = packet + 8;
+  }
+
+  if ( count && AE_SUCCESS != ae_encrypt_batch( ctx, &batch_items[ 0 ], count ) ) {
+    throw CryptoException( "ae_encrypt_batch() returned error." );
+  }
+
+  for ( size_t i = 0; i < count; i++ ) {
+    count_blocks( packets[ i ].len );
+    packets[ i ].len += PACKET_OVERHEAD;
+  }
 }
 
-Message Session::decrypt( string ciphertext )
+size_t Session::decrypt( AlignedBuffer &buf, size_t len, uint64_t &nonce_val )
 {
-  if ( ciphertext.size() < 24 ) {
+  if ( len < PACKET_OVERHEAD ) {
     throw CryptoException( "Ciphertext must contain nonce and tag." );
   }
 
-  char *str = (char *)ciphertext.data();
+  assert( PACKET_OFFSET + len <= buf.len() );
 
-  int body_len = ciphertext.size() - 8;
+  char *packet = buf.data() + PACKET_OFFSET;
+  char *text = packet + 8;
+
+  int body_len = len - 8;
   int pt_len = body_len - 16;
 
   if ( pt_len < 0 ) { /* super-assertion that pt_len does not equal AE_INVALID */
@@ -260,28 +310,48 @@ Message Session::decrypt( string ciphertext )
     exit( 1 );
   }
 
-  assert( (size_t)body_len <= ciphertext_buffer.len() );
-  assert( (size_t)pt_len <= plaintext_buffer.len() );
-
-  Nonce nonce( str, 8 );
-  memcpy( ciphertext_buffer.data(), str + 8, body_len );
+  Nonce nonce( packet, 8 );
   memcpy( nonce_buffer.data(), nonce.data(), Nonce::NONCE_LEN );
 
   if ( pt_len != ae_decrypt( ctx,                      /* ctx */
 			     nonce_buffer.data(),      /* nonce */
-			     ciphertext_buffer.data(), /* ct */
+			     text,                     /* ct */
 			     body_len,                 /* ct_len */
 			     NULL,                     /* ad */
 			     0,                        /* ad_len */
-			     plaintext_buffer.data(),  /* pt */
+			     text,                     /* pt */
 			     NULL,                     /* tag */
 			     AE_FINALIZE ) ) {         /* final */
     throw CryptoException( "Packet failed integrity check." );
   }
 
-  Message ret( nonce, string( plaintext_buffer.data(), pt_len ) );
+  nonce_val = nonce.val();
+  return pt_len;
+}
 
-  return ret;
+string Session::encrypt( const Message &plaintext )
+{
+  Segment segment = { plaintext.text.data(), plaintext.text.size() };
+
+  Nonce nonce( plaintext.nonce );
+  size_t len = encrypt( nonce.val(), &segment, 1, packet_buffer );
+
+  return string( packet_buffer.data() + PACKET_OFFSET, len );
+}
+
+Message Session::decrypt( const string &ciphertext )
+{
+  if ( PACKET_OFFSET + ciphertext.size() > packet_buffer.len() ) {
+    throw CryptoException( "Ciphertext too long." );
+  }
+
+  memcpy( packet_buffer.data() + PACKET_OFFSET, ciphertext.data(), ciphertext.size() );
+
+  uint64_t nonce_val;
+  size_t pt_len = decrypt( packet_buffer, ciphertext.size(), nonce_val );
+
+  return Message( Nonce( nonce_val ),
+		  string( packet_buffer.data() + PACKET_OFFSET + 8, pt_len ) );
 }
 
 static rlim_t saved_core_rlimit;
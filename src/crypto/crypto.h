@@ -35,6 +35,7 @@
 
 #include "ae.h"
 #include <string>
+#include <vector>
 #include <string.h>
 #include <stdint.h>
 #include <stdlib.h>
@@ -105,6 +106,20 @@ namespace Crypto {
     uint64_t val( void );
   };
   
+  /* One piece of a plaintext given to Session::encrypt() as a list. */
+  struct Segment {
+    const char *data;
+    size_t len;
+  };
+
+  /* A packet for Session::encrypt_batch(), its plaintext already
+     gathered into buf by Session::gather(). */
+  struct BatchPacket {
+    uint64_t nonce_val;
+    AlignedBuffer *buf;
+    size_t len; /* plaintext length; packet length afterwards */
+  };
+
   class Message {
   public:
     Nonce nonce;
@@ -122,18 +137,48 @@ namespace Crypto {
     ae_ctx *ctx;
     uint64_t blocks_encrypted;
 
-    AlignedBuffer plaintext_buffer;
-    AlignedBuffer ciphertext_buffer;
+    AlignedBuffer packet_buffer;
     AlignedBuffer nonce_buffer;
-    
+
+    std::vector< ae_batch_item > batch_items;
+
+    void count_blocks( size_t pt_len );
+
   public:
     static const int RECEIVE_MTU = 2048;
 
+    /* A packet is the 8-byte nonce, the ciphertext and the 16-byte tag.
+       In a buffer given to the functions below it starts at this offset,
+       which leaves the ciphertext 16-byte aligned for in-place AES-OCB. */
+    static const size_t PACKET_OFFSET = 8;
+    static const size_t PACKET_OVERHEAD = 8 + 16;
+    static const size_t BUFFER_SIZE = PACKET_OFFSET + 8 + RECEIVE_MTU;
+
     Session( Base64Key s_key );
     ~Session();
-    
-    string encrypt( Message plaintext );
-    Message decrypt( string ciphertext );
+
+    /* Encrypts the concatenated segments into buf, which must be at least
+       BUFFER_SIZE long.  Returns the length of the packet written at
+       buf.data() + PACKET_OFFSET.  Does not allocate. */
+    size_t encrypt( uint64_t nonce_val, const Segment *segments, size_t count,
+		    AlignedBuffer &buf );
+
+    /* Copies the concatenated segments to where encrypt_batch() expects
+       the plaintext in buf, and returns their length. */
+    static size_t gather( const Segment *segments, size_t count, AlignedBuffer &buf );
+
+    /* Encrypts several gathered packets at once, interleaving their AES
+       work.  Afterwards each is len bytes long at buf->data() +
+       PACKET_OFFSET, exactly as encrypt() would have left it. */
+    void encrypt_batch( BatchPacket *packets, size_t count );
+
+    /* Decrypts in place the packet of length len at buf.data() +
+       PACKET_OFFSET.  Returns the plaintext length; the plaintext is at
+       buf.data() + PACKET_OFFSET + 8.  Does not allocate. */
+    size_t decrypt( AlignedBuffer &buf, size_t len, uint64_t &nonce_val );
+
+    string encrypt( const Message &plaintext );
+    Message decrypt( const string &ciphertext );
     
     Session( const Session & );
     Session & operator=( const Session & );
@@ -52,7 +52,12 @@
 /  one of the following to non-zero to specify which to use.               */
 #define USE_OPENSSL_AES      1  /* http://openssl.org                      */
 #define USE_REFERENCE_AES    0  /* Internet search: rijndael-alg-fst.c     */
-#define USE_AES_NI           0  /* Uses compiler's intrinsics              */
+
+/* On x86, an AES-NI implementation can be compiled in alongside the one
+/  chosen above. Each key is expanded for AES-NI when cpuid reports it at
+/  ae_init() time, and for the generic implementation otherwise, so a
+/  single binary runs everywhere. Set to 0 to leave it out.               */
+#define USE_AES_NI           1  /* Uses compiler's intrinsics              */
 
 /* During encryption and decryption, various "L values" are required.
 /  The L values can be precomputed during initialization (requiring extra
@@ -72,6 +77,7 @@
 /* Includes and compiler specific definitions                              */
 /* ----------------------------------------------------------------------- */
 
+#include "config.h"
 #include "ae.h"
 #include <stdlib.h>
 #include <string.h>
@@ -153,7 +159,7 @@
     #define zero_block()          _mm_setzero_si128()
     #define unequal_blocks(x,y) \
     					   (_mm_movemask_epi8(_mm_cmpeq_epi8(x,y)) != 0xffff)
-	#if __SSSE3__ || USE_AES_NI
+	#if __SSSE3__
     #include <tmmintrin.h>              /* SSSE3 instructions              */
     #define swap_if_le(b) \
       _mm_shuffle_epi8(b,_mm_set_epi8(0,1,2,3,4,5,6,7,8,9,10,11,12,13,14,15))
@@ -171,7 +177,7 @@
 		__m128i lshift = _mm_cvtsi32_si128(bot);
 		__m128i rshift = _mm_cvtsi32_si128(64-bot);
 		lo = _mm_xor_si128(_mm_sll_epi64(hi,lshift),_mm_srl_epi64(lo,rshift));
-		#if __SSSE3__ || USE_AES_NI
+		#if __SSSE3__
 		return _mm_shuffle_epi8(lo,_mm_set_epi8(8,9,10,11,12,13,14,15,0,1,2,3,4,5,6,7));
 		#else
 		return swap_if_le(_mm_shuffle_epi32(lo, _MM_SHUFFLE(1,0,3,2)));
@@ -320,6 +326,19 @@
 
 #endif
 
+/* Unaligned block loads and stores, for ae_encrypt_batch()                */
+#if __SSE2__
+	#define load_block_u(p)     _mm_loadu_si128((const block *)(p))
+	#define store_block_u(p,b)  _mm_storeu_si128((block *)(p), (b))
+#else
+	static inline block load_block_u(const void *p) {
+		block b; memcpy(&b, p, sizeof(b)); return b;
+	}
+	static inline void store_block_u(void *p, block b) {
+		memcpy(p, &b, sizeof(b));
+	}
+#endif
+
 /* ----------------------------------------------------------------------- */
 /* AES - Code uses OpenSSL API. Other implementations get mapped to it.    */
 /* ----------------------------------------------------------------------- */
@@ -384,18 +403,38 @@ static void AES_ecb_encrypt_blks(block *blks, unsigned nblks, AES_KEY *key) {
 
 #define BPI 4  /* Number of blocks in buffer per ECB call */
 
+/*----*/
+#endif
+/*----*/
+
+/* ----------------------------------------------------------------------- */
+/* AES-NI - Selected per key at runtime, falls back to the above.          */
+/* ----------------------------------------------------------------------- */
+
+#if USE_AES_NI && !((__x86_64__ || __i386__) && __SSE2__ && \
+                    HAVE_CPUID_H && HAVE_AES_NI_TARGET_ATTRIBUTE)
+	#undef USE_AES_NI
+	#define USE_AES_NI 0
+#endif
+
 /*----------*/
-#elif USE_AES_NI
+#if USE_AES_NI
 /*----------*/
 
+#include <cpuid.h>
 #include <wmmintrin.h>
 
+/* The rest of the file is built for the baseline ISA, so only the
+/  functions below may execute AES-NI instructions. They are never inlined
+/  into their callers, so run in batches of blocks as large as possible.  */
+#define AESNI __attribute__((target("aes")))
+
 #if (OCB_KEY_LEN == 0)
-	typedef struct { __m128i rd_key[15]; int rounds; } AES_KEY;
-	#define ROUNDS(ctx) ((ctx)->rounds)
+	typedef struct { __m128i rd_key[15]; int rounds; } aesni_key;
+	#define NI_ROUNDS(ctx) ((ctx)->rounds)
 #else
-	typedef struct { __m128i rd_key[7+OCB_KEY_LEN/4]; } AES_KEY;
-	#define ROUNDS(ctx) (6+OCB_KEY_LEN/4)
+	typedef struct { __m128i rd_key[7+OCB_KEY_LEN/4]; } aesni_key;
+	#define NI_ROUNDS(ctx) (6+OCB_KEY_LEN/4)
 #endif
 
 #define EXPAND_ASSIST(v1,v2,v3,v4,shuff_const,aes_const)                    \
@@ -422,7 +461,7 @@ static void AES_ecb_encrypt_blks(block *blks, unsigned nblks, AES_KEY *key) {
     x3 = _mm_xor_si128(x3,_mm_shuffle_epi32(x0, 255));                      \
     kp[idx+2] = x0; tmp = x3
 
-static void AES_128_Key_Expansion(const unsigned char *userkey, void *key)
+static AESNI void AES_128_Key_Expansion(const unsigned char *userkey, void *key)
 {
     __m128i x0,x1,x2;
     __m128i *kp = (__m128i *)key;
@@ -440,7 +479,8 @@ static void AES_128_Key_Expansion(const unsigned char *userkey, void *key)
     EXPAND_ASSIST(x0,x1,x2,x0,255,54);  kp[10] = x0;
 }
 
-static void AES_192_Key_Expansion(const unsigned char *userkey, void *key)
+#if (OCB_KEY_LEN == 0) || (OCB_KEY_LEN == 24)
+static AESNI void AES_192_Key_Expansion(const unsigned char *userkey, void *key)
 {
     __m128i x0,x1,x2,x3,tmp,*kp = (__m128i *)key;
     kp[0] = x0 = _mm_loadu_si128((__m128i*)userkey);
@@ -451,8 +491,10 @@ static void AES_192_Key_Expansion(const unsigned char *userkey, void *key)
     EXPAND192_STEP(7,16);
     EXPAND192_STEP(10,64);
 }
+#endif
 
-static void AES_256_Key_Expansion(const unsigned char *userkey, void *key)
+#if (OCB_KEY_LEN == 0) || (OCB_KEY_LEN == 32)
+static AESNI void AES_256_Key_Expansion(const unsigned char *userkey, void *key)
 {
     __m128i x0,x1,x2,x3,*kp = (__m128i *)key;
     kp[0] = x0 = _mm_loadu_si128((__m128i*)userkey   );
@@ -472,26 +514,30 @@ static void AES_256_Key_Expansion(const unsigned char *userkey, void *key)
     EXPAND_ASSIST(x3,x1,x2,x0,170,32); kp[13] = x3;
     EXPAND_ASSIST(x0,x1,x2,x3,255,64); kp[14] = x0;
 }
+#endif
 
-static int AES_set_encrypt_key(const unsigned char *userKey, const int bits, AES_KEY *key)
+static void aesni_set_encrypt_key(const unsigned char *userKey, const int bits, aesni_key *key)
 {
     if (bits == 128) {
         AES_128_Key_Expansion (userKey,key);
+    #if (OCB_KEY_LEN == 0) || (OCB_KEY_LEN == 24)
     } else if (bits == 192) {
         AES_192_Key_Expansion (userKey,key);
+    #endif
+    #if (OCB_KEY_LEN == 0) || (OCB_KEY_LEN == 32)
     } else if (bits == 256) {
         AES_256_Key_Expansion (userKey,key);
+    #endif
     }
     #if (OCB_KEY_LEN == 0)
     	key->rounds = 6+bits/32;
     #endif
-    return 0;
 }
 
-static void AES_set_decrypt_key_fast(AES_KEY *dkey, const AES_KEY *ekey)
+static AESNI void aesni_set_decrypt_key(aesni_key *dkey, const aesni_key *ekey)
 {
     int j = 0;
-    int i = ROUNDS(ekey);
+    int i = NI_ROUNDS(ekey);
     #if (OCB_KEY_LEN == 0)
     	dkey->rounds = i;
     #endif
@@ -501,18 +547,10 @@ static void AES_set_decrypt_key_fast(AES_KEY *dkey, const AES_KEY *ekey)
     dkey->rd_key[i] = ekey->rd_key[j];
 }
 
-static int AES_set_decrypt_key(const unsigned char *userKey, const int bits, AES_KEY *key)
-{
-    AES_KEY temp_key;
-    AES_set_encrypt_key(userKey,bits,&temp_key);
-    AES_set_decrypt_key_fast(key, &temp_key);
-    return 0;
-}
-
-static inline void AES_encrypt(const unsigned char *in,
-                        unsigned char *out, const AES_KEY *key)
+static AESNI void aesni_encrypt(const unsigned char *in,
+                        unsigned char *out, const aesni_key *key)
 {
-	int j,rnds=ROUNDS(key);
+	int j,rnds=NI_ROUNDS(key);
 	const __m128i *sched = ((__m128i *)(key->rd_key));
 	__m128i tmp = _mm_load_si128 ((__m128i*)in);
 	tmp = _mm_xor_si128 (tmp,sched[0]);
@@ -521,20 +559,8 @@ static inline void AES_encrypt(const unsigned char *in,
 	_mm_store_si128 ((__m128i*)out,tmp);
 }
 
-static inline void AES_decrypt(const unsigned char *in,
-                        unsigned char *out, const AES_KEY *key)
-{
-	int j,rnds=ROUNDS(key);
-	const __m128i *sched = ((__m128i *)(key->rd_key));
-	__m128i tmp = _mm_load_si128 ((__m128i*)in);
-	tmp = _mm_xor_si128 (tmp,sched[0]);
-	for (j=1; j<rnds; j++)  tmp = _mm_aesdec_si128 (tmp,sched[j]);
-	tmp = _mm_aesdeclast_si128 (tmp,sched[j]);
-	_mm_store_si128 ((__m128i*)out,tmp);
-}
-
-static inline void AES_ecb_encrypt_blks(block *blks, unsigned nblks, AES_KEY *key) {
-    unsigned i,j,rnds=ROUNDS(key);
+static AESNI void aesni_ecb_encrypt_blks(block *blks, unsigned nblks, const aesni_key *key) {
+    unsigned i,j,rnds=NI_ROUNDS(key);
 	const __m128i *sched = ((__m128i *)(key->rd_key));
 	for (i=0; i<nblks; ++i)
 	    blks[i] =_mm_xor_si128(blks[i], sched[0]);
@@ -545,8 +571,8 @@ static inline void AES_ecb_encrypt_blks(block *blks, unsigned nblks, AES_KEY *ke
 	    blks[i] =_mm_aesenclast_si128(blks[i], sched[j]);
 }
 
-static inline void AES_ecb_decrypt_blks(block *blks, unsigned nblks, AES_KEY *key) {
-    unsigned i,j,rnds=ROUNDS(key);
+static AESNI void aesni_ecb_decrypt_blks(block *blks, unsigned nblks, const aesni_key *key) {
+    unsigned i,j,rnds=NI_ROUNDS(key);
 	const __m128i *sched = ((__m128i *)(key->rd_key));
 	for (i=0; i<nblks; ++i)
 	    blks[i] =_mm_xor_si128(blks[i], sched[0]);
@@ -557,11 +583,61 @@ static inline void AES_ecb_decrypt_blks(block *blks, unsigned nblks, AES_KEY *ke
 	    blks[i] =_mm_aesdeclast_si128(blks[i], sched[j]);
 }
 
+static int aesni_supported(void)
+{
+	unsigned eax, ebx, ecx, edx;
+	if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+		return 0;
+	return (ecx & bit_AES) != 0;
+}
+
+#undef  BPI
 #define BPI 8  /* Number of blocks in buffer per ECB call   */
                /* Set to 4 for Westmere, 8 for Sandy Bridge */
 
+/* A key remembers which implementation it was expanded for.               */
+typedef struct {
+	union { AES_KEY generic; aesni_key ni; } u;
+	int aes_ni;
+} ocb_aes_key;
+
+static inline void ocb_aes_encrypt(const unsigned char *in,
+                        unsigned char *out, const ocb_aes_key *key)
+{
+	if (key->aes_ni)
+		aesni_encrypt(in, out, &key->u.ni);
+	else
+		AES_encrypt(in, out, &key->u.generic);
+}
+
+static inline void ocb_aes_ecb_encrypt_blks(block *blks, unsigned nblks, ocb_aes_key *key) {
+	if (key->aes_ni)
+		aesni_ecb_encrypt_blks(blks, nblks, &key->u.ni);
+	else
+		AES_ecb_encrypt_blks(blks, nblks, &key->u.generic);
+}
+
+static inline void ocb_aes_ecb_decrypt_blks(block *blks, unsigned nblks, ocb_aes_key *key) {
+	if (key->aes_ni)
+		aesni_ecb_decrypt_blks(blks, nblks, &key->u.ni);
+	else
+		AES_ecb_decrypt_blks(blks, nblks, &key->u.generic);
+}
+
+/*----*/
+#else
+/*----*/
+
+typedef AES_KEY ocb_aes_key;
+#define ocb_aes_encrypt(x,y,z)           AES_encrypt(x,y,z)
+#define ocb_aes_ecb_encrypt_blks(x,y,z)  AES_ecb_encrypt_blks(x,y,z)
+#define ocb_aes_ecb_decrypt_blks(x,y,z)  AES_ecb_decrypt_blks(x,y,z)
+
 #endif
 
+/* Which implementation ae_init() expands new keys for; see ae_set_impl(). */
+static int aes_impl = AE_IMPL_AUTO;
+
 /* ----------------------------------------------------------------------- */
 /* Define OCB context structure.                                           */
 /* ----------------------------------------------------------------------- */
@@ -588,8 +664,8 @@ struct _ae_ctx {
 	uint64_t KtopStr[3];                   /* Register correct, each item  */
     uint32_t ad_blocks_processed;
     uint32_t blocks_processed;
-    AES_KEY decrypt_key;
-    AES_KEY encrypt_key;
+    ocb_aes_key decrypt_key;
+    ocb_aes_key encrypt_key;
     #if (OCB_TAG_LEN == 0)
     unsigned tag_len;
     #endif
@@ -639,6 +715,38 @@ int ae_ctx_sizeof(void) { return (int) sizeof(ae_ctx); }
 
 /* ----------------------------------------------------------------------- */
 
+int ae_set_impl(int impl)
+{
+	switch (impl) {
+	case AE_IMPL_AUTO:
+	case AE_IMPL_GENERIC:
+		break;
+	case AE_IMPL_AES_NI:
+		#if USE_AES_NI
+		if (aesni_supported())
+			break;
+		#endif
+		return AE_NOT_SUPPORTED;
+	default:
+		return AE_NOT_SUPPORTED;
+	}
+	aes_impl = impl;
+	return AE_SUCCESS;
+}
+
+int ae_get_impl(const ae_ctx *ctx)
+{
+	#if USE_AES_NI
+	if (ctx->encrypt_key.aes_ni)
+		return AE_IMPL_AES_NI;
+	#else
+	(void) ctx;
+	#endif
+	return AE_IMPL_GENERIC;
+}
+
+/* ----------------------------------------------------------------------- */
+
 int ae_init(ae_ctx *ctx, const void *key, int key_len, int nonce_len, int tag_len)
 {
     unsigned i;
@@ -651,10 +759,19 @@ int ae_init(ae_ctx *ctx, const void *key, int key_len, int nonce_len, int tag_le
     #if (OCB_KEY_LEN > 0)
     key_len = OCB_KEY_LEN;
     #endif
-    AES_set_encrypt_key((unsigned char *)key, key_len*8, &ctx->encrypt_key);
     #if USE_AES_NI
-    AES_set_decrypt_key_fast(&ctx->decrypt_key,&ctx->encrypt_key);
+    if (aes_impl == AE_IMPL_AUTO)
+        aes_impl = aesni_supported() ? AE_IMPL_AES_NI : AE_IMPL_GENERIC;
+    ctx->encrypt_key.aes_ni = ctx->decrypt_key.aes_ni = (aes_impl == AE_IMPL_AES_NI);
+    if (aes_impl == AE_IMPL_AES_NI) {
+        aesni_set_encrypt_key((unsigned char *)key, key_len*8, &ctx->encrypt_key.u.ni);
+        aesni_set_decrypt_key(&ctx->decrypt_key.u.ni,&ctx->encrypt_key.u.ni);
+    } else {
+        AES_set_encrypt_key((unsigned char *)key, key_len*8, &ctx->encrypt_key.u.generic);
+        AES_set_decrypt_key((unsigned char *)key, (int)(key_len*8), &ctx->decrypt_key.u.generic);
+    }
     #else
+    AES_set_encrypt_key((unsigned char *)key, key_len*8, &ctx->encrypt_key);
     AES_set_decrypt_key((unsigned char *)key, (int)(key_len*8), &ctx->decrypt_key);
     #endif
 
@@ -663,7 +780,7 @@ int ae_init(ae_ctx *ctx, const void *key, int key_len, int nonce_len, int tag_le
     ctx->ad_blocks_processed = 0;
 
     /* Compute key-dependent values */
-    AES_encrypt((unsigned char *)&ctx->cached_Top,
+    ocb_aes_encrypt((unsigned char *)&ctx->cached_Top,
                             (unsigned char *)&ctx->Lstar, &ctx->encrypt_key);
     tmp_blk = swap_if_le(ctx->Lstar);
     tmp_blk = double_block(tmp_blk);
@@ -701,7 +818,7 @@ static block gen_offset_from_nonce(ae_ctx *ctx, const void *nonce)
 	tmp.u8[15] = tmp.u8[15] & 0xc0;        /* Zero low 6 bits of nonce */
 	if ( unequal_blocks(tmp.bl,ctx->cached_Top) )   { /* Cached?       */
 		ctx->cached_Top = tmp.bl;          /* Update cache, KtopStr    */
-		AES_encrypt(tmp.u8, (unsigned char *)&ctx->KtopStr, &ctx->encrypt_key);
+		ocb_aes_encrypt(tmp.u8, (unsigned char *)&ctx->KtopStr, &ctx->encrypt_key);
 		if (little.endian) {               /* Make Register Correct    */
 			ctx->KtopStr[0] = bswap64(ctx->KtopStr[0]);
 			ctx->KtopStr[1] = bswap64(ctx->KtopStr[1]);
@@ -749,7 +866,7 @@ static void process_ad(ae_ctx *ctx, const void *ad, int ad_len, int final)
 				ad_offset = xor_block(oa[6], getL(ctx, tz));
 				ta[7] = xor_block(ad_offset, adp[7]);
 			#endif
-			AES_ecb_encrypt_blks(ta,BPI,&ctx->encrypt_key);
+			ocb_aes_ecb_encrypt_blks(ta,BPI,&ctx->encrypt_key);
 			ad_checksum = xor_block(ad_checksum, ta[0]);
 			ad_checksum = xor_block(ad_checksum, ta[1]);
 			ad_checksum = xor_block(ad_checksum, ta[2]);
@@ -810,7 +927,7 @@ static void process_ad(ae_ctx *ctx, const void *ad, int ad_len, int final)
 				ta[k] = xor_block(ad_offset, tmp.bl);
 				++k;
 			}
-			AES_ecb_encrypt_blks(ta,k,&ctx->encrypt_key);
+			ocb_aes_ecb_encrypt_blks(ta,k,&ctx->encrypt_key);
 			switch (k) {
 				#if (BPI == 8)
 				case 8: ad_checksum = xor_block(ad_checksum, ta[7]);
@@ -900,7 +1017,7 @@ int ae_encrypt(ae_ctx     *  ctx,
 				ta[7] = xor_block(oa[7], ptp[7]);
 				checksum = xor_block(checksum, ptp[7]);
 			#endif
-			AES_ecb_encrypt_blks(ta,BPI,&ctx->encrypt_key);
+			ocb_aes_ecb_encrypt_blks(ta,BPI,&ctx->encrypt_key);
 			ctp[0] = xor_block(ta[0], oa[0]);
 			ctp[1] = xor_block(ta[1], oa[1]);
 			ctp[2] = xor_block(ta[2], oa[2]);
@@ -972,7 +1089,7 @@ int ae_encrypt(ae_ctx     *  ctx,
 		}
         offset = xor_block(offset, ctx->Ldollar);      /* Part of tag gen */
         ta[k] = xor_block(offset, checksum);           /* Part of tag gen */
-		AES_ecb_encrypt_blks(ta,k+1,&ctx->encrypt_key);
+		ocb_aes_ecb_encrypt_blks(ta,k+1,&ctx->encrypt_key);
 		offset = xor_block(ta[k], ctx->ad_checksum);   /* Part of tag gen */
 		if (remaining) {
 			--k;
@@ -1016,6 +1133,118 @@ int ae_encrypt(ae_ctx     *  ctx,
 
 /* ----------------------------------------------------------------------- */
 
+/* Without associated data, every block an OCB encryption passes to AES --
+/  each full plaintext block, the final partial-block pad and the tag -- is
+/  known from the plaintext and the offsets alone, before any AES output.
+/  Runs of BPI full blocks are encrypted as in ae_encrypt(). The few blocks
+/  left at the end of each message, which ae_encrypt() would have to send
+/  through AES as a short run of their own, are instead queued with those
+/  of the next messages, so short messages and the tails of long ones fill
+/  the AES pipeline together. Each queued block carries the value to xor
+/  into its AES output and where to store how many bytes of the result.
+/  Plaintexts and ciphertexts are only accessed with memcpy, so unlike the
+/  functions above these pointers need no alignment.                      */
+
+typedef struct {
+	block ta[BPI];                         /* AES inputs, then outputs     */
+	block xa[BPI];                         /* Xored into outputs           */
+	unsigned char *out[BPI];
+	unsigned len[BPI];
+	unsigned n;
+} batch_queue;
+
+static void batch_flush(ae_ctx *ctx, batch_queue *q)
+{
+	union { uint8_t u8[16]; block bl; } tmp;
+	unsigned i;
+
+	ocb_aes_ecb_encrypt_blks(q->ta, q->n, &ctx->encrypt_key);
+	for (i = 0; i < q->n; i++) {
+		if (q->len[i] == 16) {
+			store_block_u(q->out[i], xor_block(q->ta[i], q->xa[i]));
+		} else {
+			tmp.bl = xor_block(q->ta[i], q->xa[i]);
+			memcpy(q->out[i], tmp.u8, q->len[i]);
+		}
+	}
+	q->n = 0;
+}
+
+static inline void batch_push(ae_ctx *ctx, batch_queue *q, block in, block x,
+                              unsigned char *out, unsigned len)
+{
+	q->ta[q->n] = in;
+	q->xa[q->n] = x;
+	q->out[q->n] = out;
+	q->len[q->n] = len;
+	if (++q->n == BPI)
+		batch_flush(ctx, q);
+}
+
+int ae_encrypt_batch(ae_ctx *ctx, const ae_batch_item *items, int count)
+{
+	union { uint8_t u8[16]; block bl; } tmp;
+	batch_queue q;
+	int m;
+
+	#if (OCB_TAG_LEN > 0)
+	const unsigned tag_len = OCB_TAG_LEN;
+	#else
+	const unsigned tag_len = ctx->tag_len;
+	#endif
+
+	q.n = 0;
+	for (m = 0; m < count; m++) {
+		const unsigned char *pt = (const unsigned char *)items[m].pt;
+		unsigned char *ct = (unsigned char *)items[m].ct;
+		unsigned pt_len = (unsigned)items[m].pt_len;
+		unsigned full = pt_len / 16, remaining = pt_len % 16, j = 0, i;
+		block offset, checksum = zero_block();
+
+		offset = gen_offset_from_nonce(ctx, items[m].nonce);
+		while (full - j >= BPI) {
+			block ta[BPI], oa[BPI];
+			for (i = 0; i < BPI; i++) {
+				block p = load_block_u(pt);
+				offset = oa[i] = xor_block(offset, getL(ctx, ntz(++j)));
+				checksum = xor_block(checksum, p);
+				ta[i] = xor_block(offset, p);
+				pt += 16;
+			}
+			ocb_aes_ecb_encrypt_blks(ta, BPI, &ctx->encrypt_key);
+			for (i = 0; i < BPI; i++) {
+				store_block_u(ct, xor_block(ta[i], oa[i]));
+				ct += 16;
+			}
+		}
+		while (j < full) {
+			block p = load_block_u(pt);
+			offset = xor_block(offset, getL(ctx, ntz(++j)));
+			checksum = xor_block(checksum, p);
+			batch_push(ctx, &q, xor_block(offset, p), offset, ct, 16);
+			pt += 16;
+			ct += 16;
+		}
+		if (remaining) {
+			tmp.bl = zero_block();
+			memcpy(tmp.u8, pt, remaining);
+			tmp.u8[remaining] = (unsigned char)0x80u;
+			checksum = xor_block(checksum, tmp.bl);
+			offset = xor_block(offset, ctx->Lstar);
+			batch_push(ctx, &q, offset, tmp.bl, ct, remaining);
+			ct += remaining;
+		}
+		offset = xor_block(offset, ctx->Ldollar);
+		batch_push(ctx, &q, xor_block(offset, checksum), zero_block(), ct, tag_len);
+	}
+	if (q.n)
+		batch_flush(ctx, &q);
+
+	return AE_SUCCESS;
+}
+
+/* ----------------------------------------------------------------------- */
+
 /* Compare two regions of memory, taking a constant amount of time for a
    given buffer size -- under certain assumptions about the compiler
    and machine, of course.
@@ -1107,7 +1336,7 @@ int ae_decrypt(ae_ctx     *ctx,
 				oa[7] = xor_block(oa[6], getL(ctx, ntz(block_num)));
 				ta[7] = xor_block(oa[7], ctp[7]);
 			#endif
-			AES_ecb_decrypt_blks(ta,BPI,&ctx->decrypt_key);
+			ocb_aes_ecb_decrypt_blks(ta,BPI,&ctx->decrypt_key);
 			ptp[0] = xor_block(ta[0], oa[0]);
 			checksum = xor_block(checksum, ptp[0]);
 			ptp[1] = xor_block(ta[1], oa[1]);
@@ -1172,7 +1401,7 @@ int ae_decrypt(ae_ctx     *ctx,
 			if (remaining) {
 				block pad;
 				offset = xor_block(offset,ctx->Lstar);
-				AES_encrypt((unsigned char *)&offset, tmp.u8, &ctx->encrypt_key);
+				ocb_aes_encrypt((unsigned char *)&offset, tmp.u8, &ctx->encrypt_key);
 				pad = tmp.bl;
 				memcpy(tmp.u8,ctp+k,remaining);
 				tmp.bl = xor_block(tmp.bl, pad);
@@ -1181,7 +1410,7 @@ int ae_decrypt(ae_ctx     *ctx,
 				checksum = xor_block(checksum, tmp.bl);
 			}
 		}
-		AES_ecb_decrypt_blks(ta,k,&ctx->decrypt_key);
+		ocb_aes_ecb_decrypt_blks(ta,k,&ctx->decrypt_key);
 		switch (k) {
 			#if (BPI == 8)
 			case 7: ptp[6] = xor_block(ta[6], oa[6]);
@@ -1204,7 +1433,7 @@ int ae_decrypt(ae_ctx     *ctx,
 		/* Calculate expected tag */
         offset = xor_block(offset, ctx->Ldollar);
         tmp.bl = xor_block(offset, checksum);
-		AES_encrypt(tmp.u8, tmp.u8, &ctx->encrypt_key);
+		ocb_aes_encrypt(tmp.u8, tmp.u8, &ctx->encrypt_key);
 		tmp.bl = xor_block(tmp.bl, ctx->ad_checksum); /* Full tag */
 
 		/* Compare with proposed tag, change ct_len if invalid */
@@ -1387,9 +1616,7 @@ int main()
 }
 #endif
 
-#if USE_AES_NI
-char infoString[] = "OCB3 (AES-NI)";
-#elif USE_REFERENCE_AES
+#if USE_REFERENCE_AES
 char infoString[] = "OCB3 (Reference)";
 #elif USE_OPENSSL_AES
 char infoString[] = "OCB3 (OpenSSL)";
@@ -0,0 +1,156 @@
+/*
+    Mosh: the mobile shell
+    Copyright 2012 Keith Winstein
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    In addition, as a special exception, the copyright holders give
+    permission to link the code of portions of this program with the
+    OpenSSL library under certain conditions as described in each
+    individual source file, and distribute linked combinations including
+    the two.
+
+    You must obey the GNU General Public License in all respects for all
+    of the code used other than OpenSSL. If you modify file(s) with this
+    exception, you may extend this exception to your version of the
+    file(s), but you are not obligated to do so. If you do not wish to do
+    so, delete this exception statement from your version. If you delete
+    this exception statement from all source files in the program, then
+    also delete it here.
+*/
+
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+
+#if defined(HAVE_SYS_RANDOM_H)
+#include <sys/random.h>
+#endif
+
+#include <openssl/evp.h>
+
+#include "prng.h"
+
+static const char rdev[] = "/dev/urandom";
+
+/* Read size bytes from the kernel, without keeping a descriptor open. */
+static void read_kernel( unsigned char *dest, size_t size )
+{
+#if defined(HAVE_GETRANDOM)
+  while ( size > 0 ) {
+    ssize_t got = getrandom( dest, size, 0 );
+    if ( got < 0 ) {
+      if ( errno == EINTR ) {
+        continue;
+      }
+      if ( errno == ENOSYS ) {
+        break; /* older kernel; fall back to the device */
+      }
+      throw CryptoException( "getrandom() failed: " + std::string( strerror( errno ) ) );
+    }
+    dest += got;
+    size -= got;
+  }
+#elif defined(HAVE_GETENTROPY)
+  while ( size > 0 ) {
+    size_t chunk = size < 256 ? size : 256; /* getentropy() limit */
+    if ( getentropy( dest, chunk ) < 0 ) {
+      if ( errno == ENOSYS ) {
+        break;
+      }
+      throw CryptoException( "getentropy() failed: " + std::string( strerror( errno ) ) );
+    }
+    dest += chunk;
+    size -= chunk;
+  }
+#endif
+  if ( size == 0 ) {
+    return;
+  }
+
+  int fd = open( rdev, O_RDONLY );
+  if ( fd < 0 ) {
+    throw CryptoException( "Could not open " + std::string( rdev ) );
+  }
+  while ( size > 0 ) {
+    ssize_t got = read( fd, dest, size );
+    if ( got < 0 && errno == EINTR ) {
+      continue;
+    }
+    if ( got <= 0 ) {
+      close( fd );
+      throw CryptoException( "Could not read from " + std::string( rdev ) );
+    }
+    dest += got;
+    size -= got;
+  }
+  close( fd );
+}
+
+PRNG::~PRNG()
+{
+  if ( cipher ) {
+    EVP_CIPHER_CTX_free( static_cast<EVP_CIPHER_CTX *>( cipher ) );
+  }
+  memset( buffer, 0, sizeof( buffer ) );
+}
+
+void PRNG::refill( void )
+{
+  if ( !cipher || generated >= RESEED_BYTES ) {
+    unsigned char seed[ 32 ]; /* key, then IV */
+    read_kernel( seed, sizeof( seed ) );
+
+    if ( !cipher ) {
+      cipher = EVP_CIPHER_CTX_new();
+      if ( !cipher ) {
+        throw CryptoException( "Could not allocate cipher context." );
+      }
+    }
+    EVP_CIPHER_CTX *ctx = static_cast<EVP_CIPHER_CTX *>( cipher );
+    int ok = EVP_EncryptInit_ex( ctx, EVP_aes_128_ctr(), NULL, seed, seed + 16 );
+    memset( seed, 0, sizeof( seed ) );
+    if ( 1 != ok ) {
+      throw CryptoException( "Could not key random number generator." );
+    }
+    generated = 0;
+  }
+
+  /* The keystream is the encryption of zeros. */
+  memset( buffer, 0, sizeof( buffer ) );
+  int len = 0;
+  if ( 1 != EVP_EncryptUpdate( static_cast<EVP_CIPHER_CTX *>( cipher ),
+                               buffer, &len, buffer, BUFFER_SIZE )
+       || len != int( BUFFER_SIZE ) ) {
+    throw CryptoException( "Could not generate random bytes." );
+  }
+  available = BUFFER_SIZE;
+  generated += BUFFER_SIZE;
+}
+
+void PRNG::fill_slow( unsigned char *dest, size_t size )
+{
+  while ( size > 0 ) {
+    if ( available == 0 ) {
+      refill();
+    }
+    size_t chunk = size < available ? size : available;
+    fill( dest, chunk );
+    dest += chunk;
+    size -= chunk;
+  }
+}
@@ -33,40 +33,55 @@
 #ifndef PRNG_HPP
 #define PRNG_HPP
 
-#include <string>
+#include <string.h>
 #include <stdint.h>
-#include <fstream>
 
 #include "crypto.h"
 
-/* Read random bytes from /dev/urandom.
+/* Cryptographically strong random bytes, handed out from a buffer so
+   that the many small requests made while sending packets (chaff, in
+   particular) cost a memcpy.
 
-   We rely on stdio buffering for efficiency. */
-
-static const char rdev[] = "/dev/urandom";
+   The buffer is filled with an AES-128-CTR keystream whose key and IV
+   come from the kernel (getrandom() or getentropy() where available,
+   otherwise /dev/urandom), and it is rekeyed from the kernel every
+   RESEED_BYTES. No file descriptor is held between refills. */
 
 using namespace Crypto;
 
 class PRNG {
  private:
-  std::ifstream randfile;
+  static const size_t BUFFER_SIZE = 4096;
+  static const uint64_t RESEED_BYTES = 1 << 20;
+
+  unsigned char buffer[ BUFFER_SIZE ];
+  size_t available; /* unused bytes at the end of buffer */
+
+  void *cipher; /* EVP_CIPHER_CTX, kept out of this header */
+  uint64_t generated; /* since the last reseed */
 
   /* unimplemented to satisfy -Weffc++ */
   PRNG( const PRNG & );
   PRNG & operator=( const PRNG & );
 
+  void refill( void );
+  void fill_slow( unsigned char *dest, size_t size );
+
  public:
-  PRNG() : randfile( rdev, std::ifstream::in | std::ifstream::binary ) {}
+  PRNG() : buffer(), available( 0 ), cipher( NULL ), generated( 0 ) {}
+  ~PRNG();
 
   void fill( void *dest, size_t size ) {
-    if ( 0 == size ) {
+    if ( size > available ) {
+      fill_slow( static_cast<unsigned char *>( dest ), size );
       return;
     }
 
-    randfile.read( static_cast<char *>( dest ), size );
-    if ( !randfile ) {
-      throw CryptoException( "Could not read from " + std::string( rdev ) );
-    }
+    /* Hand out each byte only once. */
+    unsigned char *src = buffer + BUFFER_SIZE - available;
+    memcpy( dest, src, size );
+    memset( src, 0, size );
+    available -= size;
   }
 
   uint8_t uint8() {
@@ -0,0 +1,434 @@
+/*
+    Mosh: the mobile shell
+    Copyright 2012 Keith Winstein
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    In addition, as a special exception, the copyright holders give
+    permission to link the code of portions of this program with the
+    OpenSSL library under certain conditions as described in each
+    individual source file, and distribute linked combinations including
+    the two.
+
+    You must obey the GNU General Public License in all respects for all
+    of the code used other than OpenSSL. If you modify file(s) with this
+    exception, you may extend this exception to your version of the
+    file(s), but you are not obligated to do so. If you do not wish to do
+    so, delete this exception statement from your version. If you delete
+    this exception statement from all source files in the program, then
+    also delete it here.
+*/
+
+
+/* Measures the per-packet path below the transport: Session encryption,
+   Packet and Fragment coding, compression, and bursts through a
+   Connection, on the sizes Mosh sends most (empty acks, keystrokes,
+   partial and full-screen updates).  The OCB benchmarks run once for each
+   AES implementation the CPU supports, and compare a burst encrypted one
+   packet at a time with the same burst in one batch.
+
+   Each line is
+
+     <benchmark>[/<aes>]/<size> <iterations> <ns> ns/op [<MB/s> MB/s] <allocs> allocs/op
+
+   which is the format benchstat and similar tools read, so runs of two
+   versions can be compared directly. */
+
+#include "config.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <new>
+#include <string>
+
+#include "ae.h"
+#include "crypto.h"
+#include "network.h"
+#include "transportfragment.h"
+#include "compressor.h"
+#include "fatal_assert.h"
+#include "bench-util.h"
+
+using namespace Crypto;
+using namespace Network;
+
+/* Count heap allocations.  With glibc, every public allocator entry point
+   below is wrapped, and glibc, OpenSSL and zlib allocate through them, so
+   nothing is missed.  Elsewhere only operator new is seen. */
+
+static unsigned long allocations = 0;
+
+#if defined(__GLIBC__)
+extern "C" {
+  void *__libc_malloc( size_t size );
+  void *__libc_calloc( size_t n, size_t size );
+  void *__libc_realloc( void *ptr, size_t size );
+  void *__libc_memalign( size_t alignment, size_t size );
+  void *__libc_valloc( size_t size );
+  void *__libc_pvalloc( size_t size );
+  void __libc_free( void *ptr );
+
+  void *malloc( size_t size ) { allocations++; return __libc_malloc( size ); }
+  void *calloc( size_t n, size_t size ) { allocations++; return __libc_calloc( n, size ); }
+  void *realloc( void *ptr, size_t size ) { allocations++; return __libc_realloc( ptr, size ); }
+  void *memalign( size_t alignment, size_t size ) { allocations++; return __libc_memalign( alignment, size ); }
+  void *aligned_alloc( size_t alignment, size_t size ) { allocations++; return __libc_memalign( alignment, size ); }
+  void *valloc( size_t size ) { allocations++; return __libc_valloc( size ); }
+  void *pvalloc( size_t size ) { allocations++; return __libc_pvalloc( size ); }
+  void free( void *ptr ) { __libc_free( ptr ); }
+
+  void *reallocarray( void *ptr, size_t n, size_t size )
+  {
+    allocations++;
+    if ( size && n > size_t( -1 ) / size ) {
+      errno = ENOMEM;
+      return NULL;
+    }
+    return __libc_realloc( ptr, n * size );
+  }
+
+  int posix_memalign( void **memptr, size_t alignment, size_t size )
+  {
+    allocations++;
+    void *p = __libc_memalign( alignment, size );
+    if ( !p ) {
+      return ENOMEM;
+    }
+    *memptr = p;
+    return 0;
+  }
+}
+#else
+void *operator new( size_t size )
+{
+  allocations++;
+  void *p = malloc( size ? size : 1 );
+  if ( !p ) {
+    throw std::bad_alloc();
+  }
+  return p;
+}
+
+void operator delete( void *ptr ) throw()
+{
+  free( ptr );
+}
+#endif
+
+struct Size {
+  const char *name;
+  size_t payload_len; /* of a packet, after fragmenting */
+  size_t diff_len;    /* of an uncompressed instruction */
+};
+
+static const Size sizes[] = {
+  { "ack",       0,    16 },
+  { "keystroke", 12,   40 },
+  { "partial",   400,  1200 },
+  { "full",      1300, 8000 },
+};
+
+/* A burst the size of a full-screen redraw on a big terminal, ~30 kB
+   in full-size packets. */
+static const int BURST_PACKETS = 24;
+
+/* The far end of the Connection benchmarks: a loopback UDP socket which
+   is never read, so the kernel drops what no longer fits. */
+struct Sink {
+  int fd;
+  char port[ 8 ];
+
+  Sink() : fd( socket( AF_INET, SOCK_DGRAM, 0 ) )
+  {
+    struct sockaddr_in sin;
+    socklen_t len = sizeof( sin );
+    memset( &sin, 0, sizeof( sin ) );
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = htonl( INADDR_LOOPBACK );
+    fatal_assert( fd >= 0 );
+    fatal_assert( 0 == bind( fd, (struct sockaddr *) &sin, sizeof( sin ) ) );
+    fatal_assert( 0 == getsockname( fd, (struct sockaddr *) &sin, &len ) );
+    snprintf( port, sizeof( port ), "%d", ntohs( sin.sin_port ) );
+  }
+
+  ~Sink() { close( fd ); }
+
+private:
+  Sink( const Sink & );
+  Sink & operator=( const Sink & );
+};
+
+/* Everything a benchmark needs, prepared outside the timed loop. */
+struct Fixture {
+  Session session;
+  string payload, diff;
+  string coded_packet, coded_fragment, compressed;
+  AlignedBuffer buf, coded_buf;
+  size_t coded_len;
+  uint64_t seq;
+  AlignedBuffer *burst_bufs[ BURST_PACKETS ];
+  BatchPacket batch[ BURST_PACKETS ];
+  Sink sink;
+  Connection connection;
+
+  Fixture( const Size &size )
+    : session( Base64Key() ), payload( terminal_text( size.payload_len ) ),
+      diff( terminal_text( size.diff_len ) ), coded_packet(), coded_fragment(),
+      compressed(), buf( Session::BUFFER_SIZE ), coded_buf( Session::BUFFER_SIZE ),
+      coded_len( 0 ), seq( 0 ), sink(),
+      connection( 0, Base64Key().printable_key().c_str(), "127.0.0.1", sink.port, 0 )
+  {
+    coded_len = make_packet().tobuffer( &session, coded_buf );
+    coded_packet = string( coded_buf.data() + Session::PACKET_OFFSET, coded_len );
+    coded_fragment = Fragment( 1, 0, true, payload ).tostring();
+    compressed = get_compressor().compress_str( diff );
+    for ( int i = 0; i < BURST_PACKETS; i++ ) {
+      burst_bufs[ i ] = new AlignedBuffer( Session::BUFFER_SIZE );
+    }
+    connection.set_scheduler( SCHEDULER_MIN_RTT ); /* one copy of each packet */
+  }
+
+  ~Fixture()
+  {
+    for ( int i = 0; i < BURST_PACKETS; i++ ) {
+      delete burst_bufs[ i ];
+    }
+  }
+
+  Packet make_packet( void )
+  {
+    Segment segment = { payload.data(), payload.size() };
+    return Packet( seq++, TO_CLIENT, 1234567, 7654321, 0, 0, 0, segment );
+  }
+
+  /* Screen contents: words, spaces and the odd escape sequence, so that
+     they compress about as well as real updates. */
+  static string terminal_text( size_t len )
+  {
+    static const char *const words[] = { "mosh", "the", "\033[1;32m", "mobile", " ",
+                                         "shell", "\033[0m", "ls", "-la", "\r\n" };
+    string text;
+    uint32_t state = 12345;
+    while ( text.size() < len ) {
+      state = state * 1103515245 + 12345;
+      text += words[ ( state >> 16 ) % ( sizeof( words ) / sizeof( words[ 0 ] ) ) ];
+      text += ' ';
+    }
+    text.resize( len );
+    return text;
+  }
+
+private:
+  Fixture( const Fixture & );
+  Fixture & operator=( const Fixture & );
+};
+
+static void session_encrypt( Fixture &f )
+{
+  string ciphertext = f.session.encrypt( Message( Nonce( f.seq++ ), f.payload ) );
+}
+
+static void session_decrypt( Fixture &f )
+{
+  Message message = f.session.decrypt( f.coded_packet );
+}
+
+static void session_encrypt_inplace( Fixture &f )
+{
+  Segment segment = { f.payload.data(), f.payload.size() };
+  f.session.encrypt( f.seq++, &segment, 1, f.buf );
+}
+
+/* Includes copying the packet in, since decryption overwrites it. */
+static void session_decrypt_inplace( Fixture &f )
+{
+  uint64_t nonce_val;
+  memcpy( f.buf.data() + Session::PACKET_OFFSET, f.coded_buf.data() + Session::PACKET_OFFSET, f.coded_len );
+  f.session.decrypt( f.buf, f.coded_len, nonce_val );
+}
+
+/* The packets of a burst, each encrypted on its own... */
+static void session_encrypt_burst( Fixture &f )
+{
+  Segment segment = { f.payload.data(), f.payload.size() };
+  for ( int i = 0; i < BURST_PACKETS; i++ ) {
+    f.session.encrypt( f.seq++, &segment, 1, *f.burst_bufs[ i ] );
+  }
+}
+
+/* ...and in one batch. */
+static void session_encrypt_batch( Fixture &f )
+{
+  Segment segment = { f.payload.data(), f.payload.size() };
+  for ( int i = 0; i < BURST_PACKETS; i++ ) {
+    BatchPacket packet = { f.seq++, f.burst_bufs[ i ], Session::gather( &segment, 1, *f.burst_bufs[ i ] ) };
+    f.batch[ i ] = packet;
+  }
+  f.session.encrypt_batch( f.batch, BURST_PACKETS );
+}
+
+static void packet_tobuffer( Fixture &f )
+{
+  f.make_packet().tobuffer( &f.session, f.buf );
+}
+
+static void packet_parse_inplace( Fixture &f )
+{
+  memcpy( f.buf.data() + Session::PACKET_OFFSET, f.coded_buf.data() + Session::PACKET_OFFSET, f.coded_len );
+  Packet packet( f.buf, f.coded_len, &f.session );
+}
+
+static void fragment_tostring( Fixture &f )
+{
+  string coded = Fragment( f.seq++, 0, true, f.payload ).tostring();
+}
+
+static void fragment_parse( Fixture &f )
+{
+  Fragment fragment( f.coded_fragment );
+}
+
+static void compressor_roundtrip( Fixture &f )
+{
+  string diff = get_compressor().uncompress_str( get_compressor().compress_str( f.diff ) );
+}
+
+/* The burst sent the way the transport sends fragments: corked, so that
+   flush() encrypts and sends it in one batch. */
+static void connection_burst( Fixture &f )
+{
+  f.connection.cork();
+  for ( int i = 0; i < BURST_PACKETS; i++ ) {
+    f.connection.send( f.payload );
+  }
+  f.connection.uncork();
+}
+
+/* The same burst with every packet encrypted and sent on its own. */
+static void connection_burst_uncorked( Fixture &f )
+{
+  for ( int i = 0; i < BURST_PACKETS; i++ ) {
+    f.connection.send( f.payload );
+  }
+}
+
+struct Benchmark {
+  const char *name;
+  void (*run)( Fixture &f );
+  int packets; /* of the payload size per run, for MB/s; 0 for none */
+  bool per_aes; /* once for each AES implementation */
+};
+
+static const Benchmark benchmarks[] = {
+  { "session-encrypt",           session_encrypt,           1,             false },
+  { "session-decrypt",           session_decrypt,           1,             false },
+  { "session-encrypt-inplace",   session_encrypt_inplace,   1,             true },
+  { "session-decrypt-inplace",   session_decrypt_inplace,   1,             true },
+  { "session-encrypt-burst",     session_encrypt_burst,     BURST_PACKETS, true },
+  { "session-encrypt-batch",     session_encrypt_batch,     BURST_PACKETS, true },
+  { "packet-tobuffer",           packet_tobuffer,           1,             false },
+  { "packet-parse-inplace",      packet_parse_inplace,      1,             false },
+  { "fragment-tostring",         fragment_tostring,         0,             false },
+  { "fragment-parse",            fragment_parse,            0,             false },
+  { "compressor-roundtrip",      compressor_roundtrip,      0,             false },
+  { "connection-burst",          connection_burst,          BURST_PACKETS, false },
+  { "connection-burst-uncorked", connection_burst_uncorked, BURST_PACKETS, false },
+};
+
+struct Aes {
+  const char *name;
+  int impl;
+};
+
+static const Aes aes_impls[] = {
+  { "generic", AE_IMPL_GENERIC },
+  { "aes-ni",  AE_IMPL_AES_NI },
+};
+
+/* Runs the benchmark for at least min_ns, doubling the iteration count
+   until it does, and reports the last run.  aes names the implementation
+   selected with ae_set_impl(), if any. */
+static void measure( const Benchmark &b, const char *aes, const Size &size, double min_ns )
+{
+  Fixture f( size );
+
+  unsigned long iterations = 1;
+  for ( ;; ) {
+    unsigned long allocs = allocations;
+    double start = now_ns();
+    for ( unsigned long n = 0; n < iterations; n++ ) {
+      b.run( f );
+    }
+    double elapsed = now_ns() - start;
+    allocs = allocations - allocs;
+
+    if ( elapsed >= min_ns || iterations >= 1000000000 ) {
+      printf( "%s/%s%s%s %lu %.1f ns/op", b.name, aes ? aes : "", aes ? "/" : "", size.name,
+              iterations, elapsed / iterations );
+      const double bytes = double( b.packets ) * size.payload_len * iterations;
+      if ( bytes > 0 ) {
+        printf( " %.2f MB/s", bytes * 1e3 / elapsed );
+      }
+      printf( " %.2f allocs/op\n", double( allocs ) / iterations );
+      fflush( stdout );
+      return;
+    }
+    iterations *= 2;
+  }
+}
+
+int main( int argc, char *argv[] )
+{
+  int min_ms = 200;
+  if ( argc > 1 ) {
+    min_ms = atoi( argv[ 1 ] );
+    if ( min_ms < 1 || min_ms > 1000000 ) {
+      fprintf( stderr, "Usage: %s [milliseconds per benchmark]\n", argv[ 0 ] );
+      exit( 1 );
+    }
+  }
+
+#if !defined(__GLIBC__)
+  fprintf( stderr, "Counting operator new only; C library allocations are not included.\n" );
+#endif
+
+  try {
+    for ( size_t i = 0; i < sizeof( benchmarks ) / sizeof( benchmarks[ 0 ] ); i++ ) {
+      const Benchmark &b = benchmarks[ i ];
+      const size_t passes = b.per_aes ? sizeof( aes_impls ) / sizeof( aes_impls[ 0 ] ) : 1;
+      for ( size_t k = 0; k < passes; k++ ) {
+        /* A Session picks its implementation when it is constructed. */
+        if ( b.per_aes && AE_SUCCESS != ae_set_impl( aes_impls[ k ].impl ) ) {
+          continue; /* not compiled in, or not supported by the CPU */
+        }
+        for ( size_t j = 0; j < sizeof( sizes ) / sizeof( sizes[ 0 ] ); j++ ) {
+          measure( b, b.per_aes ? aes_impls[ k ].name : NULL, sizes[ j ], min_ms * 1e6 );
+        }
+      }
+      ae_set_impl( AE_IMPL_AUTO );
+    }
+  } catch ( const std::exception &e ) {
+    fprintf( stderr, "Error: %s\n", e.what() );
+    exit( 1 );
+  }
+
+  return 0;
+}
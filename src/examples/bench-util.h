@@ -0,0 +1,58 @@
+/*
+    Mosh: the mobile shell
+    Copyright 2012 Keith Winstein
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    In addition, as a special exception, the copyright holders give
+    permission to link the code of portions of this program with the
+    OpenSSL library under certain conditions as described in each
+    individual source file, and distribute linked combinations including
+    the two.
+
+    You must obey the GNU General Public License in all respects for all
+    of the code used other than OpenSSL. If you modify file(s) with this
+    exception, you may extend this exception to your version of the
+    file(s), but you are not obligated to do so. If you do not wish to do
+    so, delete this exception statement from your version. If you delete
+    this exception statement from all source files in the program, then
+    also delete it here.
+*/
+
+#ifndef BENCH_UTIL_HPP
+#define BENCH_UTIL_HPP
+
+/* Helpers shared by the benchmarks in this directory. */
+
+#include <stdint.h>
+#include <time.h>
+
+#include "fatal_assert.h"
+
+static inline double now_ns( void )
+{
+  struct timespec ts;
+  fatal_assert( 0 == clock_gettime( CLOCK_MONOTONIC, &ts ) );
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* small deterministic generator, so every run sees the same input */
+static inline unsigned int next_random( void )
+{
+  static uint64_t state = 1;
+  state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+  return (unsigned int)( state >> 33 );
+}
+
+#endif
@@ -0,0 +1,242 @@
+/*
+    Mosh: the mobile shell
+    Copyright 2012 Keith Winstein
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    In addition, as a special exception, the copyright holders give
+    permission to link the code of portions of this program with the
+    OpenSSL library under certain conditions as described in each
+    individual source file, and distribute linked combinations including
+    the two.
+
+    You must obey the GNU General Public License in all respects for all
+    of the code used other than OpenSSL. If you modify file(s) with this
+    exception, you may extend this exception to your version of the
+    file(s), but you are not obligated to do so. If you do not wish to do
+    so, delete this exception statement from your version. If you delete
+    this exception statement from all source files in the program, then
+    also delete it here.
+*/
+
+/* Measures how long a Ctrl-C takes to stop a runaway program in a
+   real mosh session over loopback, in the output format of
+   bench-crypto:
+
+     interrupt/<width>x<height> 1 <ms> ms/op
+
+   Each run starts mosh-server with a shell that floods the terminal
+   from base64 /dev/urandom, connects mosh-client on a pty, lets the
+   flood run, then types Ctrl-C and times until the shell's INT trap
+   shows up on the client's screen. The marker goes on a line of its
+   own and uses only characters base64 never prints, so mosh's screen
+   diff can't split it. */
+
+#include "config.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/ioctl.h>
+#include <sys/select.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#if HAVE_PTY_H
+#include <pty.h>
+#elif HAVE_UTIL_H
+#include <util.h>
+#endif
+
+#if FORKPTY_IN_LIBUTIL
+#include <libutil.h>
+#endif
+
+#include "pty_compat.h"
+#include "swrite.h"
+#include "fatal_assert.h"
+
+static const char marker[] = "%#%#%#%#";
+static const char flood[] = "trap 'echo; echo %#%#%#%#; sleep 1; exit' INT; base64 /dev/urandom";
+
+static double now_ms( void )
+{
+  struct timespec ts;
+  fatal_assert( 0 == clock_gettime( CLOCK_MONOTONIC, &ts ) );
+  return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+/* Starts a detached mosh-server; returns its "port key". */
+static bool start_server( const char *server, std::string &port, std::string &key )
+{
+  int fds[ 2 ];
+  fatal_assert( 0 == pipe( fds ) );
+
+  pid_t pid = fork();
+  fatal_assert( pid >= 0 );
+  if ( pid == 0 ) {
+    dup2( fds[ 1 ], STDOUT_FILENO );
+    int null_fd = open( "/dev/null", O_WRONLY );
+    if ( null_fd >= 0 ) {
+      dup2( null_fd, STDERR_FILENO ); /* banner */
+    }
+    close( fds[ 0 ] );
+    close( fds[ 1 ] );
+    execl( server, server, "new", "-i", "127.0.0.1", "--", "/bin/sh", "-c", flood, (char *)NULL );
+    perror( server );
+    _exit( 1 );
+  }
+
+  close( fds[ 1 ] );
+  std::string out;
+  char buf[ 1024 ];
+  ssize_t n;
+  while ( (n = read( fds[ 0 ], buf, sizeof( buf ) )) > 0 ) {
+    out.append( buf, n );
+  }
+  close( fds[ 0 ] );
+  waitpid( pid, NULL, 0 );
+
+  size_t at = out.find( "MOSH CONNECT " );
+  if ( at == std::string::npos ) {
+    return false;
+  }
+  char port_buf[ 16 ], key_buf[ 64 ];
+  if ( sscanf( out.c_str() + at, "MOSH CONNECT %15s %63s", port_buf, key_buf ) != 2 ) {
+    return false;
+  }
+  port = port_buf;
+  key = key_buf;
+  return true;
+}
+
+/* Reads the client's screen for up to timeout ms, keeping the output
+   in screen. Returns false once the client has gone away. */
+static bool drain( int fd, double timeout, std::string &screen )
+{
+  fd_set fds;
+  FD_ZERO( &fds );
+  FD_SET( fd, &fds );
+  struct timeval tv;
+  tv.tv_sec = long( timeout ) / 1000;
+  tv.tv_usec = ( long( timeout ) % 1000 ) * 1000;
+
+  if ( select( fd + 1, &fds, NULL, NULL, &tv ) <= 0 ) {
+    return true;
+  }
+
+  char buf[ 65536 ];
+  ssize_t n = read( fd, buf, sizeof( buf ) );
+  if ( n <= 0 ) {
+    return false;
+  }
+  screen.append( buf, n );
+  return true;
+}
+
+/* One session; returns ms from Ctrl-C to the marker, or -1. */
+static double run( const char *server, const char *client, int width, int height )
+{
+  std::string port, key;
+  if ( !start_server( server, port, key ) ) {
+    fprintf( stderr, "Could not start %s.\n", server );
+    exit( 1 );
+  }
+
+  struct winsize window_size;
+  memset( &window_size, 0, sizeof( window_size ) );
+  window_size.ws_col = width;
+  window_size.ws_row = height;
+
+  int master;
+  pid_t pid = forkpty( &master, NULL, NULL, &window_size );
+  fatal_assert( pid >= 0 );
+  if ( pid == 0 ) {
+    setenv( "MOSH_KEY", key.c_str(), 1 );
+    execl( client, client, "127.0.0.1", port.c_str(), (char *)NULL );
+    perror( client );
+    _exit( 1 );
+  }
+
+  /* let the flood get going */
+  std::string screen;
+  const double flood_start = now_ms();
+  while ( now_ms() < flood_start + 2000 ) {
+    if ( !drain( master, 10, screen ) ) {
+      break;
+    }
+    screen.clear();
+  }
+
+  double elapsed = -1;
+  fatal_assert( swrite( master, "\x03", 1 ) == 0 );
+  const double interrupt = now_ms();
+
+  while ( now_ms() < interrupt + 10000 ) {
+    if ( !drain( master, 1, screen ) ) {
+      break;
+    }
+    if ( elapsed < 0 && screen.find( marker ) != std::string::npos ) {
+      elapsed = now_ms() - interrupt;
+    }
+    if ( screen.size() > 2 * sizeof( marker ) ) {
+      screen.erase( 0, screen.size() - sizeof( marker ) );
+    }
+  }
+
+  close( master );
+  kill( pid, SIGTERM );
+  waitpid( pid, NULL, 0 );
+  return elapsed;
+}
+
+int main( int argc, char *argv[] )
+{
+  if ( argc < 3 ) {
+    fprintf( stderr, "Usage: %s MOSH-SERVER MOSH-CLIENT [runs]\n", argv[ 0 ] );
+    exit( 1 );
+  }
+
+  int runs = 5;
+  if ( argc > 3 ) {
+    runs = atoi( argv[ 3 ] );
+    if ( runs < 1 || runs > 1000 ) {
+      fprintf( stderr, "bogus run count\n" );
+      exit( 1 );
+    }
+  }
+
+  static const int sizes[][ 2 ] = { { 80, 24 }, { 300, 100 } };
+  for ( size_t i = 0; i < sizeof( sizes ) / sizeof( sizes[ 0 ] ); i++ ) {
+    int width = sizes[ i ][ 0 ], height = sizes[ i ][ 1 ];
+    for ( int r = 0; r < runs; r++ ) {
+      double elapsed = run( argv[ 1 ], argv[ 2 ], width, height );
+      if ( elapsed < 0 ) {
+	printf( "interrupt/%dx%d: no response within 10 s\n", width, height );
+      } else {
+	printf( "interrupt/%dx%d 1 %.1f ms/op\n", width, height, elapsed );
+      }
+      fflush( stdout );
+    }
+  }
+
+  return 0;
+}
@@ -0,0 +1,134 @@
+/*
+    Mosh: the mobile shell
+    Copyright 2012 Keith Winstein
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    In addition, as a special exception, the copyright holders give
+    permission to link the code of portions of this program with the
+    OpenSSL library under certain conditions as described in each
+    individual source file, and distribute linked combinations including
+    the two.
+
+    You must obey the GNU General Public License in all respects for all
+    of the code used other than OpenSSL. If you modify file(s) with this
+    exception, you may extend this exception to your version of the
+    file(s), but you are not obligated to do so. If you do not wish to do
+    so, delete this exception statement from your version. If you delete
+    this exception statement from all source files in the program, then
+    also delete it here.
+*/
+
+
+/* Measures local echo prediction while typing and pasting into a
+   terminal whose echo arrives some keystrokes late, in the output
+   format of bench-crypto:
+
+     <benchmark>/<size> <keystrokes> <ns> ns/op
+
+   Each keystroke goes through PredictionEngine::new_user_byte() and a
+   frame: the overlays are applied to a copy of the remote
+   framebuffer, as the client does. */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <deque>
+
+#include "completeterminal.h"
+#include "terminaloverlay.h"
+#include "locale_utils.h"
+#include "bench-util.h"
+
+using namespace Terminal;
+
+/* Types text in bursts of burst keystrokes per frame; the server
+   echoes each burst lag frames later. */
+static void run( const char *name, int width, int height, const std::string &text,
+		 int burst, int lag, int iterations )
+{
+  Complete remote( width, height );
+  Framebuffer frame( width, height );
+  Overlay::OverlayManager overlays;
+  Overlay::PredictionEngine &predictions = overlays.get_prediction_engine();
+  predictions.set_display_preference( Overlay::PredictionEngine::Always );
+
+  std::deque<std::string> in_flight;
+  uint64_t frame_num = 0;
+  size_t pos = 0;
+  unsigned long keystrokes = 0;
+
+  double start = now_ns();
+  for ( int n = 0; n < iterations; n++ ) {
+    /* this frame's keystrokes */
+    std::string sent;
+    for ( int i = 0; i < burst; i++ ) {
+      char ch = text[ pos++ % text.size() ];
+      predictions.new_user_byte( ch, frame );
+      sent += ch;
+      keystrokes++;
+    }
+    frame_num++;
+    predictions.set_local_frame_sent( frame_num );
+    in_flight.push_back( sent );
+
+    /* the echo of an earlier frame arrives */
+    if ( int( in_flight.size() ) > lag ) {
+      remote.act( in_flight.front() == "\r" ? std::string( "\r\n" ) : in_flight.front() );
+      in_flight.pop_front();
+      predictions.set_local_frame_acked( frame_num - lag );
+      predictions.set_local_frame_late_acked( frame_num - lag );
+    }
+
+    frame = remote.get_fb();
+    overlays.apply( frame );
+  }
+  double elapsed = now_ns() - start;
+
+  printf( "%s/%dx%d %lu %.1f ns/op\n", name, width, height, keystrokes, elapsed / keystrokes );
+  fflush( stdout );
+}
+
+int main( int argc, char *argv[] )
+{
+  int iterations = 20000;
+  if ( argc > 1 ) {
+    iterations = atoi( argv[ 1 ] );
+    if ( iterations < 1 || iterations > 1000000000 ) {
+      fprintf( stderr, "bogus iteration count\n" );
+      exit( 1 );
+    }
+  }
+
+  set_native_locale();
+
+  const std::string typing( "the quick brown fox jumps over the lazy dog " );
+  std::string paste;
+  for ( int i = 0; i < 40; i++ ) {
+    paste += "  for ( int i = 0; i < n; i++ ) { total += values[ i ]; }";
+  }
+
+  static const int sizes[][ 2 ] = { { 80, 24 }, { 300, 100 } };
+  for ( size_t i = 0; i < sizeof( sizes ) / sizeof( sizes[ 0 ] ); i++ ) {
+    int width = sizes[ i ][ 0 ], height = sizes[ i ][ 1 ];
+    /* a fast typist on a 200 ms link: one keystroke per frame, 20 in flight */
+    run( "type", width, height, typing, 1, 20, iterations );
+    /* a paste: a long line at once, echoed a few frames later */
+    run( "paste", width, height, paste, 256, 4, iterations / 50 + 1 );
+  }
+
+  return 0;
+}
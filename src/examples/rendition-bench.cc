@@ -0,0 +1,164 @@
+/*
+    Mosh: the mobile shell
+    Copyright 2012 Keith Winstein
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    In addition, as a special exception, the copyright holders give
+    permission to link the code of portions of this program with the
+    OpenSSL library under certain conditions as described in each
+    individual source file, and distribute linked combinations including
+    the two.
+
+    You must obey the GNU General Public License in all respects for all
+    of the code used other than OpenSSL. If you modify file(s) with this
+    exception, you may extend this exception to your version of the
+    file(s), but you are not obligated to do so. If you do not wish to do
+    so, delete this exception statement from your version. If you delete
+    this exception statement from all source files in the program, then
+    also delete it here.
+*/
+
+/* Measures how renditions weigh on the emulator and the display diff,
+   on a few kinds of coloured output at 80x24, in the output format of
+   bench-crypto:
+
+     memory/cell 1 <bytes> bytes
+     act/<kind> <screens> <ns> ns/op
+     diff/<kind> <screens> <ns> ns/op
+     bytes/<kind> <screens> <bytes> bytes
+
+   Each screen is a full repaint of highlighted source text ("palette"
+   with 256-colour escapes, "truecolor" with 24-bit ones) or of a 24-bit
+   colour test in which every cell has its own background
+   ("gradient"). act is the time to interpret one screen; diff and
+   bytes are the time and size of the display update from the
+   previous screen. */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+#include "completeterminal.h"
+#include "terminaldisplay.h"
+#include "locale_utils.h"
+#include "bench-util.h"
+
+using namespace Terminal;
+
+static const int WIDTH = 80, HEIGHT = 24;
+
+static std::string make_screen( const std::string &kind, int n )
+{
+  /* a syntax-highlighting theme: keyword, type, string, comment, number, plain */
+  static const int theme[][ 3 ] = { { 198, 40, 120 }, { 102, 217, 239 }, { 230, 219, 116 },
+				    { 117, 113, 94 }, { 174, 129, 255 }, { 248, 248, 242 } };
+  static const int palette[] = { 161, 81, 186, 101, 141, 231 };
+  static const char *words[] = { "static", "int", "\"text\"", "/* note */", "42", "value",
+				 "return", "std::string", "'c'", "// todo", "0x1f", "frame" };
+
+  std::string out( "\033[H" );
+  char tmp[ 64 ];
+  for ( int y = 0; y < HEIGHT; y++ ) {
+    snprintf( tmp, sizeof( tmp ), "\033[%d;1H", y + 1 );
+    out.append( tmp );
+    if ( kind == "gradient" ) {
+      for ( int x = 0; x < WIDTH; x++ ) {
+	snprintf( tmp, sizeof( tmp ), "\033[48;2;%d;%d;%dm ",
+		  (x * 255 / WIDTH + n) % 256, (y * 255 / HEIGHT) % 256, (255 - x * 3 + n) % 256 );
+	out.append( tmp );
+      }
+      out.append( "\033[m" );
+      continue;
+    }
+
+    int x = 0;
+    while ( x < WIDTH - 12 ) {
+      const int w = next_random() % 12;
+      const int style = w % 6;
+      if ( kind == "truecolor" ) {
+	snprintf( tmp, sizeof( tmp ), "\033[38;2;%d;%d;%dm",
+		  theme[ style ][ 0 ], theme[ style ][ 1 ], theme[ style ][ 2 ] );
+      } else {
+	snprintf( tmp, sizeof( tmp ), "\033[38;5;%dm", palette[ style ] );
+      }
+      out.append( tmp );
+      out.append( words[ w ] );
+      out.append( "\033[m " );
+      x += strlen( words[ w ] ) + 1;
+    }
+    out.append( "\033[K" );
+  }
+  return out;
+}
+
+static void run( const std::string &kind, int screens )
+{
+  std::vector<std::string> input;
+  for ( int i = 0; i < screens; i++ ) {
+    input.push_back( make_screen( kind, i ) );
+  }
+
+  Complete terminal( WIDTH, HEIGHT );
+  const Display display( false );
+  std::vector<Framebuffer> frames;
+  frames.reserve( screens + 1 );
+  frames.push_back( terminal.get_fb() );
+
+  double start = now_ns();
+  for ( int i = 0; i < screens; i++ ) {
+    terminal.act( input[ i ] );
+    frames.push_back( terminal.get_fb() );
+  }
+  double act_ns = now_ns() - start;
+
+  size_t bytes = 0;
+  start = now_ns();
+  for ( int i = 0; i < screens; i++ ) {
+    bytes += display.new_frame( true, frames[ i ], frames[ i + 1 ] ).size();
+  }
+  double diff_ns = now_ns() - start;
+
+  printf( "act/%s %d %.1f ns/op\n", kind.c_str(), screens, act_ns / screens );
+  printf( "diff/%s %d %.1f ns/op\n", kind.c_str(), screens, diff_ns / screens );
+  printf( "bytes/%s %d %lu bytes\n", kind.c_str(), screens, (unsigned long)( bytes / screens ) );
+  fflush( stdout );
+}
+
+int main( int argc, char *argv[] )
+{
+  int screens = 2000;
+  if ( argc > 1 ) {
+    screens = atoi( argv[ 1 ] );
+    if ( screens < 1 || screens > 1000000 ) {
+      fprintf( stderr, "bogus screen count\n" );
+      exit( 1 );
+    }
+  }
+
+  set_native_locale();
+
+  printf( "memory/cell 1 %lu bytes\n", (unsigned long)sizeof( Cell ) );
+
+  static const char *kinds[] = { "palette", "truecolor", "gradient" };
+  for ( size_t i = 0; i < sizeof( kinds ) / sizeof( kinds[ 0 ] ); i++ ) {
+    run( kinds[ i ], screens );
+  }
+
+  return 0;
+}
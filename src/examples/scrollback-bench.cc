@@ -0,0 +1,146 @@
+/*
+    Mosh: the mobile shell
+    Copyright 2012 Keith Winstein
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    In addition, as a special exception, the copyright holders give
+    permission to link the code of portions of this program with the
+    OpenSSL library under certain conditions as described in each
+    individual source file, and distribute linked combinations including
+    the two.
+
+    You must obey the GNU General Public License in all respects for all
+    of the code used other than OpenSSL. If you modify file(s) with this
+    exception, you may extend this exception to your version of the
+    file(s), but you are not obligated to do so. If you do not wish to do
+    so, delete this exception statement from your version. If you delete
+    this exception statement from all source files in the program, then
+    also delete it here.
+*/
+
+/* Measures the server's scrollback store on a few kinds of output,
+   100,000 lines each, at 80x24, in the output format of bench-crypto:
+
+     memory/<kind> <lines> <bytes> bytes
+     push/<kind> <lines> <ns> ns/op
+     fetch/<kind> <pages> <ns> ns/op
+
+   push is the time per line through the emulator, scrollback
+   included; base/<kind> is the same without scrollback. fetch reads a
+   screenful from a random place in the history. */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+
+#include "completeterminal.h"
+#include "terminalscrollback.h"
+#include "locale_utils.h"
+#include "fatal_assert.h"
+#include "bench-util.h"
+
+using namespace Terminal;
+
+static const int WIDTH = 80, HEIGHT = 24;
+
+static std::string make_output( const std::string &kind, int lines )
+{
+  static const char *levels[] = { "\033[32mINFO\033[m", "\033[33mWARN\033[m", "\033[1;31mERROR\033[m" };
+  static const char *dirs[] = { "frontend", "network", "statesync", "terminal", "util" };
+  static const char base64[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+  std::string out;
+  char line[ 256 ];
+  for ( int i = 0; i < lines; i++ ) {
+    if ( kind == "seq" ) {
+      snprintf( line, sizeof( line ), "%d\r\n", i + 1 );
+    } else if ( kind == "log" ) {
+      snprintf( line, sizeof( line ), "2026-10-18 12:%02d:%02d.%03d [%s] request %08x served in %u ms\r\n",
+		(i / 60000) % 60, (i / 1000) % 60, i % 1000, levels[ next_random() % 3 ],
+		next_random(), next_random() % 500 );
+    } else if ( kind == "build" ) {
+      snprintf( line, sizeof( line ), "  CXX      %s/file%u.o\r\n",
+		dirs[ next_random() % 5 ], next_random() % 200 );
+    } else { /* random */
+      for ( int j = 0; j < WIDTH - 4; j++ ) {
+	line[ j ] = base64[ next_random() % 64 ];
+      }
+      snprintf( line + WIDTH - 4, 8, "\r\n" );
+    }
+    out.append( line );
+  }
+  return out;
+}
+
+static void run( const std::string &kind, int lines, int pages )
+{
+  const std::string output( make_output( kind, lines ) );
+  const size_t chunk = 4096; /* as a pty read would deliver it */
+
+  Complete base( WIDTH, HEIGHT );
+  double start = now_ns();
+  for ( size_t pos = 0; pos < output.size(); pos += chunk ) {
+    base.act( output.substr( pos, chunk ) );
+  }
+  double base_ns = now_ns() - start;
+
+  Complete terminal( WIDTH, HEIGHT );
+  terminal.set_scrollback( size_t( 1 ) << 30 ); /* large enough to keep everything */
+  start = now_ns();
+  for ( size_t pos = 0; pos < output.size(); pos += chunk ) {
+    terminal.act( output.substr( pos, chunk ) );
+  }
+  double push_ns = now_ns() - start;
+
+  const Scrollback &scrollback = *terminal.get_fb().get_scrollback();
+  const uint64_t stored = scrollback.get_end_line() - scrollback.get_first_line();
+
+  start = now_ns();
+  for ( int i = 0; i < pages; i++ ) {
+    const uint64_t end = scrollback.get_first_line() + HEIGHT + next_random() % (stored - HEIGHT);
+    fatal_assert( scrollback.get_lines( end - HEIGHT, end ).size() == size_t( HEIGHT ) );
+  }
+  double fetch_ns = now_ns() - start;
+
+  printf( "memory/%s %llu %lu bytes\n", kind.c_str(), (unsigned long long)stored,
+	  (unsigned long)scrollback.memory_usage() );
+  printf( "base/%s %d %.1f ns/op\n", kind.c_str(), lines, base_ns / lines );
+  printf( "push/%s %d %.1f ns/op\n", kind.c_str(), lines, push_ns / lines );
+  printf( "fetch/%s %d %.1f ns/op\n", kind.c_str(), pages, fetch_ns / pages );
+  fflush( stdout );
+}
+
+int main( int argc, char *argv[] )
+{
+  int lines = 100000;
+  if ( argc > 1 ) {
+    lines = atoi( argv[ 1 ] );
+    if ( lines < 1000 || lines > 100000000 ) {
+      fprintf( stderr, "bogus line count\n" );
+      exit( 1 );
+    }
+  }
+
+  set_native_locale();
+
+  static const char *kinds[] = { "seq", "log", "build", "random" };
+  for ( size_t i = 0; i < sizeof( kinds ) / sizeof( kinds[ 0 ] ); i++ ) {
+    run( kinds[ i ], lines, 1000 );
+  }
+
+  return 0;
+}
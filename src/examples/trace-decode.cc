@@ -0,0 +1,121 @@
+/*
+    Mosh: the mobile shell
+    Copyright 2012 Keith Winstein
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    In addition, as a special exception, the copyright holders give
+    permission to link the code of portions of this program with the
+    OpenSSL library under certain conditions as described in each
+    individual source file, and distribute linked combinations including
+    the two.
+
+    You must obey the GNU General Public License in all respects for all
+    of the code used other than OpenSSL. If you modify file(s) with this
+    exception, you may extend this exception to your version of the
+    file(s), but you are not obligated to do so. If you do not wish to do
+    so, delete this exception statement from your version. If you delete
+    this exception statement from all source files in the program, then
+    also delete it here.
+*/
+
+/* Print a trace dumped by a frontend run with MOSH_TRACE set, one
+   event per line. Times are in milliseconds since the first event. */
+
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "trace.h"
+
+static void print_event( const trace_event &e, uint64_t start )
+{
+  printf( "%12.3f ", double( e.time - start ) / 1000.0 );
+
+  switch ( e.type ) {
+  case TRACE_PACKET_SENT:
+    printf( "packet sent     flow %u seq %" PRIu64 " len %u\n", e.flow, e.a, e.len );
+    break;
+  case TRACE_PACKET_RECEIVED:
+    printf( "packet received flow %u seq %" PRIu64 " len %u\n", e.flow, e.a, e.len );
+    break;
+  case TRACE_RTT:
+    printf( "rtt             flow %u rtt %.3fms srtt %.3fms\n", e.flow, e.a / 1000.0, e.b / 1000.0 );
+    break;
+  case TRACE_STATE_SENT:
+    printf( "state sent      [%" PRIu64 "=>%" PRIu64 "] ack %" PRIu64 " throwaway %" PRIu64 " fragments %u\n",
+	    e.a, e.b, e.c, e.d, e.len );
+    break;
+  case TRACE_FRAGMENT_SENT:
+    printf( "fragment sent   [=>%" PRIu64 "] id %" PRIu64 " frag %" PRIu64 " len %u\n", e.a, e.b, e.c, e.len );
+    break;
+  case TRACE_STATE_RECEIVED:
+  case TRACE_STATE_OUT_OF_ORDER:
+  case TRACE_STATE_DISCARDED:
+    printf( "%s [%" PRIu64 "=>%" PRIu64 "] ack %" PRIu64 " throwaway %" PRIu64 "\n",
+	    e.type == TRACE_STATE_RECEIVED ? "state received "
+	    : e.type == TRACE_STATE_OUT_OF_ORDER ? "state reordered"
+	    : "state discarded",
+	    e.a, e.b, e.c, e.d );
+    break;
+  case TRACE_ACK:
+    printf( "ack             %" PRIu64 "\n", e.a );
+    break;
+  default:
+    printf( "unknown event %u\n", e.type );
+    break;
+  }
+}
+
+int main( int argc, char *argv[] )
+{
+  if ( argc != 2 ) {
+    fprintf( stderr, "Usage: %s TRACE\n", argv[ 0 ] );
+    return 1;
+  }
+
+  FILE *f = fopen( argv[ 1 ], "rb" );
+  if ( !f ) {
+    perror( argv[ 1 ] );
+    return 1;
+  }
+
+  trace_header header;
+  if ( fread( &header, sizeof( header ), 1, f ) != 1
+       || memcmp( header.magic, TRACE_MAGIC, sizeof( header.magic ) ) != 0
+       || header.event_size != sizeof( trace_event ) ) {
+    fprintf( stderr, "%s: not a trace from this build of mosh\n", argv[ 1 ] );
+    return 1;
+  }
+
+  if ( header.total > header.count ) {
+    printf( "(%" PRIu64 " earlier events overwritten)\n", header.total - header.count );
+  }
+
+  trace_event e;
+  uint64_t start = 0;
+  for ( uint32_t i = 0; i < header.count; i++ ) {
+    if ( fread( &e, sizeof( e ), 1, f ) != 1 ) {
+      fprintf( stderr, "%s: truncated after %u events\n", argv[ 1 ], i );
+      return 1;
+    }
+    if ( i == 0 ) {
+      start = e.time;
+    }
+    print_event( e, start );
+  }
+
+  fclose( f );
+  return 0;
+}
@@ -77,7 +77,7 @@ static void usage( const char *argv0 ) {
   fprintf( stderr, "License GPLv3+: GNU GPL version 3 or later <http://gnu.org/licenses/gpl.html>.\nThis is free software: you are free to change and redistribute it.\nThere is NO WARRANTY, to the extent permitted by law.\n\n" );
 
   fprintf( stderr,
-	   "Usage: %s [-f <logfile>] [-d <debug-level>] [-m <loss-tolerance>] [-w] IP PORT\n"
+	   "Usage: %s [-f <logfile>] [-d <debug-level>] [-m <loss-tolerance>] [-S <scheduler>] [-r <frames/s>] [-w] IP PORT\n"
 	   "       %s -c\n", argv0, argv0 );
 }
 
@@ -103,6 +103,8 @@ int main( int argc, char *argv[] )
 #endif
 {
   int loss_ratio_tolerance = 0;
+  Network::SchedulerPolicy scheduler = Network::SCHEDULER_REDUNDANT;
+  int max_frame_rate = 60;
 
   /* For security, make sure we don't dump core */
   Crypto::disable_dumping_core();
@@ -112,7 +114,7 @@ int main( int argc, char *argv[] )
 
   /* Get arguments */
   int opt;
-  while ( (opt = getopt( argc, argv, "cwd:f:m:" )) != -1 ) {
+  while ( (opt = getopt( argc, argv, "cwd:f:m:r:S:" )) != -1 ) {
     switch ( opt ) {
     case 'c':
       print_colorcount();
@@ -138,6 +140,19 @@ int main( int argc, char *argv[] )
       case 'm':
 	loss_ratio_tolerance = atoi( optarg );
 	break;
+      case 'r':
+	max_frame_rate = atoi( optarg );
+	if ( max_frame_rate < 0 ) {
+	  usage( argv[ 0 ] );
+	  exit( 1 );
+	}
+	break;
+      case 'S':
+	if ( !Network::Connection::parse_scheduler( optarg, scheduler ) ) {
+	  usage( argv[ 0 ] );
+	  exit( 1 );
+	}
+	break;
     default:
       usage( argv[ 0 ] );
       exit( 1 );
@@ -189,7 +204,7 @@ int main( int argc, char *argv[] )
   set_native_locale();
 
   try {
-    STMClient client( ip, desired_port, key, predict_mode, loss_ratio_tolerance );
+    STMClient client( ip, desired_port, key, predict_mode, loss_ratio_tolerance, scheduler, max_frame_rate );
     client.init();
 
     try {
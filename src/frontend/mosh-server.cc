@@ -40,6 +40,7 @@
 #include <termios.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/ioctl.h>
@@ -51,6 +52,7 @@
 #include <utempter.h>
 #endif
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <netdb.h>
 #include <time.h>
 #include <sys/stat.h>
@@ -83,6 +85,8 @@
 #include "timestamp.h"
 #include "fatal_assert.h"
 #include "logger.h"
+#include "trace.h"
+#include "metrics.h"
 
 #ifndef _PATH_BSHELL
 #define _PATH_BSHELL "/bin/sh"
@@ -94,18 +98,21 @@ typedef Network::Transport< Terminal::Complete, Network::UserStream > ServerConn
 
 static void serve( int host_fd,
 		   Terminal::Complete &terminal,
-		   ServerConnection &network );
+		   ServerConnection &network,
+		   int metrics_fd );
 
 static int run_server( const char *desired_ip, const char *desired_port,
 		       const string &command_path, char *command_argv[],
-		       const int colors, bool verbose, bool with_motd, bool detach, int loss_ratio_tolerance );
+		       const int colors, bool verbose, bool with_motd, bool detach, int loss_ratio_tolerance,
+		       Network::SchedulerPolicy scheduler, bool fast_forward, int scrollback_megabytes,
+		       const char *metrics_path );
 
 using namespace std;
 
 static void print_usage( const char *argv0 )
 {
   fprintf( stderr, "Usage: %s new [-s] [-v] [-i LOCALADDR] [-p PORT[:PORT2]] [-c COLORS] [-l NAME=VALUE] [-a] "
-           "[-f <logfile>] [-d <debug-level>] [-m <loss-tolerance>] [-- COMMAND...]\n"
+           "[-f <logfile>] [-d <debug-level>] [-m <loss-tolerance>] [-S <scheduler>] [-F] [-H <megabytes>] [-M <socket>] [-- COMMAND...]\n"
 	   "       %s new -e\n", argv0, argv0 );
 }
 
@@ -113,6 +120,7 @@ static void print_motd( void );
 static void chdir_homedir( void );
 static bool motd_hushed( void );
 static void warn_unattached( const string & ignore_entry );
+static int open_metrics_socket( const char *path );
 
 /* Simple spinloop */
 static void spin( void )
@@ -174,6 +182,10 @@ int main( int argc, char *argv[] )
   list<string> locale_vars;
   bool detach = true;
   int loss_ratio_tolerance = 0;
+  Network::SchedulerPolicy scheduler = Network::SCHEDULER_REDUNDANT;
+  bool fast_forward = false;
+  int scrollback_megabytes = 0;
+  const char *metrics_path = NULL;
 
   /* strip off command */
   for ( int i = 0; i < argc; i++ ) {
@@ -191,7 +203,7 @@ int main( int argc, char *argv[] )
        && (strcmp( argv[ 1 ], "new" ) == 0) ) {
     /* new option syntax */
     int opt;
-    while ( (opt = getopt( argc - 1, argv + 1, "aei:p:c:svl:d:f:m:" )) != -1 ) {
+    while ( (opt = getopt( argc - 1, argv + 1, "aei:p:c:svl:d:f:m:S:FH:M:" )) != -1 ) {
       switch ( opt ) {
       case 'a':
 	detach = false;
@@ -237,12 +249,39 @@ int main( int argc, char *argv[] )
       case 'm':
 	loss_ratio_tolerance = atoi( optarg );
 	break;
+      case 'S':
+	if ( !Connection::parse_scheduler( optarg, scheduler ) ) {
+	  print_usage( argv[ 0 ] );
+	  exit( 1 );
+	}
+	break;
+      case 'F':
+	fast_forward = true;
+	break;
+      case 'H':
+	try {
+	  scrollback_megabytes = myatoi( optarg );
+	} catch ( const CryptoException & ) {
+	  scrollback_megabytes = -1;
+	}
+	if ( scrollback_megabytes < 0 ) {
+	  fprintf( stderr, "%s: Bad scrollback size (%s)\n", argv[ 0 ], optarg );
+	  print_usage( argv[ 0 ] );
+	  exit( 1 );
+	}
+	break;
+      case 'M':
+	metrics_path = optarg;
+	break;
       case 'e':
 	printf( "mosh-server (%s) [build %s]\n", PACKAGE_STRING, BUILD_VERSION );
 	/* list of supported extensions and options: */
 	printf( "  standard eipcsvl\n"
 		"  debug adf\n"
-		"  multipath m\n" );
+		"  multipath mS\n"
+		"  fastforward F\n"
+		"  scrollback H\n"
+		"  metrics M\n" );
 	exit(0);
 	break;
       default:
@@ -351,7 +390,7 @@ int main( int argc, char *argv[] )
 
   try {
     return run_server( desired_ip, desired_port, command_path, command_argv, colors, verbose, with_motd, detach,
-		       loss_ratio_tolerance );
+		       loss_ratio_tolerance, scheduler, fast_forward, scrollback_megabytes, metrics_path );
   } catch ( const Network::NetworkException &e ) {
     fprintf( stderr, "Network exception: %s\n",
 	     e.what() );
@@ -365,7 +404,9 @@ int main( int argc, char *argv[] )
 
 static int run_server( const char *desired_ip, const char *desired_port,
 		       const string &command_path, char *command_argv[],
-		       const int colors, bool verbose, bool with_motd, bool detach, int loss_ratio_tolerance ) {
+		       const int colors, bool verbose, bool with_motd, bool detach, int loss_ratio_tolerance,
+		       Network::SchedulerPolicy scheduler, bool fast_forward, int scrollback_megabytes,
+		       const char *metrics_path ) {
   /* get initial window size */
   struct winsize window_size;
   if ( ioctl( STDIN_FILENO, TIOCGWINSZ, &window_size ) < 0 ||
@@ -382,15 +423,29 @@ static int run_server( const char *desired_ip, const char *desired_port,
 
   /* open parser and terminal */
   Terminal::Complete terminal( window_size.ws_col, window_size.ws_row );
+  terminal.set_fast_forward( fast_forward );
+  if ( scrollback_megabytes > 0 ) {
+    terminal.set_scrollback( size_t( scrollback_megabytes ) << 20 );
+  }
 
   /* open network */
   Network::UserStream blank;
   ServerConnection *network = new ServerConnection( terminal, blank, desired_ip, desired_port, loss_ratio_tolerance );
 
+  network->set_scheduler( scheduler );
+
   if ( verbose ) {
     network->set_verbose();
   }
 
+  int metrics_fd = -1;
+  if ( metrics_path ) {
+    metrics_fd = open_metrics_socket( metrics_path );
+    if ( metrics_fd < 0 ) {
+      exit( 1 );
+    }
+  }
+
   printf( "\nMOSH CONNECT %s %s\n", network->port().c_str(), network->get_key().c_str() );
   fflush( stdout );
 
@@ -533,7 +588,7 @@ static int run_server( const char *desired_ip, const char *desired_port,
 #endif
 
     try {
-      serve( master, terminal, *network );
+      serve( master, terminal, *network, metrics_fd );
     } catch ( const Network::NetworkException &e ) {
       fprintf( stderr, "Network exception: %s\n",
 	       e.what() );
@@ -552,6 +607,11 @@ static int run_server( const char *desired_ip, const char *desired_port,
     }
 
     delete network;
+
+    if ( metrics_fd >= 0 ) {
+      close( metrics_fd );
+      unlink( metrics_path );
+    }
   }
 
   printf( "\n[mosh-server is exiting.]\n" );
@@ -559,14 +619,129 @@ static int run_server( const char *desired_ip, const char *desired_port,
   return 0;
 }
 
-static void serve( int host_fd, Terminal::Complete &terminal, ServerConnection &network )
+/* Is there something to read on fd right now? */
+static bool readable_now( int fd )
+{
+  struct pollfd pfd;
+  pfd.fd = fd;
+  pfd.events = POLLIN;
+  pfd.revents = 0;
+
+  return ( poll( &pfd, 1, 0 ) == 1 ) && ( pfd.revents & POLLIN );
+}
+
+static bool any_readable_now( const std::vector< int > &fds )
+{
+  for ( std::vector< int >::const_iterator it = fds.begin();
+	it != fds.end();
+	it++ ) {
+    if ( readable_now( *it ) ) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/* The metrics page is served on a unix socket: each connection gets
+   one snapshot, and the socket is closed. Nothing is gathered until
+   someone connects, but the pipeline stages are timed from now on. */
+static int open_metrics_socket( const char *path )
+{
+  struct sockaddr_un addr;
+  memset( &addr, 0, sizeof( addr ) );
+  addr.sun_family = AF_UNIX;
+  if ( strlen( path ) >= sizeof( addr.sun_path ) ) {
+    fprintf( stderr, "Metrics socket path too long (%s)\n", path );
+    return -1;
+  }
+  strcpy( addr.sun_path, path );
+
+  int fd = socket( AF_UNIX, SOCK_STREAM, 0 );
+  if ( fd < 0 ) {
+    perror( "socket" );
+    return -1;
+  }
+
+  /* replace the socket of an earlier server, but nothing else */
+  struct stat st;
+  if ( (lstat( path, &st ) == 0) && S_ISSOCK( st.st_mode ) ) {
+    unlink( path );
+  }
+
+  if ( (bind( fd, (struct sockaddr *)&addr, sizeof( addr ) ) < 0)
+       || (listen( fd, 4 ) < 0)
+       || (fcntl( fd, F_SETFL, O_NONBLOCK ) < 0)
+       || (fcntl( fd, F_SETFD, FD_CLOEXEC ) < 0) ) {
+    perror( path );
+    close( fd );
+    return -1;
+  }
+
+  metrics_timing = true;
+  return fd;
+}
+
+static void serve_metrics( int metrics_fd, const ServerConnection &network, uint64_t host_bytes )
+{
+  int fd = accept( metrics_fd, NULL, NULL );
+  if ( fd < 0 ) {
+    return;
+  }
+
+  Metrics metrics;
+  network.write_metrics( metrics );
+
+  metrics.family( "mosh_host_bytes_total", "counter", "Bytes of host output fed to the terminal emulator." );
+  metrics.sample( "mosh_host_bytes_total", host_bytes );
+
+  static const char *stage_names[ STAGE_COUNT ] = { "parse", "diff", "compress", "crypto" };
+  metrics.family( "mosh_stage_seconds_total", "counter", "Time spent in each stage of the pipeline." );
+  for ( int i = 0; i < STAGE_COUNT; i++ ) {
+    metrics.sample( "mosh_stage_seconds_total", "stage", stage_names[ i ], metrics_stage_ns[ i ] / 1e9 );
+  }
+
+  /* the page fits in the socket buffer; a reader that is not
+     there yet gets nothing rather than stalling the session */
+  fcntl( fd, F_SETFL, O_NONBLOCK );
+  if ( write( fd, metrics.str().data(), metrics.str().size() ) < 0 ) {
+    /* don't report */
+  }
+  close( fd );
+}
+
+/* Each pass of the loop below takes all user input that has arrived
+   before touching host output. Host output is then parsed only until
+   the budget runs out, the transport has a frame due, or more user
+   input shows up, so neither keystrokes nor ticks wait behind a
+   runaway program. Whatever host output is left stays in the pty and
+   select() hands it back to us at once.
+
+   Host output is read in chunks no larger than what a Linux pty hands
+   over per read() anyway, so one chunk parses in about a millisecond
+   even for a full-screen redraw, and a keystroke that arrives mid-pass
+   waits for at most the budget plus one chunk plus a tick. */
+static const int MAX_DATAGRAMS_PER_PASS = 64;
+static const uint64_t HOST_OUTPUT_BUDGET = 2; /* ms */
+static const int HOST_OUTPUT_CHUNK = 4096;
+
+static void serve( int host_fd, Terminal::Complete &terminal, ServerConnection &network, int metrics_fd )
 {
   /* prepare to poll for events */
   Select &sel = Select::get_instance();
   sel.add_signal( SIGTERM );
   sel.add_signal( SIGINT );
 
+  const char *trace_path = getenv( "MOSH_TRACE" );
+  if ( trace_path && trace_init( trace_path ) ) {
+    sel.add_signal( SIGUSR1 );
+  }
+
   uint64_t last_remote_num = network.get_remote_state_num();
+  uint64_t host_bytes = 0;
+
+  /* the client is sent snapshots of the live terminal, taken when
+     there's a new frame to send */
+  network.track_current_state( terminal );
 
   #ifdef HAVE_UTEMPTER
   bool connected_utmp = false;
@@ -598,6 +773,13 @@ static void serve( int host_fd, Terminal::Complete &terminal, ServerConnection &
       if ( !network.shutdown_in_progress() ) {
 	sel.add_fd( host_fd );
       }
+      int addresses_fd = network.host_addresses_fd();
+      if ( addresses_fd >= 0 ) {
+	sel.add_fd( addresses_fd );
+      }
+      if ( metrics_fd >= 0 ) {
+	sel.add_fd( metrics_fd );
+      }
 
       int active_fds = sel.select( timeout );
       if ( active_fds < 0 ) {
@@ -612,8 +794,11 @@ static void serve( int host_fd, Terminal::Complete &terminal, ServerConnection &
 	    it != fd_list.end();
 	    it++ ) {
 	if ( sel.read( *it ) ) {
-	  /* packet received from the network */
-	  network.recv();
+	  /* packets received from the network */
+	  int datagrams = 0;
+	  do {
+	    network.recv();
+	  } while ( (++datagrams < MAX_DATAGRAMS_PER_PASS) && readable_now( *it ) );
 
 	  /* is new user input available for the terminal? */
 	  if ( network.get_remote_state_num() != last_remote_num ) {
@@ -624,19 +809,25 @@ static void serve( int host_fd, Terminal::Complete &terminal, ServerConnection &
 	    Network::UserStream us;
 	    us.apply_string( network.get_remote_diff() );
 	    /* apply userstream to terminal */
-	    for ( size_t i = 0; i < us.size(); i++ ) {
-	      const Parser::Action *action = us.get_action( i );
-	      terminal_to_host += terminal.act( action );
-	      if ( typeid( *action ) == typeid( Parser::Resize ) ) {
+	    terminal_to_host += terminal.act_user_input( us.get_keys().data(), us.get_keys().size() );
+
+	    /* Of a batch of resizes, only the last size matters: the
+	       child hears of it once, and the terminal is redrawn once. */
+	    if ( us.resize_count() > 0 ) {
+	      const Network::UserResize &res = us.get_resize( us.resize_count() - 1 );
+	      if ( (res.width != terminal.get_fb().ds.get_width())
+		   || (res.height != terminal.get_fb().ds.get_height()) ) {
+		Parser::Resize resize_action( res.width, res.height );
+		terminal_to_host += terminal.act( &resize_action );
+
 		/* tell child process of resize */
-		const Parser::Resize *res = static_cast<const Parser::Resize *>( us.get_action( i ) );
 		struct winsize window_size;
 		if ( ioctl( host_fd, TIOCGWINSZ, &window_size ) < 0 ) {
 		  perror( "ioctl TIOCGWINSZ" );
 		  return;
 		}
-		window_size.ws_col = res->width;
-		window_size.ws_row = res->height;
+		window_size.ws_col = res.width;
+		window_size.ws_row = res.height;
 		if ( ioctl( host_fd, TIOCSWINSZ, &window_size ) < 0 ) {
 		  perror( "ioctl TIOCSWINSZ" );
 		  return;
@@ -644,16 +835,16 @@ static void serve( int host_fd, Terminal::Complete &terminal, ServerConnection &
 	      }
 	    }
 
+	    for ( size_t i = 0; i < us.history_request_count(); i++ ) {
+	      const Network::UserHistoryRequest &request = us.get_history_request( i );
+	      terminal.act_history_request( request.id, request.end, request.count );
+	    }
+
 	    if ( !us.empty() ) {
 	      /* register input frame number for future echo ack */
 	      terminal.register_input_frame( last_remote_num, now );
 	    }
 
-	    /* update client with new state of terminal */
-	    if ( !network.shutdown_in_progress() ) {
-	      network.set_current_state( terminal );
-	    }
-
 	    /* write any writeback octets back to the host */
 	    if ( swrite( host_fd, terminal_to_host.c_str(), terminal_to_host.length() ) < 0 ) {
 	      break;
@@ -694,32 +885,64 @@ static void serve( int host_fd, Terminal::Complete &terminal, ServerConnection &
 	}
       }
 
+      if ( addresses_fd >= 0 && sel.read( addresses_fd ) ) {
+	/* tell the client about our new addresses */
+	network.process_host_addresses();
+      }
+
       if ( (!network.shutdown_in_progress()) && sel.read( host_fd ) ) {
 	/* input from the host needs to be fed to the terminal */
-	const int buf_size = 16384;
-	char buf[ buf_size ];
-	
-	/* fill buffer if possible */
-	ssize_t bytes_read = read( host_fd, buf, buf_size );
-
-        /* If the pty slave is closed, reading from the master can fail with
-           EIO (see #264).  So we treat errors on read() like EOF. */
-        if ( bytes_read <= 0 ) {
-	  network.start_shutdown();
-	} else {
+	char buf[ HOST_OUTPUT_CHUNK ];
+	bool host_problem = false;
+
+	const uint64_t host_deadline = now + min( HOST_OUTPUT_BUDGET, uint64_t( network.wait_time() ) );
+
+	while ( 1 ) {
+	  /* fill buffer if possible */
+	  ssize_t bytes_read = read( host_fd, buf, sizeof( buf ) );
+
+	  /* If the pty slave is closed, reading from the master can fail with
+	     EIO (see #264).  So we treat errors on read() like EOF. */
+	  if ( bytes_read <= 0 ) {
+	    network.start_shutdown();
+	    break;
+	  }
+
+	  StageTimer parse_timer( STAGE_PARSE );
 	  string terminal_to_host = terminal.act( string( buf, bytes_read ) );
-	
-	  /* update client with new state of terminal */
-	  network.set_current_state( terminal );
+	  parse_timer.stop();
+	  host_bytes += bytes_read;
 
 	  /* write any writeback octets back to the host */
 	  if ( swrite( host_fd, terminal_to_host.c_str(), terminal_to_host.length() ) < 0 ) {
+	    host_problem = true;
+	    break;
+	  }
+
+	  /* keep going only while we are behind the host and nothing
+	     more urgent is waiting */
+	  freeze_timestamp();
+	  if ( (frozen_timestamp() >= host_deadline)
+	       || any_readable_now( fd_list )
+	       || (!readable_now( host_fd )) ) {
 	    break;
 	  }
 	}
+
+	if ( host_problem ) {
+	  break;
+	}
+      }
+
+      if ( metrics_fd >= 0 && sel.read( metrics_fd ) ) {
+	serve_metrics( metrics_fd, network, host_bytes );
+      }
+
+      if ( sel.signal( SIGUSR1 ) ) {
+	trace_dump();
       }
 
-      if ( sel.any_signal() ) {
+      if ( sel.signal( SIGTERM ) || sel.signal( SIGINT ) ) {
 	/* shutdown signal */
 	if ( network.has_remote_addr() && (!network.shutdown_in_progress()) ) {
 	  network.start_shutdown();
@@ -767,12 +990,8 @@ static void serve( int host_fd, Terminal::Complete &terminal, ServerConnection &
       }
       #endif
 
-      if ( terminal.set_echo_ack( now ) ) {
-	/* update client with new echo ack */
-	if ( !network.shutdown_in_progress() ) {
-	  network.set_current_state( terminal );
-	}
-      }
+      /* update client with new echo ack */
+      terminal.set_echo_ack( now );
 
       if ( !network.get_remote_state_num()
            && time_since_remote_state >= uint64_t( timeout_if_no_client ) ) {
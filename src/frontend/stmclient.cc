@@ -59,6 +59,7 @@
 #include "pty_compat.h"
 #include "select.h"
 #include "timestamp.h"
+#include "trace.h"
 
 #include "networktransport.cc"
 
@@ -185,7 +186,7 @@ void STMClient::init( void )
     wstring escape_pass_name = std::wstring(tmp.begin(), tmp.end());
     tmp = string( escape_key_name_buf );
     wstring escape_key_name = std::wstring(tmp.begin(), tmp.end());
-    escape_key_help = L"Commands: Ctrl-Z suspends, \".\" quits, " + escape_pass_name + L" gives literal " + escape_key_name;
+    escape_key_help = L"Commands: Ctrl-Z suspends, \".\" quits, \"[\" scrolls back, " + escape_pass_name + L" gives literal " + escape_key_name;
     overlays.get_notification_engine().set_escape_key_string( tmp );
   }
   wchar_t tmp[ 128 ];
@@ -230,6 +231,11 @@ void STMClient::main_init( void )
   sel.add_signal( SIGPIPE );
   sel.add_signal( SIGCONT );
 
+  const char *trace_path = getenv( "MOSH_TRACE" );
+  if ( trace_path && trace_init( trace_path ) ) {
+    sel.add_signal( SIGUSR1 );
+  }
+
   /* get initial window size */
   if ( ioctl( STDIN_FILENO, TIOCGWINSZ, &window_size ) < 0 ) {
     perror( "ioctl TIOCGWINSZ" );
@@ -252,6 +258,7 @@ void STMClient::main_init( void )
 									       loss_ratio_tolerance );
 
   network->set_send_delay( 1 ); /* minimal delay on outgoing keystrokes */
+  network->set_scheduler( scheduler );
 
   /* tell server the size of the terminal */
   network->get_current_state().push_back( Parser::Resize( window_size.ws_col, window_size.ws_row ) );
@@ -265,6 +272,9 @@ void STMClient::output_new_frame( void )
 
   /* fetch target state */
   *new_state = network->get_latest_remote_state().state.get_fb();
+  if ( history_mode ) {
+    draw_history( *new_state );
+  }
 
   /* apply local overlays */
   overlays.apply( *new_state );
@@ -280,12 +290,30 @@ void STMClient::output_new_frame( void )
 
   repaint_requested = false;
 
+  /* remember what this frame was made from */
+  last_frame_time = timestamp();
+  last_frame_state_num = network->get_remote_state_num();
+  last_frame_overlays = overlays.active();
+  window_resized = false;
+  frame_deferred = false;
+
   /* switch pointers */
   Terminal::Framebuffer *tmp = new_state;
   new_state = local_framebuffer;
   local_framebuffer = tmp;
 }
 
+/* Whether the screen may differ from the last frame painted. Timers and
+   acks alone do not change it, unless overlays are, or were, drawn. */
+bool STMClient::frame_needed( void ) const
+{
+  return repaint_requested
+    || window_resized
+    || network->get_remote_state_num() != last_frame_state_num
+    || last_frame_overlays
+    || overlays.active();
+}
+
 void STMClient::process_network_input( void )
 {
   network->recv();
@@ -299,6 +327,157 @@ void STMClient::process_network_input( void )
   overlays.get_prediction_engine().set_local_frame_late_acked( network->get_latest_remote_state().state.get_echo_ack() );
 }
 
+/* The newest page of scrollback fetched since history mode began. */
+const Terminal::HistoryPage *STMClient::history_page( void ) const
+{
+  const Terminal::HistoryPage *page = network->get_latest_remote_state().state.get_history();
+  if ( page && (page->id > history_first_id) ) {
+    return page;
+  }
+  return NULL;
+}
+
+void STMClient::request_history( uint64_t end )
+{
+  /* the top row is taken by the notification bar */
+  const unsigned int count = ( window_size.ws_row > 1 ) ? window_size.ws_row - 1 : 1;
+
+  history_end = end;
+  network->get_current_state().push_back( Network::UserHistoryRequest( ++history_request_id, end, count ) );
+}
+
+void STMClient::start_history( void )
+{
+  history_mode = true;
+  history_first_id = history_request_id;
+  history_keys.clear();
+  overlays.get_prediction_engine().reset();
+  request_history( 0 );
+}
+
+void STMClient::stop_history( void )
+{
+  history_mode = false;
+  overlays.get_notification_engine().set_notification_string( L"" );
+}
+
+/* Move the view by the given number of lines, back if negative.
+   Moving forward from the newest lines ends history mode. */
+void STMClient::scroll_history( int lines )
+{
+  const Terminal::HistoryPage *page = history_page();
+  if ( !page ) {
+    return; /* nothing to scroll until the first page is here */
+  }
+
+  const int64_t end = history_end ? history_end : page->start + page->lines.size();
+  if ( (lines > 0) && (uint64_t( end ) >= page->end_line) ) {
+    stop_history();
+    return;
+  }
+
+  const int64_t page_lines = ( window_size.ws_row > 1 ) ? window_size.ws_row - 1 : 1;
+  const int64_t lowest = min( page->first_line + page_lines, page->end_line );
+  const int64_t new_end = max( lowest, min( end + lines, int64_t( page->end_line ) ) );
+
+  if ( new_end != end ) {
+    request_history( new_end );
+  }
+}
+
+void STMClient::process_history_input( const char *buf, ssize_t len )
+{
+  const int page_lines = ( window_size.ws_row > 2 ) ? window_size.ws_row - 2 : 1;
+  const struct { const char *keys; int lines; } bindings[] = {
+    { "\033[A", -1 }, { "\033OA", -1 }, { "\033[B", 1 }, { "\033OB", 1 },
+    { "\033[5~", -page_lines }, { "\033[6~", page_lines }, { " ", page_lines },
+  };
+  const size_t binding_count = sizeof( bindings ) / sizeof( bindings[ 0 ] );
+
+  for ( ssize_t i = 0; (i < len) && history_mode; i++ ) {
+    history_keys.push_back( buf[ i ] );
+
+    bool partial = false;
+    for ( size_t j = 0; j < binding_count; j++ ) {
+      const string keys( bindings[ j ].keys );
+      if ( keys == history_keys ) {
+	scroll_history( bindings[ j ].lines );
+	history_keys.clear();
+	break;
+      } else if ( keys.compare( 0, history_keys.size(), history_keys ) == 0 ) {
+	partial = true;
+      }
+    }
+
+    if ( history_keys.empty() || partial ) {
+      continue;
+    }
+
+    /* q, Return and Ctrl-C go back; other keys do nothing */
+    if ( (history_keys == "q") || (history_keys == "\r") || (history_keys == "\003") ) {
+      stop_history();
+    }
+    history_keys.clear();
+  }
+
+  /* Esc on its own goes back, too */
+  if ( history_keys == "\033" ) {
+    stop_history();
+  }
+}
+
+/* Replace the screen below the notification bar with the history page. */
+void STMClient::draw_history( Terminal::Framebuffer &fb )
+{
+  const Terminal::HistoryPage *page = history_page();
+  wchar_t status[ 128 ];
+
+  Terminal::Complete view( fb.ds.get_width(), fb.ds.get_height() );
+  string screen( "\033[?7l" ); /* cut off long lines instead of wrapping them */
+
+  if ( !page ) {
+    swprintf( status, 128, L"Fetching history..." );
+  } else if ( page->lines.empty() ) {
+    swprintf( status, 128, L"No history on the server. q returns." );
+  } else {
+    for ( size_t i = 0; i < page->lines.size(); i++ ) {
+      char tmp[ 64 ];
+      snprintf( tmp, 64, "\033[%d;1H", int( i ) + 2 );
+      screen.append( tmp );
+      screen.append( page->lines[ i ] );
+    }
+
+    swprintf( status, 128, L"History %llu-%llu of %llu. Arrows and PgUp/PgDn scroll, q returns.",
+	      (unsigned long long)( page->start - page->first_line + 1 ),
+	      (unsigned long long)( page->start - page->first_line + page->lines.size() ),
+	      (unsigned long long)( page->end_line - page->first_line ) );
+  }
+
+  view.act( screen );
+  for ( int row = 0; row < fb.ds.get_height(); row++ ) {
+    fb.share_row( row, view.get_fb(), row );
+  }
+  fb.ds.cursor_visible = false;
+
+  overlays.get_notification_engine().set_notification_string( status, true, false );
+}
+
+/* Heuristic for input that was pasted rather than typed: the
+   terminal marked it as a bracketed paste, or more arrived at once
+   than anyone types between two reads. */
+bool STMClient::is_paste( const char *buf, ssize_t len )
+{
+  const ssize_t paste_threshold = 256;
+  static const char paste_start[] = "\033[200~";
+
+  if ( len >= paste_threshold ) {
+    return true;
+  }
+
+  const char *end = buf + len;
+  return std::search( buf, end, paste_start, paste_start + sizeof( paste_start ) - 1 ) != end;
+}
+
 bool STMClient::process_user_input( int fd )
 {
   const int buf_size = 16384;
@@ -314,14 +493,36 @@ bool STMClient::process_user_input( int fd )
   }
 
   if ( !network->shutdown_in_progress() ) {
-    overlays.get_prediction_engine().set_local_frame_sent( network->get_sent_state_last() );
+    if ( history_mode ) {
+      process_history_input( buf, bytes_read );
+      return true;
+    }
+
+    Overlay::PredictionEngine &prediction = overlays.get_prediction_engine();
+    Network::UserStream &user_stream = network->get_current_state();
+
+    prediction.set_local_frame_sent( network->get_sent_state_last() );
+
+    /* Large reads and bracketed pastes are not typing; skip prediction
+       for them and hand the bytes to the UserStream in runs. */
+    const bool paste = is_paste( buf, bytes_read );
+    if ( paste ) {
+      prediction.new_user_paste();
+    }
+
+    int run_start = 0; /* buf[ run_start, i ) is pending literal input */
 
     for ( int i = 0; i < bytes_read; i++ ) {
       char the_byte = buf[ i ];
 
-      overlays.get_prediction_engine().new_user_byte( the_byte, *local_framebuffer );
+      if ( !paste ) {
+	prediction.new_user_byte( the_byte, *local_framebuffer );
+      }
 
       if ( quit_sequence_started ) {
+	user_stream.push_back( buf + run_start, i - run_start );
+	run_start = i + 1;
+
 	if ( the_byte == '.' ) { /* Quit sequence is Ctrl-^ . */
 	  if ( network->has_remote_addr() && (!network->shutdown_in_progress()) ) {
 	    overlays.get_notification_engine().set_notification_string( wstring( L"Exiting on user request..." ), true );
@@ -347,14 +548,19 @@ bool STMClient::process_user_input( int fd )
 	  kill( 0, SIGSTOP );
 
 	  resume();
+	} else if ( the_byte == '[' ) { /* History sequence is escape_key [ */
+	  quit_sequence_started = false;
+	  start_history();
+	  process_history_input( buf + i + 1, bytes_read - i - 1 );
+	  return true;
 	} else if ( (the_byte == escape_pass_key) || (the_byte == escape_pass_key2) ) {
 	  /* Emulation sequence to type escape_key is escape_key +
 	     escape_pass_key (that is escape key without Ctrl) */
-	  network->get_current_state().push_back( Parser::UserByte( escape_key ) );
+	  user_stream.push_back( Parser::UserByte( escape_key ) );
 	} else {
 	  /* Escape key followed by anything other than . and ^ gets sent literally */
-	  network->get_current_state().push_back( Parser::UserByte( escape_key ) );
-	  network->get_current_state().push_back( Parser::UserByte( the_byte ) );	  
+	  user_stream.push_back( Parser::UserByte( escape_key ) );
+	  user_stream.push_back( Parser::UserByte( the_byte ) );
 	}
 
 	quit_sequence_started = false;
@@ -368,6 +574,8 @@ bool STMClient::process_user_input( int fd )
 
       quit_sequence_started = (escape_key > 0) && (the_byte == escape_key) && (lf_entered || (! escape_requires_lf));
       if ( quit_sequence_started ) {
+	user_stream.push_back( buf + run_start, i - run_start );
+	run_start = i + 1;
 	lf_entered = false;
 	overlays.get_notification_engine().set_notification_string( escape_key_help, true, false );
 	continue;
@@ -378,9 +586,9 @@ bool STMClient::process_user_input( int fd )
       if ( the_byte == 0x0C ) { /* Ctrl-L */
 	repaint_requested = true;
       }
-
-      network->get_current_state().push_back( Parser::UserByte( the_byte ) );		
     }
+
+    user_stream.push_back( buf + run_start, bytes_read - run_start );
   }
 
   return true;
@@ -388,17 +596,32 @@ bool STMClient::process_user_input( int fd )
 
 bool STMClient::process_resize( void )
 {
+  resize_pending = false;
+  last_resize_time = timestamp();
+
   /* get new size */
+  struct winsize old_size = window_size;
   if ( ioctl( STDIN_FILENO, TIOCGWINSZ, &window_size ) < 0 ) {
     perror( "ioctl TIOCGWINSZ" );
     return false;
   }
+
+  /* the drag may have come back to where it started */
+  if ( (window_size.ws_col == old_size.ws_col)
+       && (window_size.ws_row == old_size.ws_row) ) {
+    return true;
+  }
   
   /* tell remote emulator */
   Parser::Resize res( window_size.ws_col, window_size.ws_row );
   
   if ( !network->shutdown_in_progress() ) {
     network->get_current_state().push_back( res );
+
+    /* fetch a page of the new height */
+    if ( history_mode ) {
+      request_history( history_end );
+    }
   }
 
   /* note remote emulator will probably reply with its own Resize to adjust our state */
@@ -406,6 +629,8 @@ bool STMClient::process_resize( void )
   /* tell prediction engine */
   overlays.get_prediction_engine().reset();
 
+  window_resized = true;
+
   return true;
 }
 
@@ -419,10 +644,27 @@ void STMClient::main( void )
 
   while ( 1 ) {
     try {
-      output_new_frame();
+      if ( frame_needed() ) {
+	if ( timestamp() - last_frame_time >= frame_interval ) {
+	  output_new_frame();
+	} else {
+	  frame_deferred = true;
+	}
+      }
 
       int wait_time = min( network->wait_time(), overlays.wait_time() );
 
+      /* wake up when the deferred frame is due */
+      if ( frame_deferred ) {
+	wait_time = min( wait_time, int( last_frame_time + frame_interval - timestamp() ) );
+      }
+
+      /* ... or the deferred resize */
+      if ( resize_pending ) {
+	const uint64_t resize_due = last_resize_time + frame_interval;
+	wait_time = min( wait_time, int( resize_due > timestamp() ? resize_due - timestamp() : 0 ) );
+      }
+
       /* Handle startup "Connecting..." message */
       if ( still_connecting() ) {
 	wait_time = min( 250, wait_time );
@@ -437,6 +679,10 @@ void STMClient::main( void )
 	    it++ ) {
 	sel.add_fd( *it );
       }
+      int addresses_fd = network->host_addresses_fd();
+      if ( addresses_fd >= 0 ) {
+	sel.add_fd( addresses_fd );
+      }
       sel.add_fd( STDIN_FILENO );
 
       int active_fds = sel.select( wait_time );
@@ -465,6 +711,11 @@ void STMClient::main( void )
       if ( network_ready_to_read ) {
 	process_network_input();
       }
+
+      if ( addresses_fd >= 0 && sel.read( addresses_fd ) ) {
+	/* local addresses changed, look for new flows */
+	network->process_host_addresses();
+      }
     
       if ( sel.read( STDIN_FILENO ) ) {
 	/* input from the user needs to be fed to the network */
@@ -479,6 +730,11 @@ void STMClient::main( void )
       }
 
       if ( sel.signal( SIGWINCH ) ) {
+        resize_pending = true;
+      }
+
+      if ( resize_pending
+	   && (timestamp() - last_resize_time >= frame_interval) ) {
         /* resize */
         if ( !process_resize() ) { return; }
       }
@@ -487,6 +743,10 @@ void STMClient::main( void )
 	resume();
       }
 
+      if ( sel.signal( SIGUSR1 ) ) {
+	trace_dump();
+      }
+
       if ( sel.signal( SIGTERM )
            || sel.signal( SIGINT )
            || sel.signal( SIGHUP )
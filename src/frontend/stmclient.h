@@ -48,6 +48,7 @@ private:
   std::string port;
   std::string key;
   int loss_ratio_tolerance;
+  Network::SchedulerPolicy scheduler;
 
   int escape_key;
   int escape_pass_key;
@@ -68,12 +69,44 @@ private:
   bool repaint_requested, lf_entered, quit_sequence_started;
   bool clean_shutdown;
 
+  /* A frame is painted only when something may have changed it, and at
+     most once per frame_interval; changes in between are coalesced
+     into the frame painted when the interval is up. */
+  uint64_t frame_interval; /* ms */
+  uint64_t last_frame_time, last_frame_state_num;
+  bool last_frame_overlays; /* overlays were drawn over the last frame */
+  bool window_resized, frame_deferred;
+
+  /* Likewise, the window's size is read and sent at most once per
+     frame_interval, however many SIGWINCHes a drag delivers. */
+  uint64_t last_resize_time;
+  bool resize_pending;
+
+  /* Looking back through the server's scrollback, which starts with
+     the escape key and "[". Pages are fetched as the user scrolls;
+     history_end is the line just below the view, or 0 until the
+     newest lines have arrived. */
+  bool history_mode;
+  unsigned int history_first_id, history_request_id;
+  uint64_t history_end;
+  std::string history_keys; /* an unfinished key sequence */
+
   void main_init( void );
   void process_network_input( void );
+  static bool is_paste( const char *buf, ssize_t len );
   bool process_user_input( int fd );
   bool process_resize( void );
 
   void output_new_frame( void );
+  bool frame_needed( void ) const;
+
+  const Terminal::HistoryPage *history_page( void ) const;
+  void request_history( uint64_t end );
+  void start_history( void );
+  void stop_history( void );
+  void scroll_history( int lines );
+  void process_history_input( const char *buf, ssize_t len );
+  void draw_history( Terminal::Framebuffer &fb );
 
   bool still_connecting( void ) const
   {
@@ -85,8 +118,10 @@ private:
 
 public:
   STMClient( const char *s_ip, const char *s_port, const char *s_key, const char *predict_mode,
-	     int s_loss_ratio_tolerance )
+	     int s_loss_ratio_tolerance, Network::SchedulerPolicy s_scheduler,
+	     int s_max_frame_rate )
     : ip( s_ip ), port( s_port ), key( s_key ), loss_ratio_tolerance( s_loss_ratio_tolerance ),
+    scheduler( s_scheduler ),
     escape_key( 0x1E ), escape_pass_key( '^' ), escape_pass_key2( '^' ),
     escape_requires_lf( false ), escape_key_help( L"?" ),
       saved_termios(), raw_termios(),
@@ -100,7 +135,20 @@ public:
       repaint_requested( false ),
       lf_entered( false ),
       quit_sequence_started( false ),
-      clean_shutdown( false )
+      clean_shutdown( false ),
+      frame_interval( s_max_frame_rate > 0 ? 1000 / s_max_frame_rate : 0 ),
+      last_frame_time( 0 ),
+      last_frame_state_num( -1 ),
+      last_frame_overlays( false ),
+      window_resized( false ),
+      frame_deferred( false ),
+      last_resize_time( 0 ),
+      resize_pending( false ),
+      history_mode( false ),
+      history_first_id( 0 ),
+      history_request_id( 0 ),
+      history_end( 0 ),
+      history_keys()
   {
     if ( predict_mode ) {
       if ( !strcmp( predict_mode, "always" ) ) {
@@ -61,7 +61,7 @@ void ConditionalOverlayCell::apply( Framebuffer &fb, uint64_t confirmed_epoch, i
 
   if ( unknown ) {
     if ( flag && ( col != fb.ds.get_width() - 1 ) ) {
-      fb.get_mutable_cell( row, col )->renditions.underlined = true;
+      fb.get_mutable_cell( row, col )->renditions.set_attribute( Renditions::underlined, true );
     }
     return;
   }
@@ -69,7 +69,7 @@ void ConditionalOverlayCell::apply( Framebuffer &fb, uint64_t confirmed_epoch, i
   if ( !(*(fb.get_cell( row, col )) == replacement) ) {
     *(fb.get_mutable_cell( row, col )) = replacement;
     if ( flag ) {
-      fb.get_mutable_cell( row, col )->renditions.underlined = true;
+      fb.get_mutable_cell( row, col )->renditions.set_attribute( Renditions::underlined, true );
     }
   }
 }
@@ -206,8 +206,8 @@ void NotificationEngine::apply( Framebuffer &fb ) const
 
   /* draw bar across top of screen */
   Cell notification_bar( 0 );
-  notification_bar.renditions.foreground_color = 37;
-  notification_bar.renditions.background_color = 44;
+  notification_bar.renditions.set_foreground_color( 7 );
+  notification_bar.renditions.set_background_color( 4 );
   notification_bar.contents.push_back( 0x20 );
 
   for ( int i = 0; i < fb.ds.get_width(); i++ ) {
@@ -275,9 +275,9 @@ void NotificationEngine::apply( Framebuffer &fb ) const
     case 2: /* wide character */
       this_cell = fb.get_mutable_cell( 0, overlay_col );
       fb.reset_cell( this_cell );
-      this_cell->renditions.bold = true;
-      this_cell->renditions.foreground_color = 37;
-      this_cell->renditions.background_color = 44;
+      this_cell->renditions.set_attribute( Renditions::bold, true );
+      this_cell->renditions.set_foreground_color( 7 );
+      this_cell->renditions.set_background_color( 4 );
       
       this_cell->contents.push_back( ch );
       this_cell->width = chwidth;
@@ -352,13 +352,23 @@ void TitleEngine::set_prefix( const wstring s )
 
 void ConditionalOverlayRow::apply( Framebuffer &fb, uint64_t confirmed_epoch, bool flag ) const
 {
-  for ( overlay_cells_type::const_iterator it = overlay_cells.begin();
-        it != overlay_cells.end();
+  for ( overlay_cells_type::const_iterator it = overlay_cells.begin() + used_begin;
+        it != overlay_cells.begin() + used_end;
         it++ ) {
     it->apply( fb, confirmed_epoch, row_num, flag );
   }
 }
 
+void ConditionalOverlayRow::trim( void )
+{
+  while ( (used_begin < used_end) && overlay_cells[ used_begin ].pristine() ) {
+    used_begin++;
+  }
+  while ( (used_end > used_begin) && overlay_cells[ used_end - 1 ].pristine() ) {
+    used_end--;
+  }
+}
+
 void PredictionEngine::apply( Framebuffer &fb ) const
 {
   bool show = (display_preference != Never) && ( srtt_trigger
@@ -394,8 +404,8 @@ void PredictionEngine::kill_epoch( uint64_t epoch, const Framebuffer &fb )
   for ( overlays_type::iterator i = overlays.begin();
         i != overlays.end();
         i++ ) {
-    for ( overlay_cells_type::iterator j = i->overlay_cells.begin();
-          j != i->overlay_cells.end();
+    for ( overlay_cells_type::iterator j = i->used_cells_begin();
+          j != i->used_cells_end();
           j++ ) {
       if ( j->tentative( epoch - 1 ) ) {
 	j->reset();
@@ -410,11 +420,24 @@ void PredictionEngine::reset( void )
 {
   cursors.clear();
   overlays.clear();
+  overlays_by_row.clear();
   become_tentative();
 
   //  fprintf( stderr, "RESETTING\n" );
 }
 
+void PredictionEngine::new_user_paste( void )
+{
+  /* A paste can contain anything (newlines, control characters,
+     escape sequences), so rather than run every byte through the
+     parser, drop outstanding predictions and start over from a
+     known parser state. reset() also makes the next predictions
+     tentative until the server confirms them. */
+  reset();
+  parser = Parser::UTF8Parser();
+  last_byte = 0;
+}
+
 void PredictionEngine::init_cursor( const Framebuffer &fb )
 {
   if ( cursors.empty() ) {
@@ -479,13 +502,16 @@ void PredictionEngine::cull( const Framebuffer &fb )
     overlays_type::iterator inext = i;
     inext++;
     if ( (i->row_num < 0) || (i->row_num >= fb.ds.get_height()) ) {
+      if ( i->row_num >= 0 && i->row_num < int( overlays_by_row.size() ) ) {
+	overlays_by_row[ i->row_num ] = NULL;
+      }
       overlays.erase( i );
       i = inext;
       continue;
     }
 
-    for ( overlay_cells_type::iterator j = i->overlay_cells.begin();
-          j != i->overlay_cells.end();
+    for ( overlay_cells_type::iterator j = i->used_cells_begin();
+          j != i->used_cells_end();
           j++ ) {
       switch ( j->get_validity( fb, i->row_num,
 				local_frame_acked, local_frame_late_acked ) ) {
@@ -589,6 +615,7 @@ void PredictionEngine::cull( const Framebuffer &fb )
       }
     }
 
+    i->trim();
     i = inext;
   }
 
@@ -628,12 +655,12 @@ void PredictionEngine::cull( const Framebuffer &fb )
 
 ConditionalOverlayRow & PredictionEngine::get_or_make_row( int row_num, int num_cols )
 {
-  overlays_type::iterator it =
-    find_if( overlays.begin(), overlays.end(),
-	     bind2nd( mem_fun_ref( &ConditionalOverlayRow::row_num_eq ), row_num ) );
+  if ( row_num >= int( overlays_by_row.size() ) ) {
+    overlays_by_row.resize( row_num + 1, NULL );
+  }
 
-  if ( it != overlays.end() ) {
-    return *it;
+  if ( overlays_by_row[ row_num ] ) {
+    return *overlays_by_row[ row_num ];
   } else {
     /* make row */
     ConditionalOverlayRow r( row_num );
@@ -643,6 +670,7 @@ ConditionalOverlayRow & PredictionEngine::get_or_make_row( int row_num, int num_
       assert( r.overlay_cells[ i ].col == i );
     }
     overlays.push_back( r );
+    overlays_by_row[ row_num ] = &overlays.back();
     return overlays.back();
   }
 }
@@ -703,7 +731,7 @@ void PredictionEngine::new_user_byte( char the_byte, const Framebuffer &fb )
 	    cell.active = true;
 	    cell.tentative_until_epoch = prediction_epoch;
 	    cell.expire( local_frame_sent + 1, now );
-	    cell.original_contents.push_back( *fb.get_cell( cursor().row, i ) );
+	    cell.remember_original( *fb.get_cell( cursor().row, i ) );
 	  
 	    if ( i + 2 < fb.ds.get_width() ) {
 	      ConditionalOverlayCell &next_cell = the_row.overlay_cells[ i + 1 ];
@@ -724,6 +752,7 @@ void PredictionEngine::new_user_byte( char the_byte, const Framebuffer &fb )
 	      cell.unknown = true;
 	    }
 	  }
+	  the_row.use( cursor().col, fb.ds.get_width() );
 	}
       } else if ( (ch < 0x20) || (wcwidth( ch ) != 1) ) {
 	/* unknown print */
@@ -750,7 +779,7 @@ void PredictionEngine::new_user_byte( char the_byte, const Framebuffer &fb )
 	  cell.active = true;
 	  cell.tentative_until_epoch = prediction_epoch;
 	  cell.expire( local_frame_sent + 1, now );
-	  cell.original_contents.push_back( *fb.get_cell( cursor().row, i ) );
+	  cell.remember_original( *fb.get_cell( cursor().row, i ) );
 
 	  ConditionalOverlayCell &prev_cell = the_row.overlay_cells[ i - 1 ];
 	  const Cell *prev_cell_actual = fb.get_cell( cursor().row, i - 1 );
@@ -790,7 +819,8 @@ void PredictionEngine::new_user_byte( char the_byte, const Framebuffer &fb )
 
 	cell.replacement.contents.clear();
 	cell.replacement.contents.push_back( ch );
-	cell.original_contents.push_back( *fb.get_cell( cursor().row, cursor().col ) );
+	cell.remember_original( *fb.get_cell( cursor().row, cursor().col ) );
+	the_row.use( cursor().col, fb.ds.get_width() );
 
 	/*
 	fprintf( stderr, "[%d=>%d] Predicting %lc in row %d, col %d [tue: %lu]\n",
@@ -878,6 +908,7 @@ void PredictionEngine::newline_carriage_return( const Framebuffer &fb )
       j->expire( local_frame_sent + 1, now );
       j->replacement.contents.clear();
     }
+    the_row.use( 0, fb.ds.get_width() );
   } else {
     cursor().row++;
   }
@@ -904,8 +935,8 @@ bool PredictionEngine::active( void ) const
   for ( overlays_type::const_iterator i = overlays.begin();
         i != overlays.end();
         i++ ) {
-    for ( overlay_cells_type::const_iterator j = i->overlay_cells.begin();
-          j != i->overlay_cells.end();
+    for ( overlay_cells_type::const_iterator j = i->overlay_cells.begin() + i->used_begin;
+          j != i->overlay_cells.begin() + i->used_end;
           j++ ) {
       if ( j->active ) {
 	return true;
@@ -120,9 +120,27 @@ namespace Overlay {
 	return;
       }
 
-      original_contents.push_back( replacement );
+      remember_original( replacement );
       ConditionalOverlay::reset();
     }
+
+    /* Only whether some original matches counts, so keep one of each;
+       otherwise every keystroke typed ahead of the echo adds a copy. */
+    void remember_original( const Cell &c )
+    {
+      for ( vector<Cell>::const_iterator it = original_contents.begin();
+	    it != original_contents.end();
+	    it++ ) {
+	if ( it->contents_match( c ) ) {
+	  return;
+	}
+      }
+      original_contents.push_back( c );
+    }
+
+    /* Nothing to show, check or remember; skipping such cells changes
+       nothing. */
+    bool pristine( void ) const { return (!active) && (!unknown) && original_contents.empty(); }
   };
 
   class ConditionalOverlayRow {
@@ -132,12 +150,29 @@ namespace Overlay {
     typedef vector<ConditionalOverlayCell> overlay_cells_type;
     overlay_cells_type overlay_cells;
 
+    /* All cells outside [used_begin, used_end) are pristine. */
+    int used_begin, used_end;
+
     void apply( Framebuffer &fb, uint64_t confirmed_epoch, bool flag ) const;
 
-    /* For use with find_if */
-    bool row_num_eq( int v ) const { return row_num == v; }
+    overlay_cells_type::iterator used_cells_begin( void ) { return overlay_cells.begin() + used_begin; }
+    overlay_cells_type::iterator used_cells_end( void ) { return overlay_cells.begin() + used_end; }
 
-    ConditionalOverlayRow( int s_row_num ) : row_num( s_row_num ), overlay_cells() {}
+    void use( int begin, int end )
+    {
+      if ( used_begin == used_end ) {
+	used_begin = begin;
+	used_end = end;
+      } else {
+	used_begin = std::min( used_begin, begin );
+	used_end = std::max( used_end, end );
+      }
+    }
+
+    void trim( void );
+
+    ConditionalOverlayRow( int s_row_num )
+      : row_num( s_row_num ), overlay_cells(), used_begin( 0 ), used_end( 0 ) {}
   };
 
   /* the various overlays */
@@ -158,6 +193,7 @@ namespace Overlay {
   public:
     void adjust_message( void );
     void apply( Framebuffer &fb ) const;
+    bool active( void ) const { return !message.empty() || need_countup( timestamp() ); }
     const wstring &get_notification_string( void ) const { return message; }
     void server_heard( uint64_t s_last_word ) { last_word_from_server = s_last_word; }
     void server_acked( uint64_t s_last_acked ) { last_acked_state = s_last_acked; }
@@ -221,6 +257,7 @@ namespace Overlay {
 
     typedef list<ConditionalOverlayRow> overlays_type;
     overlays_type overlays;
+    vector<ConditionalOverlayRow *> overlays_by_row; /* NULL where there is none */
 
     typedef list<ConditionalCursorMove> cursors_type;
     cursors_type cursors;
@@ -264,8 +301,6 @@ namespace Overlay {
   private:
     DisplayPreference display_preference;
 
-    bool active( void ) const;
-
     bool timing_tests_necessary( void ) const {
       /* Are there any timing-based triggers that haven't fired yet? */
       return !( glitch_trigger && flagging );
@@ -274,8 +309,11 @@ namespace Overlay {
   public:
     void set_display_preference( DisplayPreference s_pref ) { display_preference = s_pref; }
 
+    bool active( void ) const; /* any predictions to check or show */
+
     void apply( Framebuffer &fb ) const;
     void new_user_byte( char the_byte, const Framebuffer &fb );
+    void new_user_paste( void ); /* bulk input we don't try to predict */
     void cull( const Framebuffer &fb );
 
     void reset( void );
@@ -293,7 +331,7 @@ namespace Overlay {
           : INT_MAX;
     }
 
-    PredictionEngine( void ) : last_byte( 0 ), parser(), overlays(), cursors(),
+    PredictionEngine( void ) : last_byte( 0 ), parser(), overlays(), overlays_by_row(), cursors(),
 			       local_frame_sent( 0 ), local_frame_acked( 0 ),
 			       local_frame_late_acked( 0 ),
 			       prediction_epoch( 1 ), confirmed_epoch( 0 ),
@@ -339,6 +377,9 @@ namespace Overlay {
     {
       return std::min( notifications.wait_time(), predictions.wait_time() );
     }
+
+    /* Whether apply() may draw anything over the framebuffer. */
+    bool active( void ) const { return notifications.active() || predictions.active(); }
   };
 }
 
@@ -30,8 +30,18 @@
     also delete it here.
 */
 
+#include "config.h"
+
 #include <ifaddrs.h>
 #include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#ifdef HAVE_LINUX_RTNETLINK_H
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#endif
 
 #include "addresses.h"
 #include "timestamp.h"
@@ -41,6 +51,88 @@ using namespace Network;
 
 const unsigned char Addr::v4prefix[] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xFF, 0xFF};
 
+Addresses::Addresses()
+  : addresses(),
+    last_addr_check( 0 ),
+    notify_fd( -1 ),
+    stale( true )
+{
+  open_notify();
+}
+
+Addresses::~Addresses()
+{
+  if ( notify_fd >= 0 ) {
+    close( notify_fd );
+  }
+}
+
+void Addresses::open_notify( void )
+{
+#ifdef HAVE_LINUX_RTNETLINK_H
+  int fd = socket( AF_NETLINK, SOCK_RAW, NETLINK_ROUTE );
+  if ( fd < 0 ) {
+    log_dbg( LOG_DEBUG_COMMON, "Cannot open netlink socket, polling host addresses: %s.\n", strerror( errno ) );
+    return;
+  }
+
+  struct sockaddr_nl snl;
+  memset( &snl, 0, sizeof( snl ) );
+  snl.nl_family = AF_NETLINK;
+  snl.nl_groups = RTMGRP_IPV4_IFADDR | RTMGRP_IPV6_IFADDR;
+
+  if ( bind( fd, (struct sockaddr *) &snl, sizeof( snl ) ) < 0
+       || fcntl( fd, F_SETFL, fcntl( fd, F_GETFL ) | O_NONBLOCK ) < 0
+       || fcntl( fd, F_SETFD, FD_CLOEXEC ) < 0 ) {
+    log_dbg( LOG_DEBUG_COMMON, "Cannot listen to netlink, polling host addresses: %s.\n", strerror( errno ) );
+    close( fd );
+    return;
+  }
+
+  notify_fd = fd;
+#endif
+}
+
+/* Drain pending notifications.  Returns true if one of them announced a new or
+   deleted address, or if some were lost: the next get_host_addresses() call
+   will then read the interfaces again. */
+bool Addresses::process_notifications( void )
+{
+  bool changed = false;
+
+#ifdef HAVE_LINUX_RTNETLINK_H
+  if ( notify_fd < 0 ) {
+    return false;
+  }
+
+  char buf[ 8192 ] __attribute__(( aligned( NLMSG_ALIGNTO ) ));
+  while ( true ) {
+    ssize_t len = recv( notify_fd, buf, sizeof( buf ), MSG_DONTWAIT );
+    if ( len < 0 ) {
+      if ( errno == ENOBUFS ) { /* kernel dropped notifications */
+	changed = true;
+	continue;
+      }
+      break;
+    }
+
+    for ( struct nlmsghdr *nh = (struct nlmsghdr *) buf;
+	  NLMSG_OK( nh, (size_t) len );
+	  nh = NLMSG_NEXT( nh, len ) ) {
+      if ( nh->nlmsg_type == RTM_NEWADDR || nh->nlmsg_type == RTM_DELADDR ) {
+	changed = true;
+      }
+    }
+  }
+#endif
+
+  if ( changed ) {
+    log_dbg( LOG_DEBUG_COMMON, "Host addresses changed.\n" );
+    stale = true;
+  }
+  return changed;
+}
+
 std::vector< Addr > Addresses::get_host_addresses( int *has_change )
 {
   struct ifaddrs *ifaddr;
@@ -49,6 +141,12 @@ std::vector< Addr > Addresses::get_host_addresses( int *has_change )
   int changed = 0;
   int rc;
 
+  if ( notify_fd >= 0 && !stale ) {
+    /* nothing notified since the last read */
+    addr = addresses;
+    goto done;
+  }
+
   rc = getifaddrs( &ifaddr );
   if ( rc < 0 ) {
     addr = addresses;
@@ -69,6 +167,7 @@ std::vector< Addr > Addresses::get_host_addresses( int *has_change )
 
   freeifaddrs( ifaddr );
 
+  stale = false;
   changed = !( addr == addresses );
  done:
   if ( has_change ) {
@@ -106,11 +205,6 @@ string Addr::tostring( void ) const {
   return string( tmp );
 }
 
-int Addresses::get_fd( void )
-{
-  return -1;
-}
-
 bool Addresses::compatible( const Addr &src, const Addr &dst ) {
   return src.sa.sa_family == dst.sa.sa_family &&
     src.is_loopback() == dst.is_loopback() &&
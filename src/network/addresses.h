@@ -165,9 +165,26 @@ namespace Network {
   private:
     std::set< Addr > addresses;
     uint64_t last_addr_check;
+
+    /* Routing socket notified of host address changes (-1 if unavailable).
+       When it is open, getifaddrs() is only called after a notification. */
+    int notify_fd;
+    bool stale;
+
+    void open_notify( void );
+
+    /* not implemented */
+    Addresses( const Addresses & );
+    Addresses & operator=( const Addresses & );
+
   public:
+    Addresses();
+    ~Addresses();
+
     std::vector< Addr > get_host_addresses( int *has_change );
-    int get_fd( void ); /* to monitor things */
+    int get_fd( void ) const { return notify_fd; } /* to monitor things */
+    bool process_notifications( void ); /* true if host addresses may have changed */
+    bool is_host_address( const Addr &addr ) const { return addresses.find( addr ) != addresses.end(); }
     uint64_t last_check( void ) { return last_addr_check; }
     static bool compatible( const Addr &src, const Addr &dest );
   };
@@ -34,12 +34,14 @@
 
 #include "compressor.h"
 #include "dos_assert.h"
+#include "metrics.h"
 
 using namespace Network;
 using namespace std;
 
 string Compressor::compress_str( const string &input )
 {
+  StageTimer timer( STAGE_COMPRESS );
   long unsigned int len = BUFFER_SIZE;
   dos_assert( Z_OK == compress( buffer, &len,
 				reinterpret_cast<const unsigned char *>( input.data() ),
@@ -49,6 +51,7 @@ string Compressor::compress_str( const string &input )
 
 string Compressor::uncompress_str( const string &input )
 {
+  StageTimer timer( STAGE_COMPRESS );
   long unsigned int len = BUFFER_SIZE;
   dos_assert( Z_OK == uncompress( buffer, &len,
 				  reinterpret_cast<const unsigned char *>( input.data() ),
@@ -55,6 +55,8 @@
 #include "timestamp.h"
 #include "utils.h"
 #include "logger.h"
+#include "trace.h"
+#include "metrics.h"
 
 #ifndef MSG_DONTWAIT
 #define MSG_DONTWAIT MSG_NONBLOCK
@@ -77,30 +79,57 @@ const uint64_t SEQUENCE_MASK  = 0x0000FFFFFFFFFFFF;
 #define GET_FLOWID(nonce) ( uint16_t( ( (nonce) & FLOWID_MASK ) >> 48 ) )
 const uint16_t PROBE_FLAG = 1 << 0;
 const uint16_t ADDR_FLAG = 1 << 1;
-
-/* Read in packet from coded string */
-Packet::Packet( string coded_packet, Session *session )
+/* Sub-millisecond timestamps: the first flag advertises that the sender
+   understands them, the second that they follow the header.  They are only
+   sent to a peer which advertised them, older peers ignore the first flag. */
+const uint16_t FINE_TIMESTAMP_OK_FLAG = 1 << 2;
+const uint16_t FINE_TIMESTAMP_FLAG = 1 << 3;
+
+/* Read in packet from a received buffer, decrypting it in place */
+Packet::Packet( AlignedBuffer &buf, size_t len, Session *session )
   : seq( -1 ),
     direction( TO_SERVER ),
     timestamp( -1 ),
     timestamp_reply( -1 ),
     payload()
 {
-  Message message = session->decrypt( coded_packet );
-
-  direction = GET_DIRECTION( message.nonce.val() );
-  flow_id = GET_FLOWID( message.nonce.val() );
-  seq = message.nonce.val() & SEQUENCE_MASK;
+  uint64_t nonce_val;
+  size_t text_len = session->decrypt( buf, len, nonce_val );
 
-  dos_assert( message.text.size() >= 2 * sizeof( uint16_t ) + 2 * sizeof( uint8_t ) );
+  parse( nonce_val, buf.data() + Session::PACKET_OFFSET + 8, text_len );
+}
 
-  uint8_t *data = (uint8_t *)message.text.data();
-  timestamp = be16toh( *(uint16_t*) (data) );
-  timestamp_reply = be16toh( *(uint16_t*) ( data + 2 ) );
+void Packet::parse( uint64_t nonce_val, const char *text, size_t len )
+{
+  direction = GET_DIRECTION( nonce_val );
+  flow_id = GET_FLOWID( nonce_val );
+  seq = nonce_val & SEQUENCE_MASK;
+
+  dos_assert( len >= 2 * sizeof( uint16_t ) + 2 * sizeof( uint8_t ) );
+
+  const uint8_t *data = (const uint8_t *)text;
+  uint16_t field;
+  memcpy( &field, data, sizeof( field ) );
+  timestamp = be16toh( field );
+  memcpy( &field, data + 2, sizeof( field ) );
+  timestamp_reply = be16toh( field );
   flags = data[ 4 ];
   loss_ratio = data[ 5 ];
 
-  payload = string( message.text.begin() + 2 * sizeof( uint16_t ) + 2 * sizeof( uint8_t ), message.text.end() );
+  size_t header_len = 2 * sizeof( uint16_t ) + 2 * sizeof( uint8_t );
+  timestamp_frac = timestamp_reply_frac = 0;
+  if ( has_fine_timestamps() ) {
+    dos_assert( len >= header_len + 2 * sizeof( uint16_t ) );
+    memcpy( &field, data + header_len, sizeof( field ) );
+    timestamp_frac = be16toh( field );
+    memcpy( &field, data + header_len + 2, sizeof( field ) );
+    timestamp_reply_frac = be16toh( field );
+    dos_assert( timestamp_frac < 1000 && timestamp_reply_frac < 1000 );
+    header_len += 2 * sizeof( uint16_t );
+  }
+
+  payload.data = text + header_len;
+  payload.len = len - header_len;
 }
 
 bool Packet::is_probe( void )
@@ -113,39 +142,95 @@ bool Packet::is_addr_msg( void )
   return flags & ADDR_FLAG;
 }
 
-/* Output coded string from packet */
-string Packet::tostring( Session *session )
+bool Packet::has_fine_timestamps( void )
+{
+  return flags & FINE_TIMESTAMP_FLAG;
+}
+
+bool Packet::accepts_fine_timestamps( void )
+{
+  return flags & FINE_TIMESTAMP_OK_FLAG;
+}
+
+uint64_t Packet::nonce_val( void ) const
+{
+  return TO_DIRECTION( direction ) | TO_FLOWID( flow_id ) | (seq & SEQUENCE_MASK);
+}
+
+size_t Packet::header( uint8_t *out )
+{
+  size_t header_len = 0;
+  uint16_t field;
+
+  field = htobe16( timestamp );
+  memcpy( out + header_len, &field, sizeof( field ) );
+  header_len += sizeof( field );
+  field = htobe16( timestamp_reply );
+  memcpy( out + header_len, &field, sizeof( field ) );
+  header_len += sizeof( field );
+  out[ header_len++ ] = flags;
+  out[ header_len++ ] = loss_ratio;
+  if ( has_fine_timestamps() ) {
+    field = htobe16( timestamp_frac );
+    memcpy( out + header_len, &field, sizeof( field ) );
+    header_len += sizeof( field );
+    field = htobe16( timestamp_reply_frac );
+    memcpy( out + header_len, &field, sizeof( field ) );
+    header_len += sizeof( field );
+  }
+
+  return header_len;
+}
+
+/* Encrypt the packet straight into buf, header and payload gathered by the
+   session without building an intermediate string */
+size_t Packet::tobuffer( Session *session, AlignedBuffer &buf )
 {
-  uint64_t direction_id_seq = TO_DIRECTION( direction ) | TO_FLOWID( flow_id ) | (seq & SEQUENCE_MASK);
+  uint8_t header_bytes[ MAX_HEADER_LEN ];
+  Segment segments[ 2 ] = { { (const char *)header_bytes, header( header_bytes ) },
+			    payload };
 
-  uint16_t ts_net[ 2 ] = { static_cast<uint16_t>( htobe16( timestamp ) ),
-			   static_cast<uint16_t>( htobe16( timestamp_reply ) ) };
+  return session->encrypt( nonce_val(), segments, 2, buf );
+}
 
-  string timestamps = string( (char *)ts_net, 2 * sizeof( uint16_t ) );
-  string flags_string = string( (char *)&flags, sizeof( uint8_t ) );
-  string loss_string = string( (char *)&loss_ratio, sizeof( uint8_t ) );
+size_t Packet::gather( AlignedBuffer &buf )
+{
+  uint8_t header_bytes[ MAX_HEADER_LEN ];
+  Segment segments[ 2 ] = { { (const char *)header_bytes, header( header_bytes ) },
+			    payload };
 
-  return session->encrypt( Message( Nonce( direction_id_seq ), timestamps + flags_string + loss_string + payload ) );
+  return Session::gather( segments, 2, buf );
 }
 
-Packet Connection::new_packet( Flow *flow, uint8_t flags, string &s_payload )
+Packet Connection::new_packet( Flow *flow, uint8_t flags, const Segment &s_payload )
 {
-  uint16_t outgoing_timestamp_reply = -1;
+  uint32_t outgoing_timestamp_reply = FINE_TIMESTAMP_NONE;
 
   uint64_t now = timestamp();
+  uint64_t now_us = timestamp_us();
 
-  if ( now - flow->saved_timestamp_received_at < 1000 ) { /* we have a recent received timestamp */
+  if ( now_us - flow->saved_timestamp_received_at < 1000000 ) { /* we have a recent received timestamp */
     /* send "corrected" timestamp advanced by how long we held it */
-    outgoing_timestamp_reply = flow->saved_timestamp + (now - flow->saved_timestamp_received_at);
+    outgoing_timestamp_reply = ( flow->saved_timestamp + (now_us - flow->saved_timestamp_received_at) )
+      % FINE_TIMESTAMP_PERIOD;
+    if ( outgoing_timestamp_reply / 1000 == uint16_t(-1) ) {
+      outgoing_timestamp_reply = 0;
+    }
     flow->saved_timestamp = -1;
     flow->saved_timestamp_received_at = 0;
   }
 
+  flags |= FINE_TIMESTAMP_OK_FLAG;
+  if ( fine_timestamps ) {
+    flags |= FINE_TIMESTAMP_FLAG;
+  }
+
   if ( !server ) { /* only the client waits answer. */
     unsigned int rto = ( (unsigned int)flow->SRTT + flow->idle_time ) + 4 * flow->RTTVAR;
     unsigned int probe_interval = MAX( rto + delay_ack_interval, MIN_PROBE_INTERVAL );
     if ( flow->rto < now ) {
       flow->idle_time = ( MAX_IDLE_TIME - flow->idle_time < rto ) ? MAX_IDLE_TIME : flow->idle_time + rto;
+      check_flow_order( flow );
       log_dbg( LOG_DEBUG_COMMON, "report flow %hu srtt %dms idle %dms\n",
 	       flow->flow_id, (int)flow->SRTT, (int)flow->idle_time );
       flow->rto = uint64_t(-1);
@@ -157,7 +242,7 @@ Packet Connection::new_packet( Flow *flow, uint8_t flags, string &s_payload )
     }
   }
 
-  Packet p( flow->next_seq++, direction, timestamp16(), outgoing_timestamp_reply,
+  Packet p( flow->next_seq++, direction, timestamp_fine(), outgoing_timestamp_reply,
 	    flow->flow_id, flags, flow->incoming_loss.get_ratio(), s_payload );
 
   return p;
@@ -214,10 +299,10 @@ void Connection::check_remote_addr( void ) {
 }
 
 bool Connection::flow_exists( const Addr &src, const Addr &dst ) {
-  for ( std::vector< Flow* >::iterator it = flows.begin();
-	it != flows.end();
+  for ( std::map< uint16_t, Flow* >::const_iterator it = flows_by_id.begin();
+	it != flows_by_id.end();
 	it++ ) {
-    if ( (*it)->src == src && (*it)->dst == dst ) {
+    if ( it->second->src == src && it->second->dst == dst ) {
       return true;
     }
   }
@@ -230,8 +315,7 @@ void Connection::new_flow( Addr &src, Addr &dst ) {
       dst.sin6.sin6_scope_id = src.sin6.sin6_scope_id;
     }
     if ( ! flow_exists( src, dst ) ) {
-      Flow *flow_info = new Flow( src, dst );
-      flows.push_back( flow_info );
+      add_flow( new Flow( src, dst ) );
     }
   }
 }
@@ -279,20 +363,92 @@ void Connection::check_flows( bool remote_has_changed ) {
 }
 
 Connection::Flow *Connection::get_flow( uint16_t id ) {
-  for ( std::vector< Flow * >::iterator it = flows.begin();
+  std::map< uint16_t, Flow* >::const_iterator it = flows_by_id.find( id );
+  if ( it == flows_by_id.end() ) {
+    return NULL;
+  }
+  if ( it->second->cold ) {
+    warm_flow( it->second );
+  }
+  return it->second;
+}
+
+void Connection::add_flow( Flow *flow ) {
+  flows_by_id[ flow->flow_id ] = flow;
+  flows.push_back( flow );
+  flows_unsorted = true;
+}
+
+void Connection::warm_flow( Flow *flow ) {
+  assert( flow->cold );
+  log_dbg( LOG_DEBUG_COMMON, "Flow %hu is back\n", flow->flow_id );
+  cold_flows.erase( std::find( cold_flows.begin(), cold_flows.end(), flow ) );
+  flow->cold = false;
+  flows.push_back( flow );
+  flows_unsorted = true;
+}
+
+/* Move the flows not heard for long out of the way (server only, the client
+   only has one flow per pair of addresses). */
+void Connection::compact_flows( void ) {
+  assert( server );
+  if ( last_heard - last_flows_compaction < FLOW_COMPACTION_INTERVAL ) {
+    return;
+  }
+  last_flows_compaction = last_heard;
+
+  std::vector< Flow* >::iterator hot = flows.begin();
+  for ( std::vector< Flow* >::iterator it = flows.begin();
 	it != flows.end();
 	it++ ) {
-    if ( (*it)->flow_id == id ) {
-      return *it;
+    Flow *flow = *it;
+    if ( flow != last_flow && last_heard - flow->last_heard > COLD_FLOW_AGE ) {
+      log_dbg( LOG_DEBUG_COMMON, "Flow %hu is cold\n", flow->flow_id );
+      flow->cold = true;
+      cold_flows.push_back( flow );
+      scheduler->removed( flow );
+    } else {
+      *hot++ = flow;
     }
   }
-  return NULL;
+  flows.erase( hot, flows.end() ); /* order is kept */
 }
 
-void Connection::sort_flows( void ) {
-  std::sort( flows.begin(), flows.end(), Flow::srtt_order );
+void Connection::sort_flows( void ) const {
+  if ( !flows_unsorted ) {
+    return;
+  }
+  flows_unsorted = false;
+
+  /* The order rarely changes between two calls: an insertion sort is linear
+     when the flows are already sorted. */
+  for ( size_t i = 1; i < flows.size(); i++ ) {
+    Flow *flow = flows[ i ];
+    size_t j = i;
+    while ( j > 0 && Flow::srtt_order( flow, flows[ j - 1 ] ) ) {
+      flows[ j ] = flows[ j - 1 ];
+      j--;
+    }
+    flows[ j ] = flow;
+  }
 }
 
+/* The SRTT, idle time or loss of a flow changed: only resort if it moved
+   past one of its neighbours. */
+void Connection::check_flow_order( const Flow *flow ) {
+  if ( flows_unsorted || flow->cold ) {
+    return;
+  }
+  std::vector< Flow* >::const_iterator it = std::find( flows.begin(), flows.end(), flow );
+  assert( it != flows.end() );
+  if ( ( it != flows.begin() && Flow::srtt_order( *it, *(it - 1) ) )
+       || ( it + 1 != flows.end() && Flow::srtt_order( *(it + 1), *it ) ) ) {
+    flows_unsorted = true;
+  }
+}
+
+/* Idle times all move together with last_heard, which doesn't change the
+   order of the flows. */
 void Connection::update_server_idle_time( void ) {
   assert( server );
   for ( std::vector< Flow* >::const_iterator it = flows.begin();
@@ -318,17 +474,18 @@ void Connection::Loss::update(uint64_t seq)
     last_update = now;
     seq_last = seq;
   } else if ( seq >= seq_last - 63 ) {
-    seq_vect |= ( 1 << ( seq_last - seq ) );
+    seq_vect |= ( uint64_t( 1 ) << ( seq_last - seq ) );
   }
-}
 
-int Connection::Loss::get_ratio( void )
-{
+#if HAVE_DECL___BUILTIN_POPCOUNTLL
+  int loss = 64 - __builtin_popcountll( seq_vect );
+#else
   int loss = 0;
   for ( int i = 0; i < 64; i ++)
     if ( ! ( 1 & ( seq_vect >> i ) ) )
       loss ++;
-  return loss * 100 / 64;
+#endif
+  ratio = loss * 100 / 64;
 }
 
 bool Connection::Loss::is_lossy( void )
@@ -336,6 +493,160 @@ bool Connection::Loss::is_lossy( void )
   return seq_vect != uint64_t(-1);
 }
 
+/* Send on the fastest flow, and also on the next non-idle one if the fastest
+   may be idle. */
+void Connection::MinRTTScheduler::start( const std::vector< Flow* > & )
+{
+  possible_idle_send = -1;
+}
+
+bool Connection::MinRTTScheduler::pick( const Flow *flow )
+{
+  return possible_idle_send == -1 ||
+    ( possible_idle_send == 1 && ! flow->idle_time );
+}
+
+void Connection::MinRTTScheduler::sent( const Flow *flow )
+{
+  if ( flow->idle_time && possible_idle_send < 0 ) {
+    possible_idle_send = 1;
+  } else {
+    possible_idle_send = 0;
+  }
+}
+
+/* Like MinRTTScheduler, but keep duplicating the packet on the next flows
+   while the expected loss ratio exceeds the tolerance. */
+void Connection::RedundantScheduler::start( const std::vector< Flow* > & )
+{
+  possible_idle_send = -1;
+  loss_ratio = 100;
+}
+
+bool Connection::RedundantScheduler::pick( const Flow *flow )
+{
+  return possible_idle_send == -1 ||
+    ( loss_ratio > loss_ratio_tolerance && flow->idle_time < MAX_IDLE_TIME ) ||
+    ( possible_idle_send == 1 && ! flow->idle_time );
+}
+
+void Connection::RedundantScheduler::sent( const Flow *flow )
+{
+  loss_ratio = ( loss_ratio * flow->outgoing_loss ) / 100;
+  if ( flow->idle_time && possible_idle_send < 0 ) {
+    possible_idle_send = 1;
+  } else {
+    possible_idle_send = 0;
+  }
+}
+
+/* Smooth weighted round-robin over the working flows, each one weighted by
+   the inverse of its RTT, to aggregate their bandwidth. */
+void Connection::RoundRobinScheduler::start( const std::vector< Flow* > &flows )
+{
+  double total = 0;
+  double best = 0;
+  chosen = NULL;
+
+  for ( std::vector< Flow* >::const_iterator it = flows.begin();
+	it != flows.end();
+	it++ ) {
+    const Flow *flow = *it;
+    if ( flow->idle_time || !flow->RTT_hit ) {
+      continue;
+    }
+    double weight = 1.0 / ( flow->SRTT + 1 );
+    double &c = credit[ flow->flow_id ];
+    c += weight;
+    total += weight;
+    if ( !chosen || c > best ) {
+      chosen = flow;
+      best = c;
+    }
+  }
+
+  if ( chosen ) {
+    credit[ chosen->flow_id ] -= total;
+  } else {
+    fallback.start( flows );
+  }
+}
+
+bool Connection::RoundRobinScheduler::pick( const Flow *flow )
+{
+  return chosen ? flow == chosen : fallback.pick( flow );
+}
+
+void Connection::RoundRobinScheduler::sent( const Flow *flow )
+{
+  if ( !chosen ) {
+    fallback.sent( flow );
+  }
+}
+
+void Connection::Congestion::update( double RTT, uint64_t now )
+{
+  /* The base delay is the minimum RTT seen in the last one or two minutes, so
+     that it follows route changes. */
+  if ( now - base_delay_start >= uint64_t( BASE_DELAY_INTERVAL ) ) {
+    base_delay[ 1 ] = base_delay[ 0 ];
+    base_delay[ 0 ] = RTT;
+    base_delay_start = now;
+  } else if ( RTT < base_delay[ 0 ] ) {
+    base_delay[ 0 ] = RTT;
+  }
+
+  queuing_delay = RTT - MIN( base_delay[ 0 ], base_delay[ 1 ] );
+
+  double off_target = ( TARGET_DELAY - queuing_delay ) / TARGET_DELAY;
+  if ( off_target > 1 ) {
+    off_target = 1;
+  } else if ( off_target < -1 ) {
+    off_target = -1;
+  }
+
+  /* only grow when the rate was actually limiting us */
+  if ( off_target < 0 || limited ) {
+    rate *= 1 + off_target / 8;
+  }
+  if ( rate < MIN_RATE ) {
+    rate = MIN_RATE;
+  } else if ( rate > MAX_RATE ) {
+    rate = MAX_RATE;
+  }
+
+  limited = false;
+}
+
+void Connection::Congestion::sent( size_t bytes, uint64_t now_us )
+{
+  unqueue( bytes );
+
+  /* don't accumulate credit while idle, except for a small burst */
+  if ( next_send + PACING_BURST < now_us ) {
+    next_send = now_us - PACING_BURST;
+  }
+  next_send += uint64_t( bytes * 1000 / rate );
+}
+
+uint64_t Connection::Congestion::delay( uint64_t now_us )
+{
+  /* as if the queued bytes were already sent */
+  uint64_t next = next_send;
+  if ( queued ) {
+    if ( next + PACING_BURST < now_us ) {
+      next = now_us - PACING_BURST;
+    }
+    next += uint64_t( queued * 1000 / rate );
+  }
+
+  if ( next <= now_us ) {
+    return 0;
+  }
+  limited = true;
+  return next - now_us;
+}
+
 uint16_t Connection::Flow::next_flow_id = 0;
 const Connection::Flow Connection::Flow::defaults;
 
@@ -352,10 +663,17 @@ Connection::Flow::Flow( const Addr &s_src, const Addr &s_dst )
     next_probe( defaults.next_probe ),
     idle_time( defaults.idle_time ),
     RTT_hit( defaults.RTT_hit ),
+    fine_RTT( defaults.fine_RTT ),
     SRTT( defaults.SRTT ),
     RTTVAR( defaults.RTTVAR ),
     incoming_loss(),
     outgoing_loss( 100 ),
+    congestion(),
+    cold( false ),
+    packets_sent( 0 ),
+    bytes_sent( 0 ),
+    packets_received( 0 ),
+    bytes_received( 0 ),
     flow_id( next_flow_id++ )
 {
   if ( flow_id == 0xFFFF ) {
@@ -376,10 +694,17 @@ Connection::Flow::Flow( const Addr &s_src, const Addr &s_dst, uint16_t id )
     last_heard( defaults.last_heard ),
     next_probe( defaults.next_probe ),
     RTT_hit( defaults.RTT_hit ),
+    fine_RTT( defaults.fine_RTT ),
     SRTT( defaults.SRTT ),
     RTTVAR( defaults.RTTVAR ),
     incoming_loss(),
     outgoing_loss( 100 ),
+    congestion(),
+    cold( false ),
+    packets_sent( 0 ),
+    bytes_sent( 0 ),
+    packets_received( 0 ),
+    bytes_received( 0 ),
     flow_id( id )
 {
   assert( !next_flow_id ); /* The server should not have initialized any flow. */
@@ -502,12 +827,27 @@ Connection::Connection( uint16_t delay_ack, const char *desired_ip, const char *
     remote_addr(),
     received_remote_addr(),
     flows(),
+    cold_flows(),
+    flows_by_id(),
+    flows_unsorted( false ),
+    last_flows_compaction( 0 ),
     last_flow( NULL ),
     host_addresses(),
     server( true ),
+    fine_timestamps( false ),
     loss_ratio_tolerance( loss_ratio_tolerance ),
+    scheduler( new RedundantScheduler( loss_ratio_tolerance ) ),
     key(),
     session( key ),
+    send_buffer( Session::BUFFER_SIZE ),
+    recv_buffer( Session::BUFFER_SIZE ),
+    corked( 0 ),
+    pending_sends( 0 ),
+    pending_packets(),
+    pending_batch(),
+    packet_buffers(),
+    send_states(),
+    failed_flows(),
     direction( TO_CLIENT ),
     delay_ack_interval( delay_ack ),
     last_heard( -1 ),
@@ -557,6 +897,28 @@ Connection::Connection( uint16_t delay_ack, const char *desired_ip, const char *
   }
 }
 
+Connection::~Connection()
+{
+  delete scheduler;
+  for ( std::vector< AlignedBuffer * >::iterator it = packet_buffers.begin();
+	it != packet_buffers.end();
+	it++ ) {
+    delete *it;
+  }
+}
+
+void Connection::set_scheduler( SchedulerPolicy policy )
+{
+  Scheduler *new_scheduler;
+  switch ( policy ) {
+  case SCHEDULER_MIN_RTT:     new_scheduler = new MinRTTScheduler(); break;
+  case SCHEDULER_ROUND_ROBIN: new_scheduler = new RoundRobinScheduler(); break;
+  default:                    new_scheduler = new RedundantScheduler( loss_ratio_tolerance ); break;
+  }
+  delete scheduler;
+  scheduler = new_scheduler;
+}
+
 bool Connection::Socket::try_bind( int sock, Addr local_addr, int port_low, int port_high )
 {
   for ( int i = port_low; i <= port_high; i++ ) {
@@ -611,12 +973,27 @@ Connection::Connection( uint16_t delay_ack, const char *key_str, const char *ip,
     remote_addr(),
     received_remote_addr(),
     flows(),
+    cold_flows(),
+    flows_by_id(),
+    flows_unsorted( false ),
+    last_flows_compaction( 0 ),
     last_flow( NULL ),
     host_addresses(),
     server( false ),
+    fine_timestamps( false ),
     loss_ratio_tolerance( loss_ratio_tolerance ),
+    scheduler( new RedundantScheduler( loss_ratio_tolerance ) ),
     key( key_str ),
     session( key ),
+    send_buffer( Session::BUFFER_SIZE ),
+    recv_buffer( Session::BUFFER_SIZE ),
+    corked( 0 ),
+    pending_sends( 0 ),
+    pending_packets(),
+    pending_batch(),
+    packet_buffers(),
+    send_states(),
+    failed_flows(),
     direction( TO_SERVER ),
     delay_ack_interval( delay_ack ),
     last_heard( -1 ),
@@ -654,28 +1031,100 @@ Connection::Connection( uint16_t delay_ack, const char *key_str, const char *ip,
 
 void Connection::send_probe( Flow *flow )
 {
-  string empty("");
+  Segment empty = { "", 0 };
   Packet px = new_packet( flow, PROBE_FLAG, empty );
 
-  string p = px.tostring( &session );
+  size_t p_len;
+  {
+    StageTimer timer( STAGE_CRYPTO );
+    p_len = px.tobuffer( &session, send_buffer );
+  }
+  const char *p = send_buffer.data() + Session::PACKET_OFFSET;
 
   log_dbg( LOG_DEBUG_COMMON, "sending probe len %d flow %hu seq %llu local %s remote %s srtt %dms idle %dms "
 	   "iloss %d%% oloss %d%% loss-ratio -1",
-	   (int)p.size(),
+	   (int)p_len,
 	   flow->flow_id, (long long unsigned)flow->next_seq - 1,
 	   flow->src.tostring().c_str(), flow->dst.tostring().c_str(), (int)flow->SRTT, (int)flow->idle_time,
 	   (int)flow->incoming_loss.get_ratio(), (int)flow->outgoing_loss );
 
   ssize_t bytes_sent = sendfromto( flow->dst.sa.sa_family == AF_INET ? sock() : sock6(),
-				   p.data(), p.size(), MSG_DONTWAIT, flow->src, flow->dst );
+				   p, p_len, MSG_DONTWAIT, flow->src, flow->dst );
   if ( bytes_sent < 0 ) {
     flow->idle_time = MAX_IDLE_TIME;
+    check_flow_order( flow );
     log_dbg( LOG_DEBUG_COMMON | LOG_PRINT_ERROR, " failed" );
   } else {
+    flow->packets_sent++;
+    flow->bytes_sent += bytes_sent;
     log_dbg( LOG_DEBUG_COMMON, " success\n" );
   }
 }
 
+void Connection::send_probes( void )
+{
+  uint64_t now = timestamp();
+  for ( std::vector< Flow* >::const_iterator it = flows.begin();
+	it != flows.end();
+	it++ ) {
+    if ( (*it)->next_probe <= now ) {
+      send_probe( *it );
+    }
+  }
+}
+
+/* Host addresses have (probably) changed: don't wait for a send failure or an
+   address request to notice it. */
+void Connection::process_host_addresses( void )
+{
+  if ( !host_addresses.process_notifications() ) {
+    return;
+  }
+
+  if ( server ) {
+    /* let the client know where it can reach us now */
+    send_addresses();
+    return;
+  }
+
+  check_flows( true );
+
+  /* flows from a vanished local address will not work anymore */
+  std::vector< Flow* >::iterator hot = flows.begin();
+  for ( std::vector< Flow* >::iterator it = flows.begin();
+	it != flows.end();
+	it++ ) {
+    if ( !host_addresses.is_host_address( (*it)->src ) ) {
+      (*it)->idle_time = MAX_IDLE_TIME;
+      (*it)->cold = true;
+      cold_flows.push_back( *it );
+      scheduler->removed( *it );
+    } else {
+      *hot++ = *it;
+    }
+  }
+  flows.erase( hot, flows.end() );
+
+  /* and those of a returning address may work again */
+  std::vector< Flow* > returning;
+  for ( std::vector< Flow* >::const_iterator it = cold_flows.begin();
+	it != cold_flows.end();
+	it++ ) {
+    if ( host_addresses.is_host_address( (*it)->src ) ) {
+      returning.push_back( *it );
+    }
+  }
+  for ( std::vector< Flow* >::const_iterator it = returning.begin();
+	it != returning.end();
+	it++ ) {
+    (*it)->next_probe = 0;
+    warm_flow( *it );
+  }
+
+  /* probe the new flows, to get their RTT as soon as possible */
+  send_probes();
+}
+
 void Connection::send_addresses( void )
 {
   assert( server );
@@ -714,12 +1163,19 @@ void Connection::send_addresses( void )
   send( ADDR_FLAG, payload );
 }
 
-ssize_t Connection::sendfromto( int sock, const char *buffer, size_t size, int flags, Addr from, Addr to )
+/* Room for the source address of one outgoing packet. */
+union SendControl {
+  struct cmsghdr align;
+  char buf[ 256 ];
+};
+
+/* Fills in msghdr to send size bytes at buffer from one of our addresses to
+   a remote one.  It points to iov, control and to. */
+static void prepare_msghdr( struct msghdr &msghdr, struct iovec &iov, SendControl &control,
+			    const char *buffer, size_t size, const Addr &from, const Addr &to )
 {
-  struct msghdr msghdr;
   struct cmsghdr *cmsghdr;
-  struct iovec iov;
-  char cmsg[256];
+  char *cmsg = control.buf;
   const int family = to.sa.sa_family;
 
   iov.iov_base = (void*) buffer;
@@ -777,89 +1233,284 @@ ssize_t Connection::sendfromto( int sock, const char *buffer, size_t size, int f
   if ( msghdr.msg_controllen == 0 ) {
     msghdr.msg_control = NULL;
   }
+}
+
+ssize_t Connection::sendfromto( int sock, const char *buffer, size_t size, int flags, Addr from, Addr to )
+{
+  struct msghdr msghdr;
+  struct iovec iov;
+  SendControl control;
+
+  prepare_msghdr( msghdr, iov, control, buffer, size, from, to );
   /* send the message ! */
   return sendmsg( sock, &msghdr, flags );
 }
 
-void Connection::send( string s )
+void Connection::send( const string &s )
 {
   send( 0, s);
 }
 
-void Connection::send( uint8_t flags, string s )
+void Connection::send( uint8_t flags, const string &s )
 {
   if ( server && !last_flow ) {
     return;
   }
 
-  have_send_exception = true;
   uint64_t now = timestamp();
-  ssize_t bytes_sent = -1;
-  int possible_idle_send = -1; /* -1: undefined, 0: false, 1: true. */
-  int loss_ratio = 100;
-  int step = 1; /* debug only */
 
   log_dbg( LOG_DEBUG_COMMON, "timestamp %llu\n", (long long unsigned)now );
 
-  /* We try to achieve:
-       - sending on the fasted path (RTT based only),
-       - sending on a non-idle flow (if it exists),
-       - having less than [loss_ratio_tolerance] loss ratio. */
-
   if ( server ) {
     update_server_idle_time();
   }
 
+  Segment payload = { s.data(), s.size() };
+  schedule( flags, payload, pending_sends++, true );
+
+  if ( !corked ) {
+    flush();
+  }
+
+  if ( server ) {
+    if ( now - last_heard > SERVER_ASSOCIATION_TIMEOUT ) {
+      last_flow = NULL;
+      fprintf( stderr, "Server now detached from client.\n" );
+    }
+  } else { /* client */
+    if ( ( now - last_port_choice > PORT_HOP_INTERVAL )
+	 && ( now - last_roundtrip_success > PORT_HOP_INTERVAL ) ) {
+      hop_port();
+    }
+    check_remote_addr();
+  }
+}
+
+/* Queue the payload for flush() on the flows the scheduler picks, leaving out
+   those which already failed in this flush(), and probe the others if asked
+   to.  Returns the number of packets queued. */
+size_t Connection::schedule( uint8_t flags, const Segment &payload, size_t send, bool probe )
+{
+  uint64_t now = timestamp();
+  size_t queued = 0;
+
   sort_flows();
-  for ( std::vector< Flow* >::const_iterator it = flows.begin();
-	it != flows.end();
+  const std::vector< Flow* > *candidates = &flows;
+  std::vector< Flow* > working;
+  if ( !failed_flows.empty() ) {
+    for ( std::vector< Flow* >::const_iterator it = flows.begin();
+	  it != flows.end();
+	  it++ ) {
+      if ( failed_flows.find( (*it)->flow_id ) == failed_flows.end() ) {
+	working.push_back( *it );
+      }
+    }
+    candidates = &working;
+  }
+
+  scheduler->start( *candidates );
+  for ( std::vector< Flow* >::const_iterator it = candidates->begin();
+	it != candidates->end();
 	it ++ ) {
     Flow *flow = *it;
 
-    /*
-      Send data if we did't send anything, or if the expected loss ratio is not
-      reach and the flow seems not to be completely idle, or if we only did
-      (possibly) idle sent, and that flow is not idle.  Send a probe otherwise.
-    */
-
-    if ( possible_idle_send == -1 ||
-	 ( loss_ratio > loss_ratio_tolerance && flow->idle_time < MAX_IDLE_TIME ) ||
-	 ( possible_idle_send == 1 && ! flow->idle_time ) ) {
-      Packet px = new_packet( flow, flags, s );
-      string p = px.tostring( &session );
+    /* Send data where the scheduler wants it, and a probe otherwise. */
+
+    if ( scheduler->pick( flow ) ) {
+      Packet px = new_packet( flow, flags, payload );
+
+      if ( pending_packets.size() == packet_buffers.size() ) {
+	packet_buffers.push_back( new AlignedBuffer( Session::BUFFER_SIZE ) );
+      }
+      AlignedBuffer *buf = packet_buffers[ pending_packets.size() ];
+
+      BatchPacket batch_packet = { px.nonce_val(), buf, px.gather( *buf ) };
+      pending_batch.push_back( batch_packet );
+      PendingPacket pending_packet = { flow->flow_id, px.seq, batch_packet.len + Session::PACKET_OVERHEAD,
+				       send, int( ++queued ), 0, 0 };
+      pending_packets.push_back( pending_packet );
+
+      flow->congestion.queue( pending_packet.wire_len );
+      scheduler->sent( flow );
+
+    } else if ( probe && !server && ( flow->next_probe <= now || flow->rto <= now ) ) {
+      send_probe(flow);
+    }
+  }
+
+  return queued;
+}
+
+void Connection::uncork( void )
+{
+  assert( corked );
+  if ( --corked == 0 ) {
+    flush();
+  }
+}
+
+void Connection::drop_pending( void )
+{
+  for ( size_t i = 0; i < pending_packets.size(); i++ ) {
+    std::map< uint16_t, Flow* >::iterator flow_it = flows_by_id.find( pending_packets[ i ].flow_id );
+    if ( flow_it != flows_by_id.end() ) {
+      flow_it->second->congestion.unqueue( pending_packets[ i ].wire_len );
+    }
+  }
+  pending_sends = 0;
+  pending_packets.clear();
+  pending_batch.clear();
+}
+
+/* Sends pending packets [first, last) and records the result of each.
+   Where sendmmsg() is available, a run of packets on the same socket takes
+   one system call instead of one each. */
+void Connection::transmit( size_t first, size_t last )
+{
+#ifdef HAVE_SENDMMSG
+  static const size_t MAX_MESSAGES = 32;
+  struct mmsghdr messages[ MAX_MESSAGES ];
+  struct iovec iovs[ MAX_MESSAGES ];
+  SendControl controls[ MAX_MESSAGES ];
+
+  while ( first < last ) {
+    int sock_to_send = -1;
+    size_t count = 0;
+    for ( ; first + count < last && count < MAX_MESSAGES; count++ ) {
+      const BatchPacket &batch_packet = pending_batch[ first + count ];
+      const Flow *flow = flows_by_id.find( pending_packets[ first + count ].flow_id )->second;
+      const int sock_for_flow = flow->dst.sa.sa_family == AF_INET ? sock() : sock6();
+      if ( count && sock_for_flow != sock_to_send ) {
+	break;
+      }
+      sock_to_send = sock_for_flow;
+      prepare_msghdr( messages[ count ].msg_hdr, iovs[ count ], controls[ count ],
+		      batch_packet.buf->data() + Session::PACKET_OFFSET, batch_packet.len,
+		      flow->src, flow->dst );
+      messages[ count ].msg_len = 0;
+    }
+
+    /* On failure, sendmmsg() reports the packets sent before it, and the
+       error on the next call, which starts with the failed packet. */
+    int sent = sendmmsg( sock_to_send, messages, count, MSG_DONTWAIT );
+    if ( sent < 1 ) {
+      pending_packets[ first ].sent = -1;
+      pending_packets[ first ].error = errno;
+      first++;
+      continue;
+    }
+    for ( int i = 0; i < sent; i++ ) {
+      pending_packets[ first + i ].sent = messages[ i ].msg_len;
+    }
+    first += sent;
+  }
+#else
+  for ( ; first < last; first++ ) {
+    const BatchPacket &batch_packet = pending_batch[ first ];
+    PendingPacket &pending_packet = pending_packets[ first ];
+    const Flow *flow = flows_by_id.find( pending_packet.flow_id )->second;
+    pending_packet.sent = sendfromto( flow->dst.sa.sa_family == AF_INET ? sock() : sock6(),
+				      batch_packet.buf->data() + Session::PACKET_OFFSET, batch_packet.len,
+				      MSG_DONTWAIT, flow->src, flow->dst );
+    pending_packet.error = errno;
+  }
+#endif
+}
+
+void Connection::flush( void )
+{
+  int saved_errno = 0;
+  bool lost = false;
+
+  /* Each round sends the queued packets, then queues again on the flows
+     which did not fail the sends none of whose copies went out.  Every
+     failure leaves a flow out, so this ends. */
+  while ( pending_sends ) {
+    try {
+      if ( !pending_batch.empty() ) {
+	StageTimer timer( STAGE_CRYPTO );
+	session.encrypt_batch( &pending_batch[ 0 ], pending_batch.size() );
+      }
+    } catch ( ... ) {
+      drop_pending();
+      failed_flows.clear();
+      throw;
+    }
+
+    transmit( 0, pending_packets.size() );
+
+    send_states.assign( pending_sends, SEND_LOST );
+    for ( size_t i = 0; i < pending_packets.size(); i++ ) {
+      const PendingPacket &pending_packet = pending_packets[ i ];
+      const BatchPacket &batch_packet = pending_batch[ i ];
+      Flow *flow = flows_by_id.find( pending_packet.flow_id )->second;
+
       log_dbg( LOG_DEBUG_COMMON, "sending data len %d try %d flow %hu seq %llu local %s remote %s "
-	       "srtt %dms idle %dms iloss %d%% oloss %d%%", (int) p.size(), step,
-	       flow->flow_id, (long long unsigned) flow->next_seq - 1, flow->src.tostring().c_str(),
+	       "srtt %dms idle %dms iloss %d%% oloss %d%%", (int) batch_packet.len, pending_packet.step,
+	       flow->flow_id, (long long unsigned) pending_packet.seq, flow->src.tostring().c_str(),
 	       flow->dst.tostring().c_str(), (int)flow->SRTT, (int)flow->idle_time,
 	       (int)flow->incoming_loss.get_ratio(), (int)flow->outgoing_loss );
-      bytes_sent = sendfromto( flow->dst.sa.sa_family == AF_INET ? sock() : sock6(),
-			       p.data(), p.size(), MSG_DONTWAIT, flow->src, flow->dst );
-      if ( bytes_sent == static_cast<ssize_t>( p.size() ) ) {
-	have_send_exception = false;
-	loss_ratio = ( loss_ratio * flow->outgoing_loss ) / 100;
-	if ( flow->idle_time && possible_idle_send < 0 ) {
-	  possible_idle_send = 1;
-	} else {
-	  possible_idle_send = 0;
-	}
-	log_dbg( LOG_DEBUG_COMMON, " loss-ratio %d success\n", loss_ratio );
-      } else if ( bytes_sent < 0 ) {
-	if ( errno == EMSGSIZE ) {
-	  flow->MTU = 500; /* payload MTU of last resort */
+      if ( pending_packet.sent == static_cast<ssize_t>( batch_packet.len ) ) {
+	send_states[ pending_packet.send ] = SEND_DELIVERED;
+	flow->congestion.sent( pending_packet.wire_len, timestamp_us() );
+	flow->packets_sent++;
+	flow->bytes_sent += pending_packet.sent;
+	trace( TRACE_PACKET_SENT, flow->flow_id, batch_packet.len, pending_packet.seq );
+	log_dbg( LOG_DEBUG_COMMON, " success\n" );
+      } else {
+	flow->congestion.unqueue( pending_packet.wire_len );
+	if ( pending_packet.sent < 0 ) {
+	  errno = saved_errno = pending_packet.error;
+	  if ( errno == EMSGSIZE ) {
+	    flow->MTU = 500; /* payload MTU of last resort */
+	  } else {
+	    flow->idle_time = MAX_IDLE_TIME;
+	    check_flow_order( flow );
+	  }
+	  log_dbg( LOG_DEBUG_COMMON | LOG_PRINT_ERROR, " failed" );
 	} else {
-	  flow->idle_time = MAX_IDLE_TIME;
+	  log_dbg( LOG_DEBUG_COMMON, " failed (partial)\n" );
 	}
-	log_dbg( LOG_DEBUG_COMMON | LOG_PRINT_ERROR, " loss-ratio %d failed", loss_ratio );
-      } else {
-	log_dbg( LOG_DEBUG_COMMON, " loss-ratio %d failed (partial)\n", loss_ratio );
+	failed_flows.insert( flow->flow_id );
+	scheduler->failed( flow );
       }
-      step++;
+    }
 
-    } else if ( !server && ( flow->next_probe <= now || flow->rto <= now ) ) {
-      send_probe(flow);
+    /* The payload of an undelivered send is in the packets built for it:
+       decrypt one in place and queue it again.  The new packets go into the
+       buffers after this round's, which are then recycled. */
+    const size_t round = pending_packets.size();
+    const size_t sends = pending_sends;
+    pending_sends = 0;
+    for ( size_t i = 0; i < round; i++ ) {
+      char &state = send_states[ pending_packets[ i ].send ];
+      if ( state != SEND_LOST ) {
+	continue;
+      }
+      state = SEND_REQUEUED;
+
+      const BatchPacket &batch_packet = pending_batch[ i ];
+      Packet px( *batch_packet.buf, batch_packet.len, &session );
+      if ( schedule( px.flags, px.payload, pending_sends, false ) ) {
+	pending_sends++;
+      } else {
+	lost = true;
+      }
     }
+    for ( size_t send = 0; send < sends; send++ ) {
+      if ( send_states[ send ] == SEND_LOST ) {
+	lost = true; /* no flow took it at all */
+      }
+    }
+
+    pending_packets.erase( pending_packets.begin(), pending_packets.begin() + round );
+    pending_batch.erase( pending_batch.begin(), pending_batch.begin() + round );
+    std::rotate( packet_buffers.begin(), packet_buffers.begin() + round,
+		 packet_buffers.begin() + round + pending_packets.size() );
   }
+  failed_flows.clear();
 
+  have_send_exception = lost;
   if ( have_send_exception ) {
     if ( !server ) {
       check_flows( false );
@@ -867,20 +1518,7 @@ void Connection::send( uint8_t flags, string s )
     /* Notify the frontend on sendmsg() failure, but don't alter control flow.
        sendmsg() success is not very meaningful because packets can be lost in
        flight anyway. */
-    send_exception = NetworkException( "sendmsg", errno );
-  }
-
-  if ( server ) {
-    if ( now - last_heard > SERVER_ASSOCIATION_TIMEOUT ) {
-      last_flow = NULL;
-      fprintf( stderr, "Server now detached from client.\n" );
-    }
-  } else { /* client */
-    if ( ( now - last_port_choice > PORT_HOP_INTERVAL )
-	 && ( now - last_roundtrip_success > PORT_HOP_INTERVAL ) ) {
-      hop_port();
-    }
-    check_remote_addr();
+    send_exception = NetworkException( "sendmsg", saved_errno );
   }
 }
 
@@ -922,7 +1560,6 @@ string Connection::recv_one( int sock_to_recv )
   struct iovec msg_iovec;
   uint64_t now = timestamp();
 
-  char msg_payload[ Session::RECEIVE_MTU ];
   char msg_control[ Session::RECEIVE_MTU ];
 
   /* receive source address */
@@ -930,7 +1567,7 @@ string Connection::recv_one( int sock_to_recv )
   header.msg_namelen = packet_remote_addr.addrlen;
 
   /* receive payload */
-  msg_iovec.iov_base = msg_payload;
+  msg_iovec.iov_base = recv_buffer.data() + Session::PACKET_OFFSET;
   msg_iovec.iov_len = Session::RECEIVE_MTU;
   header.msg_iov = &msg_iovec;
   header.msg_iovlen = 1;
@@ -998,9 +1635,12 @@ string Connection::recv_one( int sock_to_recv )
 
   packet_remote_addr.addrlen = header.msg_namelen;
 
-  Packet p( string( msg_payload, received_len ), &session );
+  StageTimer decrypt_timer( STAGE_CRYPTO );
+  Packet p( recv_buffer, received_len, &session );
+  decrypt_timer.stop();
 
   Flow *flow_info = get_flow( p.flow_id );
+  trace( TRACE_PACKET_RECEIVED, p.flow_id, received_len, p.seq );
   log_dbg( LOG_DEBUG_COMMON, "timestamp %llu\n", (long long unsigned)now );
   log_dbg( LOG_DEBUG_COMMON, "receiving %s length %d flow %d seq %llu local %s remote %s ",
 	   p.is_probe() ? "probe" : "data", (int)received_len, (int)p.flow_id,
@@ -1009,7 +1649,7 @@ string Connection::recv_one( int sock_to_recv )
   if ( !flow_info ) {
     fatal_assert( server ); /* if client, then server answers with an unknown flow ID. This is terrific. */
     flow_info = new Flow( packet_local_addr, packet_remote_addr, p.flow_id );
-    flows.push_back( flow_info );
+    add_flow( flow_info );
   } else if ( server ) {
     /* the destination may change, especially when client hop port.  Not sure
        about the source, but anyway... */
@@ -1020,20 +1660,27 @@ string Connection::recv_one( int sock_to_recv )
   dos_assert( p.direction == (server ? TO_SERVER : TO_CLIENT) ); /* prevent malicious playback to sender */
 
   flow_info->incoming_loss.update(p.seq);
+  flow_info->packets_received++;
+  flow_info->bytes_received += received_len;
 
   if ( p.seq >= flow_info->expected_receiver_seq ) { /* don't use out-of-order packets for timestamp or targeting */
     flow_info->expected_receiver_seq = p.seq + 1; /* this is security-sensitive because a replay attack could otherwise
 						     screw up the timestamp and targeting */
     flow_info->outgoing_loss = p.loss_ratio;
 
+    if ( p.accepts_fine_timestamps() ) {
+      fine_timestamps = true;
+    }
+
     if ( p.timestamp != uint16_t(-1) ) {
-      flow_info->saved_timestamp = p.timestamp;
-      flow_info->saved_timestamp_received_at = now;
+      flow_info->saved_timestamp = p.fine_timestamp();
+      flow_info->saved_timestamp_received_at = timestamp_us();
 
       if ( congestion_experienced ) {
 	/* signal counterparty to slow down */
 	/* this will gradually slow the counterparty down to the minimum frame rate */
-	flow_info->saved_timestamp -= CONGESTION_TIMESTAMP_PENALTY;
+	flow_info->saved_timestamp = ( flow_info->saved_timestamp + FINE_TIMESTAMP_PERIOD
+				       - CONGESTION_TIMESTAMP_PENALTY * 1000 ) % FINE_TIMESTAMP_PERIOD;
 	if ( server ) {
 	  fprintf( stderr, "Received explicit congestion notification.\n" );
 	}
@@ -1041,8 +1688,7 @@ string Connection::recv_one( int sock_to_recv )
     }
 
     if ( p.timestamp_reply != uint16_t(-1) ) {
-      uint16_t now = timestamp16();
-      double R = timestamp_diff( now, p.timestamp_reply );
+      double R = timestamp_fine_diff( timestamp_fine(), p.fine_timestamp_reply() ) / 1000.0;
 
       if ( R < 5000 ) { /* ignore large values, e.g. server was Ctrl-Zed */
 	if ( !flow_info->RTT_hit ) { /* first measurement */
@@ -1056,10 +1702,14 @@ string Connection::recv_one( int sock_to_recv )
 	  flow_info->RTTVAR = (1 - beta) * flow_info->RTTVAR + ( beta * fabs( flow_info->SRTT - R ) );
 	  flow_info->SRTT = (1 - alpha) * flow_info->SRTT + ( alpha * R );
 	}
+	flow_info->fine_RTT = p.has_fine_timestamps();
+	flow_info->congestion.update( R, now );
+	trace( TRACE_RTT, p.flow_id, 0, uint64_t( R * 1000 ), uint64_t( flow_info->SRTT * 1000 ) );
       }
-      log_dbg( LOG_DEBUG_COMMON, "rtt %ums srtt %ums", (unsigned int)R, (unsigned int)flow_info->SRTT );
+      log_dbg( LOG_DEBUG_COMMON, "rtt %.3fms srtt %.3fms qdelay %.3fms rate %dB/ms", R, flow_info->SRTT,
+	       flow_info->congestion.queuing_delay, (int)flow_info->congestion.rate );
     } else {
-      log_dbg( LOG_DEBUG_COMMON, "rtt NA srtt %ums", (unsigned int)flow_info->SRTT );
+      log_dbg( LOG_DEBUG_COMMON, "rtt NA srtt %.3fms", flow_info->SRTT );
     }
 
     log_dbg( LOG_DEBUG_COMMON, " iloss %d%% oloss %d%%\n",
@@ -1069,6 +1719,10 @@ string Connection::recv_one( int sock_to_recv )
     flow_info->last_heard = last_heard = timestamp();
     flow_info->idle_time = 0;
     flow_info->rto = uint64_t(-1);
+    check_flow_order( flow_info );
+    if ( server ) {
+      compact_flows();
+    }
 
     if ( server ) { /* only client can roam */
       bool has_roam = last_flow != flow_info &&
@@ -1078,7 +1732,7 @@ string Connection::recv_one( int sock_to_recv )
 	  last_flow = flow_info;
 	}
 	send_probe( flow_info );
-	return p.payload;
+	return string( p.payload.data, p.payload.len );
       }
 
       if ( has_roam ) {
@@ -1102,13 +1756,14 @@ string Connection::recv_one( int sock_to_recv )
     if ( server ) {
       send_addresses();
     } else {
-      parse_received_addresses( p.payload );
+      parse_received_addresses( string( p.payload.data, p.payload.len ) );
       check_flows( true );
-      p.payload = string("");
+      return string( "" );
     }
   }
 
-  return p.payload; /* we do return out-of-order or duplicated packets to caller */
+  /* we do return out-of-order or duplicated packets to caller */
+  return string( p.payload.data, p.payload.len );
 }
 
 void Connection::parse_received_addresses( string payload )
@@ -1192,6 +1847,21 @@ uint16_t Network::timestamp16( void )
   return ts;
 }
 
+uint64_t Network::timestamp_us( void )
+{
+  return frozen_timestamp_us();
+}
+
+uint32_t Network::timestamp_fine( void )
+{
+  return uint32_t( timestamp16() ) * 1000 + timestamp_us() % 1000;
+}
+
+uint32_t Network::timestamp_fine_diff( uint32_t tsnew, uint32_t tsold )
+{
+  return ( tsnew + FINE_TIMESTAMP_PERIOD - tsold ) % FINE_TIMESTAMP_PERIOD;
+}
+
 uint16_t Network::timestamp_diff( uint16_t tsnew, uint16_t tsold )
 {
   int diff = tsnew - tsold;
@@ -1205,12 +1875,23 @@ uint16_t Network::timestamp_diff( uint16_t tsnew, uint16_t tsold )
   return diff;
 }
 
+uint64_t Connection::pacing_delay( void )
+{
+  if ( flows.empty() ) {
+    return 0;
+  }
+  sort_flows();
+  uint64_t delay = flows.front()->congestion.delay( timestamp_us() );
+  return ( delay + 999 ) / 1000;
+}
+
 uint64_t Connection::timeout( void ) const
 {
   const Flow *flow = last_flow ? last_flow : &Flow::defaults;
+  const uint64_t min_RTO = flow->fine_RTT ? MIN_RTO_FINE : MIN_RTO;
   uint64_t RTO = lrint( ceil( flow->SRTT + 4 * flow->RTTVAR ) );
-  if ( RTO < MIN_RTO ) {
-    RTO = MIN_RTO;
+  if ( RTO < min_RTO ) {
+    RTO = min_RTO;
   } else if ( RTO > MAX_RTO ) {
     RTO = MAX_RTO;
   }
@@ -1242,6 +1923,43 @@ Connection::Socket & Connection::Socket::operator=( const Socket & other )
   return *this;
 }
 
+void Connection::write_metrics( Metrics &metrics ) const
+{
+  static const struct {
+    const char *name, *type, *help;
+  } families[] = {
+    { "mosh_flow_srtt_seconds", "gauge", "Smoothed round-trip time." },
+    { "mosh_flow_rttvar_seconds", "gauge", "Round-trip time variation." },
+    { "mosh_flow_incoming_loss_ratio", "gauge", "Share of the peer's packets lost on the way here." },
+    { "mosh_flow_outgoing_loss_ratio", "gauge", "Share of our packets lost, as reported by the peer." },
+    { "mosh_flow_packets_sent_total", "counter", "Datagrams sent, probes included." },
+    { "mosh_flow_bytes_sent_total", "counter", "Bytes sent, probes included." },
+    { "mosh_flow_packets_received_total", "counter", "Datagrams received." },
+    { "mosh_flow_bytes_received_total", "counter", "Bytes received." },
+  };
+
+  for ( size_t i = 0; i < sizeof( families ) / sizeof( families[ 0 ] ); i++ ) {
+    metrics.family( families[ i ].name, families[ i ].type, families[ i ].help );
+    for ( std::map< uint16_t, Flow* >::const_iterator it = flows_by_id.begin();
+	  it != flows_by_id.end();
+	  it++ ) {
+      const Flow *flow = it->second;
+      double value = 0;
+      switch ( i ) {
+      case 0: value = flow->SRTT / 1000.0; break;
+      case 1: value = flow->RTTVAR / 1000.0; break;
+      case 2: value = flow->incoming_loss.get_ratio() / 100.0; break;
+      case 3: value = flow->outgoing_loss / 100.0; break;
+      case 4: value = flow->packets_sent; break;
+      case 5: value = flow->bytes_sent; break;
+      case 6: value = flow->packets_received; break;
+      case 7: value = flow->bytes_received; break;
+      }
+      metrics.sample( families[ i ].name, "flow", flow->flow_id, value );
+    }
+  }
+}
+
 bool Connection::parse_portrange( const char * desired_port, int & desired_port_low, int & desired_port_high )
 {
   /* parse "port" or "portlow:porthigh" */
@@ -1288,3 +2006,18 @@ bool Connection::parse_portrange( const char * desired_port, int & desired_port_
 
   return true;
 }
+
+bool Connection::parse_scheduler( const char * name, SchedulerPolicy & policy )
+{
+  if ( !strcmp( name, "minrtt" ) ) {
+    policy = SCHEDULER_MIN_RTT;
+  } else if ( !strcmp( name, "redundant" ) ) {
+    policy = SCHEDULER_REDUNDANT;
+  } else if ( !strcmp( name, "roundrobin" ) ) {
+    policy = SCHEDULER_ROUND_ROBIN;
+  } else {
+    fprintf( stderr, "Unknown scheduler %s (minrtt, redundant or roundrobin)\n", name );
+    return false;
+  }
+  return true;
+}
@@ -36,6 +36,7 @@
 #include <stdint.h>
 #include <deque>
 #include <map>
+#include <set>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <string>
@@ -47,16 +48,25 @@
 
 #include "crypto.h"
 #include "addresses.h"
+#include "metrics.h"
 
 using namespace Crypto;
 
 namespace Network {
-  static const unsigned int MOSH_PROTOCOL_VERSION = 2; /* bumped for echo-ack */
+  static const unsigned int MOSH_PROTOCOL_VERSION = 3; /* bumped for the alternate screen and reflow */
 
   uint64_t timestamp( void );
   uint16_t timestamp16( void );
   uint16_t timestamp_diff( uint16_t tsnew, uint16_t tsold );
 
+  /* Fine timestamps: a 16-bit millisecond timestamp and its microseconds,
+     as one count of microseconds modulo 65536 ms. */
+  static const uint32_t FINE_TIMESTAMP_PERIOD = 65536 * 1000;
+  uint64_t timestamp_us( void );
+  uint32_t timestamp_fine( void );
+  uint32_t timestamp_fine_diff( uint32_t tsnew, uint32_t tsold );
+  static const uint32_t FINE_TIMESTAMP_NONE = 65535 * 1000; /* uint16_t(-1) in ms */
+
   class NetworkException : public std::exception {
   public:
     string function;
@@ -76,36 +86,65 @@ namespace Network {
     TO_CLIENT = 1
   };
 
+  /* How packets are spread over the available flows */
+  enum SchedulerPolicy {
+    SCHEDULER_MIN_RTT,           /* fastest flow only */
+    SCHEDULER_REDUNDANT,         /* duplicate until the loss tolerance is met */
+    SCHEDULER_ROUND_ROBIN        /* alternate flows, weighted by their speed */
+  };
+
   class Packet {
   public:
     uint64_t seq;
     Direction direction;
     uint16_t timestamp, timestamp_reply;
+    uint16_t timestamp_frac, timestamp_reply_frac; /* us past the ms, if has_fine_timestamps() */
     uint16_t flow_id;
     uint8_t flags;
     uint8_t loss_ratio;
-    string payload;
+    /* Not owned: the data the packet is built from, or the buffer it was
+       decrypted in, which must outlive the packet. */
+    Segment payload;
     
     Packet( uint64_t s_seq, Direction s_direction,
-	    uint16_t s_timestamp, uint16_t s_timestamp_reply,
+	    uint32_t s_timestamp, uint32_t s_timestamp_reply, /* fine timestamps */
 	    uint16_t s_flow_id, uint8_t s_flags, uint8_t s_loss,
-	    string s_payload )
+	    const Segment &s_payload )
       : seq( s_seq ), direction( s_direction ),
-	timestamp( s_timestamp ), timestamp_reply( s_timestamp_reply ),
+	timestamp( s_timestamp / 1000 ), timestamp_reply( s_timestamp_reply / 1000 ),
+	timestamp_frac( s_timestamp % 1000 ), timestamp_reply_frac( s_timestamp_reply % 1000 ),
         flow_id( s_flow_id ), flags( s_flags ), loss_ratio( s_loss ), payload( s_payload )
     {}
     
-    Packet( string coded_packet, Session *session );
-    
+    /* Decrypts in place; see Session::decrypt(). */
+    Packet( AlignedBuffer &buf, size_t len, Session *session );
+
     bool is_probe( void );
     bool is_addr_msg( void );
-    string tostring( Session *session );
+    bool has_fine_timestamps( void );
+    bool accepts_fine_timestamps( void );
+    uint32_t fine_timestamp( void ) const { return timestamp * 1000 + timestamp_frac; }
+    uint32_t fine_timestamp_reply( void ) const { return timestamp_reply * 1000 + timestamp_reply_frac; }
+    /* Returns the length of the packet written at buf.data() + Session::PACKET_OFFSET. */
+    size_t tobuffer( Session *session, AlignedBuffer &buf );
+    /* Puts the plaintext in buf for Session::encrypt_batch(); returns its length. */
+    size_t gather( AlignedBuffer &buf );
+    uint64_t nonce_val( void ) const;
+
+  private:
+    static const size_t MAX_HEADER_LEN = 4 * sizeof( uint16_t ) + 2 * sizeof( uint8_t );
+
+    size_t header( uint8_t *out );
+    void parse( uint64_t nonce_val, const char *text, size_t len );
   };
 
   class Connection {
   private:
     static const int DEFAULT_SEND_MTU = 1300;
     static const uint64_t MIN_RTO = 50; /* ms */
+    /* Without the millisecond error of coarse RTT samples, the floor only
+       has to cover the timer granularity of the event loops. */
+    static const uint64_t MIN_RTO_FINE = 10; /* ms */
     static const uint64_t MAX_RTO = 1000; /* ms */
 
     static const int PORT_RANGE_LOW  = 60001;
@@ -120,22 +159,63 @@ namespace Network {
     static const unsigned int MAX_PORTS_OPEN             = 10;
     static const unsigned int MAX_OLD_SOCKET_AGE         = 60000;
 
+    static const unsigned int COLD_FLOW_AGE              = 40000;
+    static const unsigned int FLOW_COMPACTION_INTERVAL   = 1000;
+
     static const int CONGESTION_TIMESTAMP_PENALTY = 500; /* ms */
 
     class Loss {
+    private:
+      int ratio; /* kept up to date by update() */
     public:
       uint64_t seq_last;
       uint64_t seq_vect;
       uint64_t last_update;
       uint8_t acked;
       Loss( void )
-	: seq_last( 0), seq_vect( uint64_t(-1) ), acked( 0 )
+	: ratio( 0 ), seq_last( 0), seq_vect( uint64_t(-1) ), acked( 0 )
       {}
       void update(uint64_t seq);
-      int get_ratio( void ); /* return integer between 0 and 100 */
+      int get_ratio( void ) const { return ratio; } /* return integer between 0 and 100 */
       bool is_lossy( void ); /* true if one packet is loss (or reordered) */
     };
 
+    /* Delay-based rate control, in the style of LEDBAT: the sending rate grows
+       while the queuing delay (RTT above the base RTT) stays under the
+       target, and shrinks when it exceeds it.  Packets are paced at that
+       rate. */
+    class Congestion {
+    private:
+      double base_delay[ 2 ]; /* min RTT of the current and previous minute */
+      uint64_t base_delay_start;
+      uint64_t next_send; /* us, pacing clock */
+      size_t queued; /* bytes waiting in flush() */
+      bool limited; /* the pacer held a packet since the last RTT sample */
+    public:
+      double rate; /* bytes per ms */
+      double queuing_delay; /* ms */
+      Congestion( void )
+	: base_delay(), base_delay_start( 0 ), next_send( 0 ), queued( 0 ), limited( false ),
+	rate( INITIAL_RATE ), queuing_delay( 0 )
+      {
+	base_delay[ 0 ] = base_delay[ 1 ] = MAX_BASE_DELAY;
+      }
+      void update( double RTT, uint64_t now );
+      /* Queued bytes hold the pacer back, but only sent ones advance its clock. */
+      void queue( size_t bytes ) { queued += bytes; }
+      void unqueue( size_t bytes ) { assert( queued >= bytes ); queued -= bytes; }
+      void sent( size_t bytes, uint64_t now_us );
+      uint64_t delay( uint64_t now_us ); /* us before the next packet can leave */
+
+      static const int TARGET_DELAY = 25; /* ms */
+      static const int INITIAL_RATE = 250; /* bytes per ms */
+      static const int MIN_RATE = 4;
+      static const int MAX_RATE = 125000;
+      static const int MAX_BASE_DELAY = 5000; /* ms */
+      static const int BASE_DELAY_INTERVAL = 60000; /* ms */
+      static const int PACING_BURST = 2000; /* us */
+    };
+
     class Flow {
     private:
       static uint16_t next_flow_id;
@@ -143,7 +223,8 @@ namespace Network {
 	: src( Addr() ), dst( Addr() ), MTU( DEFAULT_SEND_MTU ), next_seq( 0 ),
 	expected_receiver_seq( 0 ), saved_timestamp( -1 ), saved_timestamp_received_at( 0 ),
 	rto( uint64_t(-1) ), last_heard( 0 ), next_probe( 0 ), idle_time( 0 ),
-	RTT_hit( false ), SRTT( 1000 ), RTTVAR( 500 ), flow_id( 0 )
+	RTT_hit( false ), fine_RTT( false ), SRTT( 1000 ), RTTVAR( 500 ), cold( false ),
+	packets_sent( 0 ), bytes_sent( 0 ), packets_received( 0 ), bytes_received( 0 ), flow_id( 0 )
       {}
 
     public:
@@ -153,22 +234,27 @@ namespace Network {
       int MTU;
       uint64_t next_seq;
       uint64_t expected_receiver_seq;
-      uint16_t saved_timestamp;
-      uint64_t saved_timestamp_received_at;
+      uint32_t saved_timestamp; /* fine timestamp */
+      uint64_t saved_timestamp_received_at; /* us */
       uint64_t rto;
       uint64_t last_heard;
       uint64_t next_probe;
       unsigned int idle_time;
       bool RTT_hit;
-      double SRTT;
+      bool fine_RTT; /* the last RTT sample had sub-ms precision */
+      double SRTT; /* ms, with sub-ms precision when the peer sends fine timestamps */
       double RTTVAR;
       Loss incoming_loss;
       uint8_t outgoing_loss;
+      Congestion congestion;
+      bool cold; /* in cold_flows */
+      uint64_t packets_sent, bytes_sent; /* probes included */
+      uint64_t packets_received, bytes_received;
       const uint16_t flow_id;
 
       static bool srtt_order( Flow* const &f1, Flow* const &f2 ) {
-	unsigned int srtt1 = (unsigned int) f1->SRTT + f1->idle_time;
-	unsigned int srtt2 = (unsigned int) f2->SRTT + f2->idle_time;
+	double srtt1 = f1->SRTT + f1->idle_time;
+	double srtt2 = f2->SRTT + f2->idle_time;
 	return ( srtt1 < srtt2 ) || ( ( srtt1 == srtt2) && f1->outgoing_loss < f2->outgoing_loss );
       }
 
@@ -176,6 +262,58 @@ namespace Network {
       Flow( const Addr &src, const Addr &dst, uint16_t id ); /* server only */
     };
 
+    /* Chooses the flows a packet is sent on.  For each packet, start() is
+       called, then pick() for each flow, fastest first; sent() reports a
+       successful emission on the last picked flow.  failed() reports that
+       sendmsg() failed on a flow, which is then left out when the packet is
+       sent again, and removed() that a flow is no longer used. */
+    class Scheduler {
+    public:
+      virtual void start( const std::vector< Flow* > &flows ) = 0;
+      virtual bool pick( const Flow *flow ) = 0;
+      virtual void sent( const Flow *flow ) = 0;
+      virtual void failed( const Flow * ) {}
+      virtual void removed( const Flow * ) {}
+      virtual ~Scheduler() {}
+    };
+
+    class MinRTTScheduler : public Scheduler {
+    private:
+      int possible_idle_send; /* -1: undefined, 0: false, 1: true. */
+    public:
+      MinRTTScheduler() : possible_idle_send( -1 ) {}
+      void start( const std::vector< Flow* > &flows );
+      bool pick( const Flow *flow );
+      void sent( const Flow *flow );
+    };
+
+    class RedundantScheduler : public Scheduler {
+    private:
+      int possible_idle_send; /* -1: undefined, 0: false, 1: true. */
+      int loss_ratio;
+      const int loss_ratio_tolerance;
+    public:
+      RedundantScheduler( int tolerance )
+	: possible_idle_send( -1 ), loss_ratio( 100 ), loss_ratio_tolerance( tolerance ) {}
+      void start( const std::vector< Flow* > &flows );
+      bool pick( const Flow *flow );
+      void sent( const Flow *flow );
+    };
+
+    class RoundRobinScheduler : public Scheduler {
+    private:
+      std::map< uint16_t, double > credit; /* by flow ID */
+      const Flow *chosen;
+      MinRTTScheduler fallback; /* when no flow is known to work */
+    public:
+      RoundRobinScheduler() : credit(), chosen( NULL ), fallback() {}
+      void start( const std::vector< Flow* > &flows );
+      bool pick( const Flow *flow );
+      void sent( const Flow *flow );
+      void failed( const Flow *flow ) { credit.erase( flow->flow_id ); }
+      void removed( const Flow *flow ) { credit.erase( flow->flow_id ); }
+    };
+
     class Socket
     {
     private:
@@ -197,16 +335,58 @@ namespace Network {
     std::deque< Socket > socks6;
     std::vector< Addr > remote_addr;
     std::vector< Addr > received_remote_addr;
-    std::vector< Flow* > flows; /* do NEVER remove flows when server, for security reason. */
+    /* do NEVER remove flows when server, for security reason.  Flows which
+       have not been heard for long are moved to cold_flows, which the
+       per-packet paths skip, and come back when heard again. */
+    /* Sorted by Flow::srtt_order, unless flows_unsorted.  The order is only
+       a cache, so const accessors may sort. */
+    mutable std::vector< Flow* > flows;
+    std::vector< Flow* > cold_flows;
+    std::map< uint16_t, Flow* > flows_by_id;
+    mutable bool flows_unsorted; /* set when a flow moves past a neighbour */
+    uint64_t last_flows_compaction;
     Flow *last_flow;
     Addresses host_addresses;
 
     bool server;
+    bool fine_timestamps; /* the peer understands them */
     int loss_ratio_tolerance;
+    Scheduler *scheduler;
 
     Base64Key key;
     Session session;
 
+    /* Packets are encrypted and decrypted in place in these. */
+    AlignedBuffer send_buffer;
+    AlignedBuffer recv_buffer;
+
+    /* Data packets built by send() wait here until flush() encrypts them
+       all in one batch and sends them. */
+    struct PendingPacket {
+      uint16_t flow_id;
+      uint64_t seq;
+      size_t wire_len; /* queued with the flow's congestion controller */
+      size_t send; /* the copies of one send() share it */
+      int step; /* debug only */
+      ssize_t sent; /* sendmsg() result, set by transmit() */
+      int error; /* errno if that failed */
+    };
+
+    enum SendState { SEND_LOST, SEND_DELIVERED, SEND_REQUEUED };
+
+    unsigned int corked;
+    size_t pending_sends;
+    std::vector< PendingPacket > pending_packets;
+    std::vector< BatchPacket > pending_batch;
+    std::vector< AlignedBuffer * > packet_buffers; /* one per pending packet, reused */
+    std::vector< char > send_states; /* SendState of each pending send, in flush() */
+    std::set< uint16_t > failed_flows; /* left out for the rest of flush() */
+
+    size_t schedule( uint8_t flags, const Segment &payload, size_t send, bool probe );
+    void transmit( size_t first, size_t last );
+    void flush( void );
+    void drop_pending( void );
+
     void setup( void );
 
     Direction direction;
@@ -222,7 +402,7 @@ namespace Network {
     bool have_send_exception;
     NetworkException send_exception;
 
-    Packet new_packet( Flow *flow, uint8_t flags, string &s_payload );
+    Packet new_packet( Flow *flow, uint8_t flags, const Segment &s_payload );
 
     void hop_port( void );
     void check_remote_addr( void );
@@ -230,7 +410,11 @@ namespace Network {
     void new_flow( Addr &src, Addr &dst );
     void check_flows( bool remote_has_changed );
     Flow *get_flow( uint16_t id );
-    void sort_flows( void );
+    void add_flow( Flow *flow );
+    void warm_flow( Flow *flow );
+    void compact_flows( void );
+    void sort_flows( void ) const;
+    void check_flow_order( const Flow *flow );
     void update_server_idle_time( void );
 
     int sock( void ) const { assert( !socks.empty() ); return socks.back().fd(); }
@@ -239,7 +423,7 @@ namespace Network {
     void prune_sockets( void );
     void prune_sockets( std::deque< Socket > &socks_vect );
 
-    void send( uint8_t flags, string s );
+    void send( uint8_t flags, const string &s );
     void send_probes( void );
     void send_probe( Flow *flow );
     void send_addresses( void );
@@ -252,10 +436,22 @@ namespace Network {
 		int loss_ratio_tolerance ); /* server */
     Connection( uint16_t delay_ack, const char *key_str, const char *ip, const char *port,
 		int loss_ratio_tolerance ); /* client */
+    ~Connection();
+
+    void set_scheduler( SchedulerPolicy policy );
+    void send( const string &s );
+
+    /* Between cork() and the matching uncork(), send() only queues its
+       packets, so that bursts are encrypted together. */
+    void cork( void ) { corked++; }
+    void uncork( void );
 
-    void send( string s );
     string recv( void );
     const std::vector< int > fds( void ) const;
+
+    /* Host address change notifications (-1 if we have to poll) */
+    int host_addresses_fd( void ) const { return host_addresses.get_fd(); }
+    void process_host_addresses( void );
     int get_MTU( void ) {
       sort_flows();
       return flows.empty() ? DEFAULT_SEND_MTU : flows.front()->MTU;
@@ -266,10 +462,14 @@ namespace Network {
     bool get_has_remote_addr( void ) const { return ( server && last_flow != NULL ) || flows.size() > 0; }
 
     uint64_t timeout( void ) const;
-    double get_SRTT( void ) const { return flows.size() > 0 ? flows.front()->SRTT : 1000; }
+    double get_SRTT( void ) const { sort_flows(); return flows.size() > 0 ? flows.front()->SRTT : 1000; }
+
+    /* Rate of the fastest flow (bytes per ms), and ms before it can send again. */
+    double get_send_rate( void ) const { sort_flows(); return flows.size() > 0 ? flows.front()->congestion.rate : Congestion::INITIAL_RATE; }
+    uint64_t pacing_delay( void );
 
-    const Addr &get_remote_addr( void ) const { return flows.size() > 0 ? flows.front()->dst : remote_addr.back(); }
-    socklen_t get_remote_addr_len( void ) const { return flows.size() > 0 ? flows.front()->dst.addrlen : remote_addr.back().addrlen; }
+    const Addr &get_remote_addr( void ) const { sort_flows(); return flows.size() > 0 ? flows.front()->dst : remote_addr.back(); }
+    socklen_t get_remote_addr_len( void ) const { sort_flows(); return flows.size() > 0 ? flows.front()->dst.addrlen : remote_addr.back().addrlen; }
 
     const NetworkException *get_send_exception( void ) const
     {
@@ -278,7 +478,15 @@ namespace Network {
 
     void set_last_roundtrip_success( uint64_t s_success ) { last_roundtrip_success = s_success; }
 
+    /* Per-flow round-trip times, loss and traffic, for the metrics page. */
+    void write_metrics( Metrics &metrics ) const;
+
     static bool parse_portrange( const char * desired_port_range, int & desired_port_low, int & desired_port_high );
+    static bool parse_scheduler( const char * name, SchedulerPolicy & policy );
+
+    /* not implemented */
+    Connection( const Connection & );
+    Connection & operator=( const Connection & );
   };
 }
 
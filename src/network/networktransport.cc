@@ -33,6 +33,7 @@
 #include <iostream>
 
 #include "networktransport.h"
+#include "trace.h"
 
 #include "transportsender.cc"
 
@@ -127,6 +128,8 @@ void Transport<MyState, RemoteState>::recv( void )
     if ( received_states.size() > 1024 ) { /* limit on state queue */
       uint64_t now = timestamp();
       if ( now < receiver_quench_timer ) { /* deny letting state grow further */
+	trace( TRACE_STATE_DISCARDED, 0, 0,
+	       inst.old_num(), inst.new_num(), inst.ack_num(), inst.throwaway_num() );
 	if ( verbose ) {
 	  fprintf( stderr, "[%u] Receiver queue full, discarding %d (malicious sender or long-unidirectional connectivity?)\n",
 		   (unsigned int)(timestamp() % 100000), (int)inst.new_num() );
@@ -152,6 +155,8 @@ void Transport<MyState, RemoteState>::recv( void )
 	  i++ ) {
       if ( i->num > new_state.num ) {
 	received_states.insert( i, new_state );
+	trace( TRACE_STATE_OUT_OF_ORDER, 0, 0,
+	       inst.old_num(), inst.new_num(), inst.ack_num(), inst.throwaway_num() );
 	if ( verbose ) {
 	  fprintf( stderr, "[%u] Received OUT-OF-ORDER state %d [ack %d]\n",
 		   (unsigned int)(timestamp() % 100000), (int)new_state.num, (int)inst.ack_num() );
@@ -163,6 +168,8 @@ void Transport<MyState, RemoteState>::recv( void )
       fprintf( stderr, "[%u] Received state %d [coming from %d, ack %d]\n",
 	       (unsigned int)(timestamp() % 100000), (int)new_state.num, (int)inst.old_num(), (int)inst.ack_num() );
     }
+    trace( TRACE_STATE_RECEIVED, 0, 0,
+	   inst.old_num(), inst.new_num(), inst.ack_num(), inst.throwaway_num() );
     received_states.push_back( new_state );
     sender.set_ack_num( received_states.back().num );
 
@@ -209,3 +216,12 @@ string Transport<MyState, RemoteState>::get_remote_diff( void )
 
   return ret;
 }
+
+template <class MyState, class RemoteState>
+void Transport<MyState, RemoteState>::write_metrics( Metrics &metrics ) const
+{
+  connection.write_metrics( metrics );
+  sender.write_metrics( metrics );
+  metrics.family( "mosh_received_states", "gauge", "Received states kept until the sender throws them away." );
+  metrics.sample( "mosh_received_states", received_states.size() );
+}
@@ -101,6 +101,7 @@ namespace Network {
 
     MyState &get_current_state( void ) { return sender.get_current_state(); }
     void set_current_state( const MyState &x ) { sender.set_current_state( x ); }
+    void track_current_state( const MyState &x ) { sender.track_current_state( x ); }
 
     uint64_t get_remote_state_num( void ) const { return received_states.back().num; }
 
@@ -108,10 +109,15 @@ namespace Network {
 
     const std::vector< int > fds( void ) const { return connection.fds(); }
 
+    int host_addresses_fd( void ) const { return connection.host_addresses_fd(); }
+    void process_host_addresses( void ) { connection.process_host_addresses(); }
+
     void set_verbose( void ) { sender.set_verbose(); verbose = true; }
 
     void set_send_delay( int new_delay ) { sender.set_send_delay( new_delay ); }
 
+    void set_scheduler( SchedulerPolicy policy ) { connection.set_scheduler( policy ); }
+
     uint64_t get_sent_state_acked_timestamp( void ) const { return sender.get_sent_state_acked_timestamp(); }
     uint64_t get_sent_state_acked( void ) const { return sender.get_sent_state_acked(); }
     uint64_t get_sent_state_last( void ) const { return sender.get_sent_state_last(); }
@@ -122,6 +128,8 @@ namespace Network {
     socklen_t get_remote_addr_len( void ) const { return connection.get_remote_addr_len(); }
 
     const NetworkException *get_send_exception( void ) const { return connection.get_send_exception(); }
+
+    void write_metrics( Metrics &metrics ) const;
   };
 }
 
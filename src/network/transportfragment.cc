@@ -90,6 +90,16 @@ Fragment::Fragment( string &x )
 
 bool FragmentAssembly::add_fragment( Fragment &frag )
 {
+  /* An instruction in one fragment is complete on its own. The sender
+     sends one as an ack while a larger instruction is still being paced
+     out (see TransportSender::send_ack_only()), so it must not throw
+     away the assembly in progress, or the receiver would lose the
+     partial frame and wait for a retransmission of all of it. */
+  if ( (current_id != frag.id) && (frag.fragment_num == 0) && frag.final ) {
+    single = frag;
+    return true;
+  }
+
   /* see if this is a totally new packet */
   if ( current_id != frag.id ) {
     fragments.clear();
@@ -129,6 +139,13 @@ bool FragmentAssembly::add_fragment( Fragment &frag )
 
 Instruction FragmentAssembly::get_assembly( void )
 {
+  if ( single.initialized ) {
+    Instruction ret;
+    fatal_assert( ret.ParseFromString( get_compressor().uncompress_str( single.contents ) ) );
+    single = Fragment();
+    return ret;
+  }
+
   assert( fragments_arrived == fragments_total );
 
   string encoded;
@@ -82,9 +82,10 @@ namespace Network {
     vector<Fragment> fragments;
     uint64_t current_id;
     int fragments_arrived, fragments_total;
+    Fragment single; /* complete instruction that arrived in one fragment */
 
   public:
-    FragmentAssembly() : fragments(), current_id( -1 ), fragments_arrived( 0 ), fragments_total( -1 ) {}
+    FragmentAssembly() : fragments(), current_id( -1 ), fragments_arrived( 0 ), fragments_total( -1 ), single() {}
     bool add_fragment( Fragment &inst );
     Instruction get_assembly( void );
   };
@@ -38,6 +38,7 @@
 
 #include "transportsender.h"
 #include "transportfragment.h"
+#include "trace.h"
 
 #include <limits.h>
 
@@ -48,9 +49,16 @@ template <class MyState>
 TransportSender<MyState>::TransportSender( Connection *s_connection, MyState &initial_state )
   : connection( s_connection ), 
     current_state( initial_state ),
+    tracked_state( NULL ),
     sent_states( 1, TimestampedState<MyState>( timestamp(), 0, initial_state ) ),
     assumed_receiver_state( sent_states.begin() ),
     fragmenter(),
+    paced_fragments(),
+    paced_num( 0 ),
+    paced_old_num( 0 ),
+    paced_ack_num( 0 ),
+    paced_throwaway_num( 0 ),
+    last_frame_size( 0 ),
     next_ack_time( timestamp() ),
     next_send_time( timestamp() ),
     verbose( false ),
@@ -62,15 +70,21 @@ TransportSender<MyState>::TransportSender( Connection *s_connection, MyState &in
     SEND_MINDELAY( 8 ),
     last_heard( 0 ),
     prng(),
-    mindelay_clock( -1 )
+    mindelay_clock( -1 ),
+    retransmits( 0 ),
+    fragments_sent( 0 ),
+    diffs_sent( 0 ),
+    diff_bytes_sent( 0 )
 {
 }
 
-/* Try to send roughly two frames per RTT, bounded by limits on frame rate */
+/* Try to send roughly two frames per RTT, but leave the pacer the time to
+   send the last frame, bounded by limits on frame rate */
 template <class MyState>
 unsigned int TransportSender<MyState>::send_interval( void ) const
 {
-  int SEND_INTERVAL = lrint( ceil( connection->get_SRTT() / 2.0 ) );
+  int SEND_INTERVAL = lrint( ceil( max( connection->get_SRTT() / 2.0,
+					last_frame_size / connection->get_send_rate() ) ) );
   if ( SEND_INTERVAL < SEND_INTERVAL_MIN ) {
     SEND_INTERVAL = SEND_INTERVAL_MIN;
   } else if ( SEND_INTERVAL > SEND_INTERVAL_MAX ) {
@@ -96,20 +110,20 @@ void TransportSender<MyState>::calculate_timers( void )
     next_ack_time = now + ACK_DELAY;
   }
 
-  if ( !(current_state == sent_states.back().state) ) {
+  if ( !(current() == sent_states.back().state) ) {
     if ( mindelay_clock == uint64_t( -1 ) ) {
       mindelay_clock = now;
     }
 
     next_send_time = max( mindelay_clock + SEND_MINDELAY,
 			  sent_states.back().timestamp + send_interval() );
-  } else if ( !(current_state == assumed_receiver_state->state)
+  } else if ( !(current() == assumed_receiver_state->state)
 	      && (last_heard + ACTIVE_RETRY_TIMEOUT > now) ) {
     next_send_time = sent_states.back().timestamp + send_interval();
     if ( mindelay_clock != uint64_t( -1 ) ) {
       next_send_time = max( next_send_time, mindelay_clock + SEND_MINDELAY );
     }
-  } else if ( !(current_state == sent_states.front().state )
+  } else if ( !(current() == sent_states.front().state )
 	      && (last_heard + ACTIVE_RETRY_TIMEOUT > now) ) {
     next_send_time = sent_states.back().timestamp + connection->timeout() + ACK_DELAY;
   } else {
@@ -139,6 +153,12 @@ int TransportSender<MyState>::wait_time( void )
     return INT_MAX;
   }
 
+  if ( !paced_fragments.empty() ) {
+    /* no new state goes out before the pacer has sent this one, but
+       acks still do */
+    next_wakeup = min( next_ack_time, now + connection->pacing_delay() );
+  }
+
   if ( next_wakeup > now ) {
     return next_wakeup - now;
   } else {
@@ -158,6 +178,18 @@ void TransportSender<MyState>::tick( void )
 
   uint64_t now = timestamp();
 
+  /* finish sending the previous frame before starting a new one, but
+     don't hold acks back behind it */
+  if ( !paced_fragments.empty() ) {
+    send_paced_fragments();
+    if ( !paced_fragments.empty() ) {
+      if ( now >= next_ack_time ) {
+	send_ack_only();
+      }
+      return;
+    }
+  }
+
   if ( (now < next_ack_time)
        && (now < next_send_time) ) {
     return;
@@ -165,15 +197,17 @@ void TransportSender<MyState>::tick( void )
 
   /* Determine if a new diff or empty ack needs to be sent */
     
-  string diff = current_state.diff_from( assumed_receiver_state->state );
+  StageTimer diff_timer( STAGE_DIFF );
+  string diff = current().diff_from( assumed_receiver_state->state );
 
   attempt_prospective_resend_optimization( diff );
+  diff_timer.stop();
 
   if ( verbose ) {
     /* verify diff has round-trip identity (modulo Unicode fallback rendering) */
     MyState newstate( assumed_receiver_state->state );
     newstate.apply_string( diff );
-    if ( current_state.compare( newstate ) ) {
+    if ( current().compare( newstate ) ) {
       fprintf( stderr, "Warning, round-trip Instruction verification failed!\n" );
     }
   }
@@ -204,7 +238,7 @@ void TransportSender<MyState>::send_empty_ack( void )
   }
 
   //  sent_states.push_back( TimestampedState<MyState>( sent_states.back().timestamp, new_num, current_state ) );
-  add_sent_state( now, new_num, current_state );
+  add_sent_state( now, new_num, current() );
   send_in_fragments( "", new_num );
 
   next_ack_time = now + ACK_INTERVAL;
@@ -212,7 +246,7 @@ void TransportSender<MyState>::send_empty_ack( void )
 }
 
 template <class MyState>
-void TransportSender<MyState>::add_sent_state( uint64_t the_timestamp, uint64_t num, MyState &state )
+void TransportSender<MyState>::add_sent_state( uint64_t the_timestamp, uint64_t num, const MyState &state )
 {
   sent_states.push_back( TimestampedState<MyState>( the_timestamp, num, state ) );
   if ( sent_states.size() > 32 ) { /* limit on state queue */
@@ -226,7 +260,7 @@ template <class MyState>
 void TransportSender<MyState>::send_to_receiver( string diff )
 {
   uint64_t new_num;
-  if ( current_state == sent_states.back().state ) { /* previously sent */
+  if ( current() == sent_states.back().state ) { /* previously sent */
     new_num = sent_states.back().num;
   } else { /* new state */
     new_num = sent_states.back().num + 1;
@@ -239,8 +273,9 @@ void TransportSender<MyState>::send_to_receiver( string diff )
 
   if ( new_num == sent_states.back().num ) {
     sent_states.back().timestamp = timestamp();
+    retransmits++;
   } else {
-    add_sent_state( timestamp(), new_num, current_state );
+    add_sent_state( timestamp(), new_num, current() );
   }
 
   send_in_fragments( diff, new_num ); // Can throw NetworkException
@@ -283,7 +318,9 @@ void TransportSender<MyState>::rationalize_states( void )
 {
   const MyState * known_receiver_state = &sent_states.front().state;
 
-  current_state.subtract( known_receiver_state );
+  if ( !tracked_state ) { /* a tracked state belongs to our caller */
+    current_state.subtract( known_receiver_state );
+  }
 
   for ( typename list< TimestampedState<MyState> >::reverse_iterator i = sent_states.rbegin();
 	i != sent_states.rend();
@@ -320,12 +357,63 @@ void TransportSender<MyState>::send_in_fragments( string diff, uint64_t new_num
     shutdown_tries++;
   }
 
+  if ( !diff.empty() ) {
+    diffs_sent++;
+    diff_bytes_sent += diff.size();
+  }
+
+  vector<Fragment> fragments = fragmenter.make_fragments( inst, connection->get_MTU() );
+
+  /* a new instruction supersedes what is left of the previous one */
+  paced_fragments.assign( fragments.begin(), fragments.end() );
+  paced_num = new_num;
+  paced_old_num = inst.old_num();
+  paced_ack_num = inst.ack_num();
+  paced_throwaway_num = inst.throwaway_num();
+  last_frame_size = 0;
+  for ( vector<Fragment>::const_iterator i = fragments.begin();
+        i != fragments.end();
+        i++ ) {
+    last_frame_size += i->contents.size();
+  }
+
+  trace( TRACE_STATE_SENT, 0, fragments.size(),
+	 inst.old_num(), inst.new_num(), inst.ack_num(), inst.throwaway_num() );
+
+  send_paced_fragments(); // Can throw NetworkException
+
+  pending_data_ack = false;
+}
+
+/* Send our ack while the pacer still holds back part of a frame. The
+   instruction restates the state the receiver has acknowledged, so it
+   starts no new state, and it fits in one fragment, which the
+   receiver assembles without dropping the frame's fragments. */
+template <class MyState>
+void TransportSender<MyState>::send_ack_only( void )
+{
+  Instruction inst;
+
+  inst.set_protocol_version( MOSH_PROTOCOL_VERSION );
+  inst.set_old_num( sent_states.front().num );
+  inst.set_new_num( sent_states.front().num );
+  inst.set_ack_num( ack_num );
+  inst.set_throwaway_num( sent_states.front().num );
+  inst.set_diff( "" );
+  inst.set_chaff( make_chaff() );
+
   vector<Fragment> fragments = fragmenter.make_fragments( inst, connection->get_MTU() );
 
+  trace( TRACE_STATE_SENT, 0, fragments.size(),
+	 inst.old_num(), inst.new_num(), inst.ack_num(), inst.throwaway_num() );
+
   for ( vector<Fragment>::iterator i = fragments.begin();
         i != fragments.end();
         i++ ) {
-    connection->send( i->tostring() );
+    connection->send( i->tostring() ); // Can throw NetworkException
+
+    fragments_sent++;
+    trace( TRACE_FRAGMENT_SENT, 0, i->contents.size(), inst.new_num(), i->id, i->fragment_num );
 
     if ( verbose ) {
       fprintf( stderr, "[%u] Sent [%d=>%d] id %d, frag %d ack=%d, throwaway=%d, len=%d, frame rate=%.2f, timeout=%d, srtt=%.1f\n",
@@ -334,12 +422,54 @@ void TransportSender<MyState>::send_in_fragments( string diff, uint64_t new_num
 	       1000.0 / (double)send_interval(),
 	       (int)connection->timeout(), connection->get_SRTT() );
     }
-
   }
 
+  next_ack_time = timestamp() + ACK_INTERVAL;
   pending_data_ack = false;
 }
 
+/* Send the pending fragments the congestion controller lets out now,
+   corked so the whole burst is encrypted in one batch */
+template <class MyState>
+void TransportSender<MyState>::send_paced_fragments( void )
+{
+  connection->cork();
+  try {
+    send_paced_burst();
+  } catch ( ... ) {
+    connection->uncork();
+    throw;
+  }
+  connection->uncork();
+
+  if ( paced_fragments.empty() && sent_states.back().num == paced_num ) {
+    /* the state really left now */
+    sent_states.back().timestamp = timestamp();
+  }
+}
+
+template <class MyState>
+void TransportSender<MyState>::send_paced_burst( void )
+{
+  while ( !paced_fragments.empty() && connection->pacing_delay() == 0 ) {
+    Fragment frag = paced_fragments.front();
+    paced_fragments.pop_front();
+
+    connection->send( frag.tostring() );
+
+    fragments_sent++;
+    trace( TRACE_FRAGMENT_SENT, 0, frag.contents.size(), paced_num, frag.id, frag.fragment_num );
+
+    if ( verbose ) {
+      fprintf( stderr, "[%u] Sent [%d=>%d] id %d, frag %d ack=%d, throwaway=%d, len=%d, frame rate=%.2f, timeout=%d, srtt=%.1f\n",
+	       (unsigned int)(timestamp() % 100000), (int)paced_old_num, (int)paced_num, (int)frag.id, (int)frag.fragment_num,
+	       (int)paced_ack_num, (int)paced_throwaway_num, (int)frag.contents.size(),
+	       1000.0 / (double)send_interval(),
+	       (int)connection->timeout(), connection->get_SRTT() );
+    }
+  }
+}
+
 template <class MyState>
 void TransportSender<MyState>::process_acknowledgment_through( uint64_t ack_num )
 {
@@ -349,11 +479,27 @@ void TransportSender<MyState>::process_acknowledgment_through( uint64_t ack_num
        find_if( sent_states.begin(), sent_states.end(),
 		bind2nd( mem_fun_ref( &TimestampedState<MyState>::num_eq ), ack_num ) ) ) {
     sent_states.remove_if( bind2nd( mem_fun_ref( &TimestampedState<MyState>::num_lt ), ack_num ) );
+    trace( TRACE_ACK, 0, 0, ack_num );
   }
 
   assert( !sent_states.empty() );
 }
 
+template <class MyState>
+void TransportSender<MyState>::start_shutdown( void )
+{
+  if ( !shutdown_in_progress ) {
+    shutdown_start = timestamp();
+    shutdown_in_progress = true;
+
+    /* the state we send can't change from here on */
+    if ( tracked_state ) {
+      current_state = *tracked_state;
+      tracked_state = NULL;
+    }
+  }
+}
+
 /* give up on getting acknowledgement for shutdown */
 template <class MyState>
 bool TransportSender<MyState>::shutdown_ack_timed_out( void ) const
@@ -385,7 +531,7 @@ void TransportSender<MyState>::attempt_prospective_resend_optimization( string &
     return;
   }
 
-  string resend_diff = current_state.diff_from( sent_states.front().state );
+  string resend_diff = current().diff_from( sent_states.front().state );
 
   /* We do a prophylactic resend if it would make the diff shorter,
      or if it would lengthen it by no more than 100 bytes and still be
@@ -398,3 +544,17 @@ void TransportSender<MyState>::attempt_prospective_resend_optimization( string &
     proposed_diff = resend_diff;
   }
 }
+
+template <class MyState>
+void TransportSender<MyState>::write_metrics( Metrics &metrics ) const
+{
+  metrics.family( "mosh_retransmits_total", "counter", "States sent again for lack of an acknowledgment." );
+  metrics.sample( "mosh_retransmits_total", retransmits );
+  metrics.family( "mosh_fragments_sent_total", "counter", "Instruction fragments sent." );
+  metrics.sample( "mosh_fragments_sent_total", fragments_sent );
+  metrics.family( "mosh_diff_bytes", "summary", "Sizes of the diffs sent." );
+  metrics.sample( "mosh_diff_bytes_sum", diff_bytes_sent );
+  metrics.sample( "mosh_diff_bytes_count", diffs_sent );
+  metrics.family( "mosh_sent_states", "gauge", "Sent states not yet known to be superseded." );
+  metrics.sample( "mosh_sent_states", sent_states.size() );
+}
@@ -67,13 +67,21 @@ namespace Network {
     void send_to_receiver( string diff );
     void send_empty_ack( void );
     void send_in_fragments( string diff, uint64_t new_num );
-    void add_sent_state( uint64_t the_timestamp, uint64_t num, MyState &state );
+    void send_ack_only( void );
+    void send_paced_fragments( void );
+    void send_paced_burst( void );
+    void add_sent_state( uint64_t the_timestamp, uint64_t num, const MyState &state );
 
     /* state of sender */
     Connection *connection;
 
     MyState current_state;
 
+    /* When set, the caller updates this state in place and we only
+       copy it when a new state is actually sent. */
+    const MyState *tracked_state;
+    const MyState &current( void ) const { return tracked_state ? *tracked_state : current_state; }
+
     typedef list< TimestampedState<MyState> > sent_states_type;
     sent_states_type sent_states;
     /* first element: known, acknowledged receiver state */
@@ -85,6 +93,12 @@ namespace Network {
     /* for fragment creation */
     Fragmenter fragmenter;
 
+    /* fragments of the last instruction held back by the pacer */
+    list< Fragment > paced_fragments;
+    uint64_t paced_num;
+    uint64_t paced_old_num, paced_ack_num, paced_throwaway_num; /* for verbose output */
+    size_t last_frame_size; /* bytes */
+
     /* timing state */
     uint64_t next_ack_time;
     uint64_t next_send_time;
@@ -110,6 +124,11 @@ namespace Network {
 
     uint64_t mindelay_clock; /* time of first pending change to current state */
 
+    /* for the metrics page */
+    uint64_t retransmits; /* states sent again */
+    uint64_t fragments_sent;
+    uint64_t diffs_sent, diff_bytes_sent;
+
   public:
     /* constructor */
     TransportSender( Connection *s_connection, MyState &initial_state );
@@ -133,12 +152,16 @@ namespace Network {
     void remote_heard( uint64_t ts ) { last_heard = ts; }
 
     /* Starts shutdown sequence */
-    void start_shutdown( void ) { if ( !shutdown_in_progress ) { shutdown_start = timestamp(); shutdown_in_progress = true; } }
+    void start_shutdown( void );
 
     /* Misc. getters and setters */
     /* Cannot modify current_state while shutdown in progress */
-    MyState &get_current_state( void ) { assert( !shutdown_in_progress ); return current_state; }
-    void set_current_state( const MyState &x ) { assert( !shutdown_in_progress ); current_state = x; }
+    MyState &get_current_state( void ) { assert( !shutdown_in_progress && !tracked_state ); return current_state; }
+    void set_current_state( const MyState &x ) { assert( !shutdown_in_progress && !tracked_state ); current_state = x; }
+
+    /* Follow x, which must outlive us, instead of a copy. Only for
+       states whose subtract() does nothing, since x isn't ours. */
+    void track_current_state( const MyState &x ) { assert( !shutdown_in_progress ); tracked_state = &x; }
     void set_verbose( void ) { verbose = true; }
 
     bool get_shutdown_in_progress( void ) const { return shutdown_in_progress; }
@@ -154,6 +177,8 @@ namespace Network {
 
     unsigned int send_interval( void ) const;
 
+    void write_metrics( Metrics &metrics ) const;
+
     /* nonexistent methods to satisfy -Weffc++ */
     TransportSender( const TransportSender &x );
     TransportSender & operator=( const TransportSender &x );
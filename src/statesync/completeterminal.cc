@@ -31,22 +31,24 @@
 */
 
 #include "completeterminal.h"
+#include "terminalscrollback.h"
 #include "fatal_assert.h"
 
 #include "hostinput.pb.h"
 
 #include <limits.h>
+#include <algorithm>
 
 using namespace std;
 using namespace Parser;
 using namespace Terminal;
 using namespace HostBuffers;
 
-string Complete::act( const string &str )
+void Complete::input( const char *bytes, size_t len )
 {
-  for ( unsigned int i = 0; i < str.size(); i++ ) {
+  for ( size_t i = 0; i < len; i++ ) {
     /* parse octet into up to three actions */
-    list<Action *> actions( parser.input( str[ i ] ) );
+    list<Action *> actions( parser.input( bytes[ i ] ) );
     
     /* apply actions to terminal and delete them */
     for ( list<Action *>::iterator it = actions.begin();
@@ -57,6 +59,70 @@ string Complete::act( const string &str )
       delete act;
     }
   }
+}
+
+static bool is_plain( char c )
+{
+  return ( (c >= 0x20) && (c <= 0x7e) ) || (c == '\r') || (c == '\n');
+}
+
+/* With fast_forward on, plain text (printable ASCII, CR and LF) that
+   is bound to scroll off the screen later in the same chunk is not
+   drawn at all. The prefix we may skip is plain, ends in CR LF and
+   holds at least height - 1 line feeds, so drawing it would leave
+   the cursor in the bottom-left corner. It must be followed by at
+   least height more line feeds of plain text, which scroll away
+   every row the skipped text could have touched. Plain text changes
+   nothing else, so skipping the prefix and just moving the cursor
+   to that corner gives exactly the same terminal. */
+size_t Complete::elidable_prefix( const string &str ) const
+{
+  const Framebuffer &fb = terminal.get_fb();
+  const int height = fb.ds.get_height();
+
+  if ( (!fast_forward)
+       || fb.get_scrollback() /* it must see every line */
+       || (!parser.is_grounded())
+       || (fb.ds.get_scrolling_region_top_row() != 0)
+       || (fb.ds.get_scrolling_region_bottom_row() != height - 1) ) {
+    return 0;
+  }
+
+  size_t plain_len = 0;
+  while ( (plain_len < str.size()) && is_plain( str[ plain_len ] ) ) {
+    plain_len++;
+  }
+
+  /* find the last CR LF with height line feeds after it */
+  int feeds_after = 0;
+  for ( size_t i = plain_len; i > 1; i-- ) {
+    if ( str[ i - 1 ] != '\n' ) {
+      continue;
+    }
+
+    if ( (feeds_after >= height) && (str[ i - 2 ] == '\r') ) {
+      if ( count( str.begin(), str.begin() + i, '\n' ) >= height - 1 ) {
+	return i;
+      }
+      return 0; /* any earlier CR LF has even fewer before it */
+    }
+
+    feeds_after++;
+  }
+
+  return 0;
+}
+
+string Complete::act( const string &str )
+{
+  size_t skip = elidable_prefix( str );
+  if ( skip > 0 ) {
+    /* put the cursor where the skipped text would have left it */
+    const string to_corner = "\r" + string( terminal.get_fb().ds.get_height() - 1, '\n' );
+    input( to_corner.data(), to_corner.size() );
+  }
+
+  input( str.data() + skip, str.size() - skip );
 
   return terminal.read_octets_to_host();
 }
@@ -68,6 +134,41 @@ string Complete::act( const Action *act )
   return terminal.read_octets_to_host();
 }
 
+string Complete::act_user_input( const char *keys, size_t len )
+{
+  terminal.user_input( keys, len );
+  return terminal.read_octets_to_host();
+}
+
+void Complete::set_scrollback( size_t memory_cap )
+{
+  terminal.set_scrollback( shared::shared_ptr<Scrollback>( new Scrollback( memory_cap ) ) );
+}
+
+void Complete::act_history_request( unsigned int id, uint64_t end, unsigned int count )
+{
+  HistoryPage *page = new HistoryPage;
+  history = shared::shared_ptr<const HistoryPage>( page );
+  page->id = id;
+
+  const shared::shared_ptr<Scrollback> &scrollback = terminal.get_fb().get_scrollback();
+  if ( !scrollback ) {
+    return;
+  }
+
+  page->first_line = scrollback->get_first_line();
+  page->end_line = scrollback->get_end_line();
+
+  if ( count > HISTORY_PAGE_MAX ) {
+    count = HISTORY_PAGE_MAX;
+  }
+  if ( (end == 0) || (end > page->end_line) ) {
+    end = page->end_line;
+  }
+  page->start = ( end - page->first_line > count ) ? end - count : page->first_line;
+  page->lines = scrollback->get_lines( page->start, end );
+}
+
 /* interface for Network::Transport */
 string Complete::diff_from( const Complete &existing ) const
 {
@@ -85,9 +186,32 @@ string Complete::diff_from( const Complete &existing ) const
       Instruction *new_res = output.add_instruction();
       new_res->MutableExtension( resize )->set_width( terminal.get_fb().ds.get_width() );
       new_res->MutableExtension( resize )->set_height( terminal.get_fb().ds.get_height() );
+
+      /* The receiver resizes (and so reflows) its terminal before
+	 drawing, so draw from the existing state resized the same
+	 way, rather than repaint everything. */
+      Framebuffer resized( existing.get_fb() );
+      resized.set_scrollback( shared::shared_ptr<Scrollback>() ); /* keep our history out of it */
+      resized.resize( terminal.get_fb().ds.get_width(), terminal.get_fb().ds.get_height() );
+      Instruction *new_inst = output.add_instruction();
+      new_inst->MutableExtension( hostbytes )->set_hoststring( display.new_frame( true, resized, terminal.get_fb() ) );
+    } else {
+      Instruction *new_inst = output.add_instruction();
+      new_inst->MutableExtension( hostbytes )->set_hoststring( display.new_frame( true, existing.get_fb(), terminal.get_fb() ) );
+    }
+  }
+
+  if ( history && (history != existing.history) ) {
+    HistoryLines *lines = output.add_instruction()->MutableExtension( HostBuffers::history );
+    lines->set_id( history->id );
+    lines->set_first_line( history->first_line );
+    lines->set_end_line( history->end_line );
+    lines->set_start( history->start );
+    for ( vector<string>::const_iterator i = history->lines.begin();
+	  i != history->lines.end();
+	  i++ ) {
+      lines->add_line( *i );
     }
-    Instruction *new_inst = output.add_instruction();
-    new_inst->MutableExtension( hostbytes )->set_hoststring( display.new_frame( true, existing.get_fb(), terminal.get_fb() ) );
   }
   
   return output.SerializeAsString();
@@ -98,6 +222,10 @@ void Complete::apply_string( string diff )
   HostBuffers::HostMessage input;
   fatal_assert( input.ParseFromString( diff ) );
 
+  /* only a copy has diffs applied to it, and the lines it scrolls
+     away are not the session's history */
+  terminal.set_scrollback( shared::shared_ptr<Scrollback>() );
+
   for ( int i = 0; i < input.instruction_size(); i++ ) {
     if ( input.instruction( i ).HasExtension( hostbytes ) ) {
       string terminal_to_host = act( input.instruction( i ).GetExtension( hostbytes ).hoststring() );
@@ -105,6 +233,15 @@ void Complete::apply_string( string diff )
     } else if ( input.instruction( i ).HasExtension( resize ) ) {
       act( new Resize( input.instruction( i ).GetExtension( resize ).width(),
 		       input.instruction( i ).GetExtension( resize ).height() ) );
+    } else if ( input.instruction( i ).HasExtension( HostBuffers::history ) ) {
+      const HistoryLines &lines = input.instruction( i ).GetExtension( HostBuffers::history );
+      HistoryPage *page = new HistoryPage;
+      history = shared::shared_ptr<const HistoryPage>( page );
+      page->id = lines.id();
+      page->first_line = lines.first_line();
+      page->end_line = lines.end_line();
+      page->start = lines.start();
+      page->lines.assign( lines.line().begin(), lines.line().end() );
     } else if ( input.instruction( i ).HasExtension( echoack ) ) {
       uint64_t inst_echo_ack_num = input.instruction( i ).GetExtension( echoack ).echo_ack_num();
       assert( inst_echo_ack_num >= echo_ack );
@@ -116,7 +253,7 @@ void Complete::apply_string( string diff )
 bool Complete::operator==( Complete const &x ) const
 {
   //  assert( parser == x.parser ); /* parser state is irrelevant for us */
-  return (terminal == x.terminal) && (echo_ack == x.echo_ack);
+  return (terminal == x.terminal) && (echo_ack == x.echo_ack) && (history == x.history);
 }
 
 static bool old_ack(uint64_t newest_echo_ack, const pair<uint64_t, uint64_t> p)
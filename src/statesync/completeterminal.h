@@ -34,14 +34,29 @@
 #define COMPLETE_TERMINAL_HPP
 
 #include <list>
+#include <string>
+#include <vector>
 #include <stdint.h>
 
 #include "parser.h"
 #include "terminal.h"
+#include "shared.h"
 
 /* This class represents the complete terminal -- a UTF8Parser feeding Actions to an Emulator. */
 
 namespace Terminal {
+  /* The lines of the server's scrollback that the client last asked
+     for, numbered as in Scrollback. */
+  class HistoryPage {
+  public:
+    unsigned int id; /* of the request */
+    uint64_t first_line, end_line; /* what the server still holds */
+    uint64_t start; /* number of lines.front() */
+    std::vector<std::string> lines;
+
+    HistoryPage() : id( 0 ), first_line( 0 ), end_line( 0 ), start( 0 ), lines() {}
+  };
+
   class Complete {
   private:
     Parser::UTF8Parser parser;
@@ -53,16 +68,31 @@ namespace Terminal {
     uint64_t echo_ack;
 
     static const int ECHO_TIMEOUT = 50; /* for late ack */
+    static const unsigned int HISTORY_PAGE_MAX = 1000; /* lines */
+
+    bool fast_forward; /* skip plain text that scrolls away unseen */
+
+    /* replaced, never changed, so that copies can share it */
+    shared::shared_ptr<const HistoryPage> history;
+
+    void input( const char *bytes, size_t len );
+    size_t elidable_prefix( const std::string &str ) const;
 
   public:
     Complete( size_t width, size_t height ) : parser(), terminal( width, height ), display( false ),
-					      input_history(), echo_ack( 0 ) {}
+					      input_history(), echo_ack( 0 ), fast_forward( false ), history() {}
+
+    void set_fast_forward( bool s_fast_forward ) { fast_forward = s_fast_forward; }
+    void set_scrollback( size_t memory_cap );
     
     std::string act( const std::string &str );
     std::string act( const Parser::Action *act );
+    std::string act_user_input( const char *keys, size_t len );
+    void act_history_request( unsigned int id, uint64_t end, unsigned int count );
 
     const Framebuffer & get_fb( void ) const { return terminal.get_fb(); }
     bool parser_grounded( void ) const { return parser.is_grounded(); }
+    const HistoryPage * get_history( void ) const { return history.get(); }
 
     uint64_t get_echo_ack( void ) const { return echo_ack; }
     bool set_echo_ack( uint64_t now );
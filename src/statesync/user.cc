@@ -31,7 +31,7 @@
 */
 
 #include <assert.h>
-#include <typeinfo>
+#include <algorithm>
 
 #include "user.h"
 #include "fatal_assert.h"
@@ -41,65 +41,102 @@ using namespace Parser;
 using namespace Network;
 using namespace ClientBuffers;
 
+/* A resize that only repeats the one just before it, with no
+   keystroke in between, tells the server nothing. A different size
+   cannot replace that resize in place, though: it may already have
+   been sent, and diffs find new resizes by count. */
+void UserStream::push_back( Parser::Resize s_resize )
+{
+  if ( !resizes.empty()
+       && (resizes.back() == UserResize( keys.size(), s_resize.width, s_resize.height )) ) {
+    return;
+  }
+
+  resizes.push_back( UserResize( keys.size(), s_resize.width, s_resize.height ) );
+}
+
+/* Does the event sequence in prefix begin ours? */
+bool UserStream::is_prefix( const UserStream &prefix ) const
+{
+  if ( (prefix.keys.size() > keys.size())
+       || (prefix.resizes.size() > resizes.size())
+       || (prefix.history_requests.size() > history_requests.size()) ) {
+    return false;
+  }
+
+  if ( keys.compare( 0, prefix.keys.size(), prefix.keys ) != 0 ) {
+    return false;
+  }
+
+  if ( !std::equal( prefix.resizes.begin(), prefix.resizes.end(), resizes.begin() ) ) {
+    return false;
+  }
+
+  if ( !std::equal( prefix.history_requests.begin(), prefix.history_requests.end(), history_requests.begin() ) ) {
+    return false;
+  }
+
+  /* none of our later resizes may fall among the prefix's keystrokes */
+  return ( resizes.size() == prefix.resizes.size() )
+    || ( resizes[ prefix.resizes.size() ].offset >= prefix.keys.size() );
+}
+
 void UserStream::subtract( const UserStream *prefix )
 {
-  // if we are subtracting ourself from ourself, just clear the deque
+  // if we are subtracting ourself from ourself, just clear the stream
   if ( this == prefix ) {
-    actions.clear();
+    keys.clear();
+    resizes.clear();
+    history_requests.clear();
     return;
   }
-  for ( deque<UserEvent>::const_iterator i = prefix->actions.begin();
-	i != prefix->actions.end();
+
+  assert( is_prefix( *prefix ) );
+
+  const size_t key_count = prefix->keys.size();
+
+  keys.erase( 0, key_count );
+  resizes.erase( resizes.begin(), resizes.begin() + prefix->resizes.size() );
+  history_requests.erase( history_requests.begin(), history_requests.begin() + prefix->history_requests.size() );
+  for ( vector<UserResize>::iterator i = resizes.begin();
+	i != resizes.end();
 	i++ ) {
-    assert( this != prefix );
-    assert( !actions.empty() );
-    assert( *i == actions.front() );
-    actions.pop_front();
+    i->offset -= key_count;
   }
 }
 
 string UserStream::diff_from( const UserStream &existing ) const
 {
-  deque<UserEvent>::const_iterator my_it = actions.begin();
-
-  for ( deque<UserEvent>::const_iterator i = existing.actions.begin();
-	i != existing.actions.end();
-	i++ ) {
-    assert( my_it != actions.end() );
-    assert( *i == *my_it );
-    my_it++;
-  }
+  assert( is_prefix( existing ) );
 
   ClientBuffers::UserMessage output;
 
-  while ( my_it != actions.end() ) {
-    switch ( my_it->type ) {
-    case UserByteType:
-      {
-	char the_byte = my_it->userbyte.c;
-	/* can we combine this with a previous Keystroke? */
-	if ( (output.instruction_size() > 0)
-	     && (output.instruction( output.instruction_size() - 1 ).HasExtension( keystroke )) ) {
-	  output.mutable_instruction( output.instruction_size() - 1 )->MutableExtension( keystroke )->mutable_keys()->append( string( &the_byte, 1 ) );
-	} else {
-	  Instruction *new_inst = output.add_instruction();
-	  new_inst->MutableExtension( keystroke )->set_keys( &the_byte, 1 );
-	}
-      }
-      break;
-    case ResizeType:
-      {
-	Instruction *new_inst = output.add_instruction();
-	new_inst->MutableExtension( resize )->set_width( my_it->resize.width );
-	new_inst->MutableExtension( resize )->set_height( my_it->resize.height );
-      }
-      break;
-    default:
-      assert( false );
-      break;
+  size_t key_pos = existing.keys.size();
+
+  for ( vector<UserResize>::const_iterator i = resizes.begin() + existing.resizes.size();
+	i != resizes.end();
+	i++ ) {
+    if ( i->offset > key_pos ) {
+      output.add_instruction()->MutableExtension( keystroke )->set_keys( keys.data() + key_pos, i->offset - key_pos );
+      key_pos = i->offset;
     }
 
-    my_it++;
+    Instruction *new_inst = output.add_instruction();
+    new_inst->MutableExtension( resize )->set_width( i->width );
+    new_inst->MutableExtension( resize )->set_height( i->height );
+  }
+
+  if ( keys.size() > key_pos ) {
+    output.add_instruction()->MutableExtension( keystroke )->set_keys( keys.data() + key_pos, keys.size() - key_pos );
+  }
+
+  for ( vector<UserHistoryRequest>::const_iterator i = history_requests.begin() + existing.history_requests.size();
+	i != history_requests.end();
+	i++ ) {
+    HistoryRequest *request = output.add_instruction()->MutableExtension( history );
+    request->set_id( i->id );
+    request->set_end( i->end );
+    request->set_count( i->count );
   }
 
   return output.SerializeAsString();
@@ -112,26 +149,14 @@ void UserStream::apply_string( string diff )
 
   for ( int i = 0; i < input.instruction_size(); i++ ) {
     if ( input.instruction( i ).HasExtension( keystroke ) ) {
-      string the_bytes = input.instruction( i ).GetExtension( keystroke ).keys();
-      for ( unsigned int loc = 0; loc < the_bytes.size(); loc++ ) {
-	actions.push_back( UserEvent( UserByte( the_bytes.at( loc ) ) ) );
-      }
+      keys.append( input.instruction( i ).GetExtension( keystroke ).keys() );
     } else if ( input.instruction( i ).HasExtension( resize ) ) {
-      actions.push_back( UserEvent( Resize( input.instruction( i ).GetExtension( resize ).width(),
-					    input.instruction( i ).GetExtension( resize ).height() ) ) );
+      resizes.push_back( UserResize( keys.size(),
+				     input.instruction( i ).GetExtension( resize ).width(),
+				     input.instruction( i ).GetExtension( resize ).height() ) );
+    } else if ( input.instruction( i ).HasExtension( history ) ) {
+      const HistoryRequest &request = input.instruction( i ).GetExtension( history );
+      history_requests.push_back( UserHistoryRequest( request.id(), request.end(), request.count() ) );
     }
   }
 }
-
-const Parser::Action *UserStream::get_action( unsigned int i ) const
-{
-  switch( actions[ i ].type ) {
-  case UserByteType:
-    return &( actions[ i ].userbyte );
-  case ResizeType:
-    return &( actions[ i ].resize );
-  default:
-    assert( false );
-    return NULL;
-  }
-}
@@ -33,66 +33,98 @@
 #ifndef USER_HPP
 #define USER_HPP
 
-#include <deque>
-#include <list>
+#include <vector>
 #include <string>
 #include <assert.h>
+#include <stdint.h>
 
 #include "parseraction.h"
 
-using std::deque;
-using std::list;
+using std::vector;
 using std::string;
 
 namespace Network {
-  enum UserEventType {
-    UserByteType = 0,
-    ResizeType = 1
+  /* A resize, positioned in the stream by how many keystroke bytes
+     precede it. */
+  class UserResize
+  {
+  public:
+    size_t offset;
+    int width, height;
+
+    UserResize( size_t s_offset, int s_width, int s_height )
+      : offset( s_offset ), width( s_width ), height( s_height )
+    {}
+
+    bool operator==( const UserResize &x ) const
+    {
+      return ( offset == x.offset ) && ( width == x.width ) && ( height == x.height );
+    }
   };
 
-  class UserEvent
+  /* A request for the count lines of the server's scrollback that end
+     just before line end (or the newest lines, if end is 0). The reply
+     carries the same id. */
+  class UserHistoryRequest
   {
   public:
-    UserEventType type;
-    Parser::UserByte userbyte;
-    Parser::Resize resize;
+    unsigned int id;
+    uint64_t end;
+    unsigned int count;
 
-    UserEvent( Parser::UserByte s_userbyte ) : type( UserByteType ), userbyte( s_userbyte ), resize( -1, -1 ) {}
-    UserEvent( Parser::Resize s_resize ) : type( ResizeType ), userbyte( 0 ), resize( s_resize ) {}
+    UserHistoryRequest( unsigned int s_id, uint64_t s_end, unsigned int s_count )
+      : id( s_id ), end( s_end ), count( s_count )
+    {}
 
-    UserEvent() /* default constructor required by C++11 STL */
-      : type( UserByteType ),
-	userbyte( 0 ),
-	resize( -1, -1 )
+    bool operator==( const UserHistoryRequest &x ) const
     {
-      assert( false );
+      return ( id == x.id ) && ( end == x.end ) && ( count == x.count );
     }
-
-    bool operator==( const UserEvent &x ) const { return ( type == x.type ) && ( userbyte == x.userbyte ) && ( resize == x.resize ); }
   };
 
+  /* The user's input is a log of keystroke bytes interleaved with
+     occasional resizes. Keep the bytes contiguous so that states
+     (which Transport copies freely) stay cheap however much has been
+     pasted, and keep the resizes on the side. History requests do not
+     touch the terminal, so they are kept in order among themselves
+     only. */
   class UserStream
   {
   private:
-    deque<UserEvent> actions;
-    
+    string keys;
+    vector<UserResize> resizes;
+    vector<UserHistoryRequest> history_requests;
+
+    bool is_prefix( const UserStream &prefix ) const;
+
   public:
-    UserStream() : actions() {}
+    UserStream() : keys(), resizes(), history_requests() {}
     
-    void push_back( Parser::UserByte s_userbyte ) { actions.push_back( UserEvent( s_userbyte ) ); }
-    void push_back( Parser::Resize s_resize ) { actions.push_back( UserEvent( s_resize ) ); }
+    void push_back( Parser::UserByte s_userbyte ) { keys.push_back( s_userbyte.c ); }
+    void push_back( Parser::Resize s_resize );
+    void push_back( const char *s_bytes, size_t s_len ) { keys.append( s_bytes, s_len ); }
+    void push_back( const UserHistoryRequest &s_request ) { history_requests.push_back( s_request ); }
     
-    bool empty( void ) const { return actions.empty(); }
-    size_t size( void ) const { return actions.size(); }
-    const Parser::Action *get_action( unsigned int i ) const;
+    bool empty( void ) const { return keys.empty() && resizes.empty() && history_requests.empty(); }
+
+    /* Iteration: the bytes before get_resize( 0 ).offset come first,
+       then that resize, then the bytes up to the next one, and so on. */
+    const string & get_keys( void ) const { return keys; }
+    size_t resize_count( void ) const { return resizes.size(); }
+    const UserResize & get_resize( size_t i ) const { return resizes[ i ]; }
+    size_t history_request_count( void ) const { return history_requests.size(); }
+    const UserHistoryRequest & get_history_request( size_t i ) const { return history_requests[ i ]; }
     
     /* interface for Network::Transport */
     void subtract( const UserStream *prefix );
     string diff_from( const UserStream &existing ) const;
     void apply_string( string diff );
-    bool operator==( const UserStream &x ) const { return actions == x.actions; }
+    bool operator==( const UserStream &x ) const
+    {
+      return ( keys == x.keys ) && ( resizes == x.resizes ) && ( history_requests == x.history_requests );
+    }
 
-    bool compare( const UserStream & ) { return false; }
+    bool compare( const UserStream & ) const { return false; }
   };
 }
 
@@ -88,7 +88,7 @@ namespace Parser {
       return parser == x.parser;
     }
 
-    bool is_grounded( void ) const { return parser.is_grounded(); }
+    bool is_grounded( void ) const { return parser.is_grounded() && (buf_len == 0); }
   };
 }
 
@@ -103,8 +103,9 @@ void OSC_End::act_on_terminal( Terminal::Emulator *emu ) const
 
 void UserByte::act_on_terminal( Terminal::Emulator *emu ) const
 {
-  emu->dispatch.terminal_to_host.append( emu->user.input( this,
-							  emu->fb.ds.application_mode_cursor_keys ) );
+  handled = true;
+  emu->user.input( c, emu->fb.ds.application_mode_cursor_keys,
+		   emu->dispatch.terminal_to_host );
 }
 
 void Resize::act_on_terminal( Terminal::Emulator *emu ) const
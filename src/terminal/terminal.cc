@@ -45,6 +45,13 @@ Emulator::Emulator( size_t s_width, size_t s_height )
   : fb( s_width, s_height ), dispatch(), user()
 {}
 
+void Emulator::user_input( const char *keys, size_t len )
+{
+  for ( size_t i = 0; i < len; i++ ) {
+    user.input( keys[ i ], fb.ds.application_mode_cursor_keys, dispatch.terminal_to_host );
+  }
+}
+
 std::string Emulator::read_octets_to_host( void )
 {
   std::string ret = dispatch.terminal_to_host;
@@ -76,9 +76,11 @@ namespace Terminal {
   public:
     Emulator( size_t s_width, size_t s_height );
 
+    void user_input( const char *keys, size_t len ); /* keystrokes from the client */
     std::string read_octets_to_host( void );
 
     const Framebuffer & get_fb( void ) const { return fb; }
+    void set_scrollback( const shared::shared_ptr<Scrollback> &s_scrollback ) { fb.set_scrollback( s_scrollback ); }
 
     bool operator==( Emulator const &x ) const;
   };
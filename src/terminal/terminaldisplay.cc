@@ -139,6 +139,10 @@ std::string Display::new_frame( bool initialized, const Framebuffer &last, const
     frame.current_rendition = frame.last_frame.ds.get_renditions();
   }
 
+  if ( switch_screens ) {
+    put_other_screen( initialized, frame, f );
+  }
+
   /* shortcut -- has display moved up by a certain number of lines? */
   frame.y = 0;
 
@@ -147,7 +151,8 @@ std::string Display::new_frame( bool initialized, const Framebuffer &last, const
     int scroll_height = 0;
 
     for ( int row = 0; row < frame.last_frame.ds.get_height(); row++ ) {
-      if ( *(f.get_row( 0 )) == *(frame.last_frame.get_row( row )) ) {
+      if ( f.same_row( 0, frame.last_frame, row )
+	   || *(f.get_row( 0 )) == *(frame.last_frame.get_row( row )) ) {
 	/* found a scroll */
 	lines_scrolled = row;
 	scroll_height = 1;
@@ -156,7 +161,8 @@ std::string Display::new_frame( bool initialized, const Framebuffer &last, const
 	for ( int region_height = 1;
 	      lines_scrolled + region_height < f.ds.get_height();
 	      region_height++ ) {
-	  if ( *(f.get_row( region_height ))
+	  if ( f.same_row( region_height, frame.last_frame, lines_scrolled + region_height )
+	       || *(f.get_row( region_height ))
 	       == *(frame.last_frame.get_row( lines_scrolled + region_height )) ) {
 	    scroll_height = region_height + 1;
 	  } else {
@@ -198,7 +204,7 @@ std::string Display::new_frame( bool initialized, const Framebuffer &last, const
 	/* do the move in memory */
 	for ( int i = top_margin; i <= bottom_margin; i++ ) {
 	  if ( i + lines_scrolled <= bottom_margin ) {
-	    *(frame.last_frame.get_mutable_row( i )) = *(frame.last_frame.get_row( i + lines_scrolled ));
+	    frame.last_frame.share_row( i, frame.last_frame, i + lines_scrolled );
 	  } else {
 	    frame.last_frame.get_mutable_row( i )->reset( 0 );
 	  }
@@ -215,51 +221,7 @@ std::string Display::new_frame( bool initialized, const Framebuffer &last, const
     }
   }
 
-  /* iterate for every cell */
-  for ( ; frame.y < f.ds.get_height(); frame.y++ ) {
-    int last_x = 0;
-    for ( frame.x = 0;
-	  frame.x < f.ds.get_width(); /* let put_cell() handle advance */ ) {
-      last_x = frame.x;
-      put_cell( initialized, frame, f );
-    }
-
-    /* To hint that a word-select should group the end of one line
-       with the beginning of the next, we let the real cursor
-       actually wrap around in cases where it wrapped around for us. */
-
-    if ( (frame.y < f.ds.get_height() - 1)
-	 && f.get_row( frame.y )->get_wrap() ) {
-      frame.x = last_x;
-
-      while ( frame.x < f.ds.get_width() ) {
-	frame.force_next_put = true;
-	put_cell( initialized, frame, f );
-      }
-
-      /* next write will wrap */
-      frame.cursor_x = 0;
-      frame.cursor_y++;
-      frame.force_next_put = true;
-    }
-
-    /* Turn off wrap */
-    if ( (frame.y < f.ds.get_height() - 1)
-	 && (!f.get_row( frame.y )->get_wrap())
-	 && (!initialized || frame.last_frame.get_row( frame.y )->get_wrap()) ) {
-      frame.x = last_x;
-      if ( initialized ) {
-	frame.last_frame.reset_cell( frame.last_frame.get_mutable_cell( frame.y, frame.x ) );
-      }
-
-      snprintf( tmp, 64, "\033[%d;%dH\033[K", frame.y + 1, frame.x + 1 );
-      frame.append( tmp );
-      frame.cursor_x = frame.x;
-
-      frame.force_next_put = true;
-      put_cell( initialized, frame, f );
-    }
-  }
+  put_rows( initialized, frame, f );
 
   /* has cursor location changed? */
   if ( (!initialized)
@@ -339,6 +301,115 @@ std::string Display::new_frame( bool initialized, const Framebuffer &last, const
   return frame.str;
 }
 
+/* Draw the rows of f from frame.y down. */
+void Display::put_rows( bool initialized, FrameState &frame, const Framebuffer &f ) const
+{
+  char tmp[ 64 ];
+
+  for ( ; frame.y < f.ds.get_height(); frame.y++ ) {
+
+    /* a row shared with the last frame is unchanged; skip it unless it
+       wraps, which is rewritten each time (see below) */
+    if ( initialized
+	 && !frame.force_next_put
+	 && f.same_row( frame.y, frame.last_frame, frame.y )
+	 && !f.get_row( frame.y )->get_wrap() ) {
+      continue;
+    }
+
+    int last_x = 0;
+    for ( frame.x = 0;
+	  frame.x < f.ds.get_width(); /* let put_cell() handle advance */ ) {
+      last_x = frame.x;
+      put_cell( initialized, frame, f );
+    }
+
+    /* To hint that a word-select should group the end of one line
+       with the beginning of the next, we let the real cursor
+       actually wrap around in cases where it wrapped around for us. */
+
+    if ( (frame.y < f.ds.get_height() - 1)
+	 && f.get_row( frame.y )->get_wrap() ) {
+      frame.x = last_x;
+
+      while ( frame.x < f.ds.get_width() ) {
+	frame.force_next_put = true;
+	put_cell( initialized, frame, f );
+      }
+
+      /* next write will wrap */
+      frame.cursor_x = 0;
+      frame.cursor_y++;
+      frame.force_next_put = true;
+    }
+
+    /* Turn off wrap */
+    if ( (frame.y < f.ds.get_height() - 1)
+	 && (!f.get_row( frame.y )->get_wrap())
+	 && (!initialized || frame.last_frame.get_row( frame.y )->get_wrap()) ) {
+      frame.x = last_x;
+      if ( initialized ) {
+	frame.last_frame.reset_cell( frame.last_frame.get_mutable_cell( frame.y, frame.x ) );
+      }
+
+      snprintf( tmp, 64, "\033[%d;%dH\033[K", frame.y + 1, frame.x + 1 );
+      frame.append( tmp );
+      frame.cursor_x = frame.x;
+
+      frame.force_next_put = true;
+      put_cell( initialized, frame, f );
+    }
+  }
+}
+
+/* On a terminal that keeps both screens, bring the one that f does
+   not show up to date, and switch screens if f shows the other one.
+   Until it is needed again, the hidden screen costs nothing. */
+void Display::put_other_screen( bool initialized, FrameState &frame, const Framebuffer &f ) const
+{
+  const bool switching = ( f.is_alternate_screen() != frame.last_frame.is_alternate_screen() );
+
+  /* the screen f hides, as it should be and as the terminal has it */
+  Framebuffer other( f );
+  other.swap_screens();
+  if ( !switching ) {
+    frame.last_frame.swap_screens();
+  }
+
+  const bool changed = ( !initialized ) || ( !other.same_screen( frame.last_frame ) );
+  if ( changed ) {
+    if ( (!switching) || (!initialized) ) {
+      frame.append( other.is_alternate_screen() ? "\033[?47h" : "\033[?47l" );
+    }
+
+    if ( !initialized ) {
+      frame.append( "\033[0m\033[H\033[2J" );
+      frame.current_rendition = initial_rendition();
+    }
+
+    frame.cursor_x = frame.cursor_y = -1;
+    frame.y = 0;
+    put_rows( initialized, frame, other );
+
+    /* the cursor is shared, but make no assumptions about it */
+    frame.cursor_x = frame.cursor_y = -1;
+    frame.force_next_put = false;
+  }
+
+  if ( switching || changed ) {
+    frame.append( f.is_alternate_screen() ? "\033[?47h" : "\033[?47l" );
+  }
+
+  /* after a resize, neither screen can be trusted */
+  if ( !initialized ) {
+    frame.append( "\033[0m\033[H\033[2J" );
+    frame.current_rendition = initial_rendition();
+  }
+
+  /* the terminal now shows the screen f shows */
+  frame.last_frame.swap_screens();
+}
+
 void Display::put_cell( bool initialized, FrameState &frame, const Framebuffer &f ) const
 {
   char tmp[ 64 ];
@@ -80,7 +80,13 @@ namespace Terminal {
 
     const char *smcup, *rmcup; /* enter and exit alternate screen mode */
 
+    bool switch_screens; /* the terminal keeps the screen it is not showing, so
+			    a switch need not redraw. True of mosh's own emulator;
+			    the user's terminal has mosh itself on its alternate screen. */
+
     void put_cell( bool initialized, FrameState &frame, const Framebuffer &f ) const;
+    void put_rows( bool initialized, FrameState &frame, const Framebuffer &f ) const;
+    void put_other_screen( bool initialized, FrameState &frame, const Framebuffer &f ) const;
 
   public:
     void downgrade( Framebuffer &f ) const { if ( posterize_colors ) { f.posterize(); } }
@@ -90,7 +90,8 @@ const char *Display::ti_str( const char *capname )
 }
 
 Display::Display( bool use_environment )
-  : has_ech( true ), has_bce( true ), has_title( true ), posterize_colors( false ), smcup( NULL ), rmcup( NULL )
+  : has_ech( true ), has_bce( true ), has_title( true ), posterize_colors( false ), smcup( NULL ), rmcup( NULL ),
+    switch_screens( !use_environment )
 {
   if ( use_environment ) {
     int errret = -2;
@@ -32,8 +32,10 @@
 
 #include <assert.h>
 #include <stdio.h>
+#include <algorithm>
 
 #include "terminalframebuffer.h"
+#include "terminalscrollback.h"
 
 using namespace Terminal;
 
@@ -69,7 +71,8 @@ DrawState::DrawState( int s_width, int s_height )
 }
 
 Framebuffer::Framebuffer( int s_width, int s_height )
-  : rows( s_height, Row( s_width, 0 ) ), icon_name(), window_title(), bell_count( 0 ), title_initialized( false ), ds( s_width, s_height )
+  : rows( s_height, row_pointer( new Row( s_width, 0 ) ) ), other_rows( rows ), alternate_screen( false ),
+    icon_name(), window_title(), bell_count( 0 ), title_initialized( false ), scrollback(), ds( s_width, s_height )
 {
   assert( s_height > 0 );
   assert( s_width > 0 );
@@ -79,6 +82,10 @@ void Framebuffer::scroll( int N )
 {
   if ( N >= 0 ) {
     for ( int i = 0; i < N; i++ ) {
+      /* as in xterm, only lines leaving the top of the normal screen are kept */
+      if ( scrollback && (!alternate_screen) && (ds.get_scrolling_region_top_row() == 0) ) {
+	scrollback->push( *rows.front() );
+      }
       delete_line( ds.get_scrolling_region_top_row() );
       ds.move_row( -1, true );
     }
@@ -170,7 +177,7 @@ Cell *Framebuffer::get_combining_cell( void )
     return NULL;
   } /* can happen if a resize came in between */
 
-  return &rows[ ds.get_combining_char_row() ].cells[ ds.get_combining_char_col() ];
+  return &unshare_row( ds.get_combining_char_row() )->cells[ ds.get_combining_char_col() ];
 }
 
 void DrawState::set_tab( void )
@@ -300,19 +307,21 @@ void Row::delete_cell( int col, int background_color )
 
 void Framebuffer::insert_cell( int row, int col )
 {
-  rows[ row ].insert_cell( col, ds.get_background_rendition() );
+  unshare_row( row )->insert_cell( col, ds.get_background_rendition() );
 }
 
 void Framebuffer::delete_cell( int row, int col )
 {
-  rows[ row ].delete_cell( col, ds.get_background_rendition() );
+  unshare_row( row )->delete_cell( col, ds.get_background_rendition() );
 }
 
 void Framebuffer::reset( void )
 {
   int width = ds.get_width(), height = ds.get_height();
   ds = DrawState( width, height );
-  rows = std::deque<Row>( height, newrow() );
+  rows = rows_type( height, newrow() );
+  other_rows = rows;
+  alternate_screen = false;
   window_title.clear();
   /* do not reset bell_count */
 }
@@ -330,13 +339,22 @@ void Framebuffer::soft_reset( void )
 
 void Framebuffer::posterize( void )
 {
-  for ( rows_type::iterator i = rows.begin();
-        i != rows.end();
-        i++ ) {
-    for ( Row::cells_type::iterator j = i->cells.begin();
-          j != i->cells.end();
-          j++ ) {
-      j->renditions.posterize();
+  for ( int row = 0; row < int( rows.size() ); row++ ) {
+    /* leave rows that would not change shared */
+    const Row::cells_type &cells = rows[ row ]->cells;
+    Row::cells_type::const_iterator j = cells.begin();
+    while ( j != cells.end() && !j->renditions.needs_posterize() ) {
+      j++;
+    }
+    if ( j == cells.end() ) {
+      continue;
+    }
+
+    Row *r = unshare_row( row );
+    for ( Row::cells_type::iterator k = r->cells.begin() + ( j - cells.begin() );
+          k != r->cells.end();
+          k++ ) {
+      k->renditions.posterize();
     }
   }
 }
@@ -346,16 +364,201 @@ void Framebuffer::resize( int s_width, int s_height )
   assert( s_width > 0 );
   assert( s_height > 0 );
 
-  rows.resize( s_height, newrow() );
+  if ( (s_width == ds.get_width()) && (s_height == ds.get_height()) ) {
+    return;
+  }
 
-  for ( rows_type::iterator i = rows.begin();
-	i != rows.end();
-	i++ ) {
-    i->set_wrap( false );
-    i->cells.resize( s_width, Cell( ds.get_background_rendition() ) );
+  /* Text on the normal screen is rewrapped to the new width. The
+     alternate screen belongs to a full-screen program, which will
+     repaint it, so it is only cut or padded. */
+  int cursor_row, cursor_col;
+  if ( alternate_screen ) {
+    /* The cursor saved by mode 1049 goes back to the normal screen,
+       so it follows its character there. One saved before an earlier
+       resize can be off the screen, so bring it inside first. */
+    cursor_row = std::min( ds.get_saved_cursor_row(), ds.get_height() - 1 );
+    cursor_col = std::min( ds.get_saved_cursor_col(), ds.get_width() - 1 );
+    resize_rows( rows, s_width, s_height );
+    reflow_rows( other_rows, s_width, s_height, cursor_row, cursor_col );
+  } else {
+    cursor_row = ds.get_cursor_row();
+    cursor_col = ds.get_cursor_col();
+    reflow_rows( rows, s_width, s_height, cursor_row, cursor_col );
+    resize_rows( other_rows, s_width, s_height );
   }
 
+  const bool pending_wrap = ds.next_print_will_wrap;
   ds.resize( s_width, s_height );
+
+  if ( alternate_screen ) {
+    ds.move_saved_cursor( cursor_row, cursor_col );
+  } else {
+    /* The cursor stays on the same character. A pending wrap is not
+       part of the state sent to the client, so it cannot be allowed
+       to move the cursor here; it is kept if the cursor is still in
+       the last column. */
+    ds.move_row( cursor_row );
+    ds.move_col( cursor_col );
+    ds.next_print_will_wrap = pending_wrap && (cursor_col == s_width - 1);
+  }
+}
+
+void Framebuffer::resize_rows( rows_type &r, int s_width, int s_height )
+{
+  r.resize( s_height, newrow() );
+
+  for ( int row = 0; row < s_height; row++ ) {
+    Row *this_row = unshare( r[ row ] );
+    this_row->set_wrap( false );
+    this_row->cells.resize( s_width, Cell( ds.get_background_rendition() ) );
+  }
+}
+
+static bool is_blank_cell( const Cell &cell )
+{
+  static const Renditions plain( 0 );
+  return cell.is_blank() && (cell.renditions == plain);
+}
+
+static bool is_blank_row( const Row &row )
+{
+  for ( Row::cells_type::const_iterator i = row.cells.begin();
+	i != row.cells.end();
+	i++ ) {
+    if ( !is_blank_cell( *i ) ) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/* Rewrap the logical lines of r (rows joined by their wrap flags) to
+   s_width in one pass, as if their text had been printed at that
+   width, and move cursor_row and cursor_col (unless cursor_row is -1)
+   to the same character. Blank rows below the cursor are dropped;
+   then, if there are still too many rows, those at the top go to the
+   scrollback as they would have scrolled off. If the width is the
+   same, rows are kept as they are, still shared. */
+void Framebuffer::reflow_rows( rows_type &r, int s_width, int s_height, int &cursor_row, int &cursor_col )
+{
+  const int old_width = ds.get_width();
+  const int background = ds.get_background_rendition();
+
+  int end = r.size();
+  while ( (end > cursor_row + 1) && is_blank_row( *r[ end - 1 ] ) ) {
+    end--;
+  }
+
+  rows_type out;
+  int new_cursor_row = -1, new_cursor_col = 0;
+
+  for ( int first = 0; first < end; ) {
+    int last = first;
+    while ( (last < end - 1) && r[ last ]->get_wrap() ) {
+      last++;
+    }
+
+    if ( s_width == old_width ) {
+      if ( (first <= cursor_row) && (cursor_row <= last) ) {
+	new_cursor_row = out.size() + cursor_row - first;
+	new_cursor_col = cursor_col;
+      }
+      out.insert( out.end(), r.begin() + first, r.begin() + last + 1 );
+      first = last + 1;
+      continue;
+    }
+
+    /* the line's length, less the blanks at its end */
+    int length = (last - first + 1) * old_width;
+    while ( (length > 0)
+	    && is_blank_cell( r[ first + (length - 1) / old_width ]->cells[ (length - 1) % old_width ] ) ) {
+      length--;
+    }
+
+    int target = -1;
+    if ( (first <= cursor_row) && (cursor_row <= last) ) {
+      target = (cursor_row - first) * old_width + cursor_col;
+    }
+
+    Row *row = new Row( s_width, background );
+    out.push_back( row_pointer( row ) );
+    int col = 0;
+    for ( int i = 0; i < length; i++ ) {
+      const Cell &cell = r[ first + i / old_width ]->cells[ i % old_width ];
+      if ( (col > 0) && (col + cell.width > s_width) ) {
+	/* a wide character that does not fit leaves the row
+	   unwrapped, as in Emulator::print() */
+	row->set_wrap( col == s_width );
+	row = new Row( s_width, background );
+	out.push_back( row_pointer( row ) );
+	col = 0;
+      }
+      if ( i == target ) {
+	new_cursor_row = out.size() - 1;
+	new_cursor_col = col;
+      }
+      row->cells[ col ] = cell;
+      row->cells[ col ].wrap = false;
+      col++;
+    }
+
+    /* the cursor is past the end of the text */
+    if ( target >= length ) {
+      const int offset = col + target - length;
+      new_cursor_row = out.size() - 1 + offset / s_width;
+      new_cursor_col = offset % s_width;
+    }
+
+    first = last + 1;
+  }
+
+  if ( cursor_row >= 0 ) {
+    cursor_row = new_cursor_row;
+    cursor_col = new_cursor_col;
+    while ( int( out.size() ) <= cursor_row ) {
+      out.push_back( row_pointer( new Row( s_width, background ) ) );
+    }
+  }
+
+  int top = std::max( int( out.size() ) - s_height, 0 );
+  if ( cursor_row >= 0 ) {
+    top = std::min( top, cursor_row );
+    cursor_row -= top;
+  }
+
+  if ( scrollback ) {
+    for ( int i = 0; i < top; i++ ) {
+      scrollback->push( *out[ i ] );
+    }
+  }
+
+  r.assign( out.begin() + top, out.begin() + std::min( int( out.size() ), top + s_height ) );
+
+  /* the bottom row cannot wrap to anything, and the display would
+     not reproduce the flag there (r is empty when every row was
+     blank and there is no cursor to keep) */
+  if ( !r.empty() && r.back()->get_wrap() ) {
+    unshare( r.back() )->set_wrap( false );
+  }
+
+  while ( int( r.size() ) < s_height ) {
+    r.push_back( row_pointer( new Row( s_width, background ) ) );
+  }
+}
+
+bool Framebuffer::same_rows( const rows_type &a, const rows_type &b )
+{
+  if ( a.size() != b.size() ) {
+    return false;
+  }
+
+  for ( size_t i = 0; i < a.size(); i++ ) {
+    if ( a[ i ] != b[ i ] && !( *a[ i ] == *b[ i ] ) ) {
+      return false;
+    }
+  }
+
+  return true;
 }
 
 void DrawState::resize( int s_width, int s_height )
@@ -389,77 +592,100 @@ void DrawState::resize( int s_width, int s_height )
 }
 
 Renditions::Renditions( int s_background )
-  : bold( false ), italic( false ), underlined( false ), blink( false ),
-    inverse( false ), invisible( false ), foreground_color( 0 ),
-    background_color( s_background )
+  : bits( uint64_t( s_background ) << COLOR_BITS )
 {}
 
+void Renditions::set_colors( int foreground, int background )
+{
+  bits = (bits & ~((COLOR_MASK << COLOR_BITS) | COLOR_MASK))
+    | (uint64_t( background ) << COLOR_BITS) | uint64_t( foreground );
+}
+
 /* This routine cannot be used to set a color beyond the 16-color set. */
 void Renditions::set_rendition( int num )
 {
   if ( num == 0 ) {
-    bold = italic = underlined = blink = inverse = invisible = false;
-    foreground_color = background_color = 0;
+    bits = 0;
     return;
   }
 
   if ( num == 39 ) {
-    foreground_color = 0;
+    set_colors( 0, get_background_color() );
     return;
   } else if ( num == 49 ) {
-    background_color = 0;
+    set_colors( get_foreground_color(), 0 );
     return;
   }
 
   if ( (30 <= num) && (num <= 37) ) { /* foreground color in 8-color set */
-    foreground_color = num;
+    set_colors( num, get_background_color() );
     return;
   } else if ( (40 <= num) && (num <= 47) ) { /* background color in 8-color set */
-    background_color = num;
+    set_colors( get_foreground_color(), num );
     return;
   } else if ( (90 <= num) && (num <= 97) ) { /* foreground color in 16-color set */
-    foreground_color = num - 90 + 38;
+    set_colors( num - 90 + 38, get_background_color() );
     return;
   } else if ( (100 <= num) && (num <= 107) ) { /* background color in 16-color set */
-    background_color = num - 100 + 48;
+    set_colors( get_foreground_color(), num - 100 + 48 );
     return;
   }
 
   switch ( num ) {
-  case 1: case 22: bold = (num == 1); break;
-  case 3: case 23: italic = (num == 3); break;
-  case 4: case 24: underlined = (num == 4); break;
-  case 5: case 25: blink = (num == 5); break;
-  case 7: case 27: inverse = (num == 7); break;
-  case 8: case 28: invisible = (num == 8); break;
+  case 1: case 22: set_attribute( bold, num == 1 ); break;
+  case 3: case 23: set_attribute( italic, num == 3 ); break;
+  case 4: case 24: set_attribute( underlined, num == 4 ); break;
+  case 5: case 25: set_attribute( blink, num == 5 ); break;
+  case 7: case 27: set_attribute( inverse, num == 7 ); break;
+  case 8: case 28: set_attribute( invisible, num == 8 ); break;
   }
 }
 
+/* num is a palette entry or a true color */
 void Renditions::set_foreground_color( int num )
 {
-  if ( (0 <= num) && (num <= 255) ) {
-    foreground_color = 30 + num;
+  if ( is_true_color( num ) ) {
+    set_colors( num, get_background_color() );
+  } else if ( (0 <= num) && (num <= 255) ) {
+    set_colors( 30 + num, get_background_color() );
   }
 }
 
 void Renditions::set_background_color( int num )
 {
-  if ( (0 <= num) && (num <= 255) ) {
-    background_color = 40 + num;
+  if ( is_true_color( num ) ) {
+    set_colors( get_foreground_color(), num );
+  } else if ( (0 <= num) && (num <= 255) ) {
+    set_colors( get_foreground_color(), 40 + num );
   }
 }
 
-std::string Renditions::sgr( void ) const
+static void append_color( std::string &ret, int selector, int color )
+{
+  char col[ 64 ];
+  if ( Renditions::is_true_color( color ) ) {
+    snprintf( col, 64, "\033[%d;2;%d;%d;%dm", selector,
+	      (color >> 16) & 0xff, (color >> 8) & 0xff, color & 0xff );
+  } else {
+    snprintf( col, 64, "\033[%d;5;%dm", selector, color - selector + 8 );
+  }
+  ret.append( col );
+}
+
+static std::string make_sgr( const Renditions &r )
 {
   std::string ret;
 
   ret.append( "\033[0" );
-  if ( bold ) ret.append( ";1" );
-  if ( italic ) ret.append( ";3" );
-  if ( underlined ) ret.append( ";4" );
-  if ( blink ) ret.append( ";5" );
-  if ( inverse ) ret.append( ";7" );
-  if ( invisible ) ret.append( ";8" );
+  if ( r.get_attribute( Renditions::bold ) ) ret.append( ";1" );
+  if ( r.get_attribute( Renditions::italic ) ) ret.append( ";3" );
+  if ( r.get_attribute( Renditions::underlined ) ) ret.append( ";4" );
+  if ( r.get_attribute( Renditions::blink ) ) ret.append( ";5" );
+  if ( r.get_attribute( Renditions::inverse ) ) ret.append( ";7" );
+  if ( r.get_attribute( Renditions::invisible ) ) ret.append( ";8" );
+
+  const int foreground_color = r.get_foreground_color();
+  const int background_color = r.get_background_color();
 
   if ( foreground_color
        && (foreground_color <= 37) ) {
@@ -478,21 +704,34 @@ std::string Renditions::sgr( void ) const
 
   ret.append( "m" );
 
-  if ( foreground_color > 37 ) { /* use 256-color set */
-    char col[ 64 ];
-    snprintf( col, 64, "\033[38;5;%dm", foreground_color - 30 );
-    ret.append( col );
+  if ( foreground_color > 37 ) { /* use 256-color set or true color */
+    append_color( ret, 38, foreground_color );
   }
 
-  if ( background_color > 47 ) { /* use 256-color set */
-    char col[ 64 ];
-    snprintf( col, 64, "\033[48;5;%dm", background_color - 40 );
-    ret.append( col );
+  if ( background_color > 47 ) {
+    append_color( ret, 48, background_color );
   }
 
   return ret;
 }
 
+/* An application uses few renditions, and the display asks for the
+   same ones again and again, so the strings are kept in a small
+   direct-mapped cache. The result is valid until the next call. */
+const std::string &Renditions::sgr( void ) const
+{
+  static const int CACHE_BITS = 6;
+  static std::pair<uint64_t, std::string> cache[ 1 << CACHE_BITS ];
+
+  std::pair<uint64_t, std::string> &slot = cache[ (bits * 0x9E3779B97F4A7C15ULL) >> (64 - CACHE_BITS) ];
+  if ( slot.second.empty() || (slot.first != bits) ) {
+    slot.first = bits;
+    slot.second = make_sgr( *this );
+  }
+
+  return slot.second;
+}
+
 /* Reduce 256 "standard" colors to the 8 ANSI colors. */
 
 /* Terminal emulators generally agree on the (R',G',B') values of the
@@ -535,15 +774,48 @@ static const char standard_posterization[] = {
   7, 7, 3, 3, 3, 3, 7, 7, 0, 0, 0, 0, 0, 0, 0, 0,
   0, 0, 1, 1, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7 };
 
+/* Index of the palette entry nearest to a color, which for a true
+   color is taken from the 6x6x6 cube. */
+static int palette_index( int color, int base )
+{
+  if ( !Renditions::is_true_color( color ) ) {
+    return color - base;
+  }
+
+  int index = 0;
+  for ( int shift = 16; shift >= 0; shift -= 8 ) {
+    const int level = (color >> shift) & 0xff;
+    /* the cube's levels are 0, 95, 135, 175, 215 and 255 */
+    index = index * 6 + ( level < 48 ? 0 : level < 115 ? 1 : (level - 35) / 40 );
+  }
+  return 16 + index;
+}
+
 void Renditions::posterize( void )
 {
+  int foreground_color = get_foreground_color();
+  int background_color = get_background_color();
+
   if ( foreground_color ) {
-    foreground_color = 30 + standard_posterization[ foreground_color - 30 ];
+    foreground_color = 30 + standard_posterization[ palette_index( foreground_color, 30 ) ];
   }
 
   if ( background_color ) {
-    background_color = 40 + standard_posterization[ background_color - 40 ];
+    background_color = 40 + standard_posterization[ palette_index( background_color, 40 ) ];
   }
+
+  set_colors( foreground_color, background_color );
+}
+
+bool Renditions::needs_posterize( void ) const
+{
+  const int foreground_color = get_foreground_color();
+  const int background_color = get_background_color();
+
+  return ( foreground_color
+           && foreground_color != 30 + standard_posterization[ palette_index( foreground_color, 30 ) ] )
+    || ( background_color
+         && background_color != 40 + standard_posterization[ palette_index( background_color, 40 ) ] );
 }
 
 void Row::reset( int background_color )
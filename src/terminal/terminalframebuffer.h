@@ -38,54 +38,83 @@
 #include <string>
 #include <list>
 #include <assert.h>
+#include <stdint.h>
+
+#include "shared.h"
 
 /* Terminal framebuffer */
 
 namespace Terminal {
+  class Scrollback;
+
+  /* A rendition packed into one word, so that cells copy and compare
+     it as a single integer. A colour is 0 for the default, 30 + n
+     (foreground) or 40 + n (background) for entry n of the 256-colour
+     palette, or TRUE_COLOR | 0xRRGGBB. */
   class Renditions {
   public:
-    bool bold, italic, underlined, blink, inverse, invisible;
-    int foreground_color;
-    int background_color;
+    enum attribute_type { bold, italic, underlined, blink, inverse, invisible };
+
+    static const int TRUE_COLOR = 0x1000000;
+
+  private:
+    static const int COLOR_BITS = 25;
+    static const uint64_t COLOR_MASK = (uint64_t( 1 ) << COLOR_BITS) - 1;
+
+    uint64_t bits; /* foreground, background, then one bit per attribute */
 
+    void set_colors( int foreground, int background );
+
+  public:
     Renditions( int s_background );
     void set_foreground_color( int num );
     void set_background_color( int num );
     void set_rendition( int num );
-    std::string sgr( void ) const;
+    const std::string &sgr( void ) const;
 
-    void posterize( void );
+    int get_foreground_color( void ) const { return int( bits & COLOR_MASK ); }
+    int get_background_color( void ) const { return int( (bits >> COLOR_BITS) & COLOR_MASK ); }
+
+    bool get_attribute( attribute_type attr ) const { return (bits >> (2 * COLOR_BITS + attr)) & 1; }
+    void set_attribute( attribute_type attr, bool val )
+    {
+      const uint64_t mask = uint64_t( 1 ) << (2 * COLOR_BITS + attr);
+      bits = val ? (bits | mask) : (bits & ~mask);
+    }
 
-    bool operator==( const Renditions &x ) const
+    static int make_true_color( int red, int green, int blue )
     {
-      return (bold == x.bold) && (italic == x.italic) && (underlined == x.underlined)
-	&& (blink == x.blink) && (inverse == x.inverse)
-	&& (invisible == x.invisible) && (foreground_color == x.foreground_color)
-	&& (background_color == x.background_color);
+      return TRUE_COLOR | (red << 16) | (green << 8) | blue;
     }
+    static bool is_true_color( int color ) { return color & TRUE_COLOR; }
+
+    void posterize( void );
+    bool needs_posterize( void ) const;
+
+    bool operator==( const Renditions &x ) const { return bits == x.bits; }
   };
 
   class Cell {
   public:
     std::vector<wchar_t> contents;
-    char fallback; /* first character is combining character */
-    int width;
     Renditions renditions;
+    int width;
+    char fallback; /* first character is combining character */
     bool wrap; /* if last cell, wrap to next line */
 
     Cell( int background_color )
       : contents(),
-	fallback( false ),
-	width( 1 ),
 	renditions( background_color ),
+	width( 1 ),
+	fallback( false ),
 	wrap( false )
     {}
 
     Cell() /* default constructor required by C++11 STL */
       : contents(),
-	fallback( false ),
-	width( 1 ),
 	renditions( 0 ),
+	width( 1 ),
+	fallback( false ),
 	wrap( false )
     {
       assert( false );
@@ -242,11 +271,14 @@ namespace Terminal {
     void set_background_color( int x ) { renditions.set_background_color( x ); }
     void add_rendition( int x ) { renditions.set_rendition( x ); }
     Renditions get_renditions( void ) const { return renditions; }
-    int get_background_rendition( void ) const { return renditions.background_color; }
+    int get_background_rendition( void ) const { return renditions.get_background_color(); }
 
     void save_cursor( void );
     void restore_cursor( void );
     void clear_saved_cursor( void ) { save = SavedCursor(); }
+    int get_saved_cursor_col( void ) const { return save.cursor_col; }
+    int get_saved_cursor_row( void ) const { return save.cursor_row; }
+    void move_saved_cursor( int row, int col ) { save.cursor_row = row; save.cursor_col = col; }
 
     void resize( int s_width, int s_height );
 
@@ -266,14 +298,45 @@ namespace Terminal {
 
   class Framebuffer {
   private:
-    typedef std::deque<Row> rows_type;
+    /* Rows are shared between copies of a framebuffer and copied only
+       when one of the copies changes them, so copying a framebuffer
+       costs a pointer per row. */
+    typedef shared::shared_ptr<Row> row_pointer;
+    typedef std::deque<row_pointer> rows_type;
     rows_type rows;
+
+    /* The screen not being shown: the normal screen while the
+       alternate one is up, and the other way round. Switching swaps
+       the two, which costs nothing. */
+    rows_type other_rows;
+    bool alternate_screen;
     std::deque<wchar_t> icon_name;
     std::deque<wchar_t> window_title;
     unsigned int bell_count;
     bool title_initialized; /* true if the window title has been set via an OSC */
 
-    Row newrow( void ) { return Row( ds.get_width(), ds.get_background_rendition() ); }
+    /* Where lines scrolled off the top of the screen go, if anywhere.
+       Copies share it; it is not part of the framebuffer's state. A
+       copy that is changed must be given none first. */
+    shared::shared_ptr<Scrollback> scrollback;
+
+    row_pointer newrow( void ) { return row_pointer( new Row( ds.get_width(), ds.get_background_rendition() ) ); }
+
+    /* Make the row ours alone before it is changed. */
+    static Row *unshare( row_pointer &r )
+    {
+      if ( r.use_count() != 1 ) {
+        r = row_pointer( new Row( *r ) );
+      }
+      return r.get();
+    }
+
+    Row *unshare_row( int row ) { return unshare( rows[ row ] ); }
+
+    void resize_rows( rows_type &r, int s_width, int s_height );
+    void reflow_rows( rows_type &r, int s_width, int s_height, int &cursor_row, int &cursor_col );
+
+    static bool same_rows( const rows_type &a, const rows_type &b );
 
   public:
     Framebuffer( int s_width, int s_height );
@@ -282,16 +345,24 @@ namespace Terminal {
     void scroll( int N );
     void move_rows_autoscroll( int rows );
 
+    bool is_alternate_screen( void ) const { return alternate_screen; }
+    void swap_screens( void ) { rows.swap( other_rows ); alternate_screen = !alternate_screen; }
+    void clear_screen( void ) { rows = rows_type( ds.get_height(), newrow() ); }
+    bool same_screen( const Framebuffer &other ) const { return same_rows( rows, other.rows ); }
+
+    void set_scrollback( const shared::shared_ptr<Scrollback> &s_scrollback ) { scrollback = s_scrollback; }
+    const shared::shared_ptr<Scrollback> & get_scrollback( void ) const { return scrollback; }
+
     const Row *get_row( int row ) const
     {
       if ( row == -1 ) row = ds.get_cursor_row();
 
-      return &rows[ row ];
+      return rows[ row ].get();
     }
 
     inline const Cell *get_cell( void ) const
     {
-      return &rows[ ds.get_cursor_row() ].cells[ ds.get_cursor_col() ];
+      return &rows[ ds.get_cursor_row() ]->cells[ ds.get_cursor_col() ];
     }
 
     inline const Cell *get_cell( int row, int col ) const
@@ -299,19 +370,25 @@ namespace Terminal {
       if ( row == -1 ) row = ds.get_cursor_row();
       if ( col == -1 ) col = ds.get_cursor_col();
 
-      return &rows[ row ].cells[ col ];
+      return &rows[ row ]->cells[ col ];
+    }
+
+    /* Whether row is, as opposed to equals, the same row in both. */
+    bool same_row( int row, const Framebuffer &other, int other_row ) const
+    {
+      return rows[ row ] == other.rows[ other_row ];
     }
 
     Row *get_mutable_row( int row )
     {
       if ( row == -1 ) row = ds.get_cursor_row();
 
-      return &rows[ row ];
+      return unshare_row( row );
     }
 
     inline Cell *get_mutable_cell( void )
     {
-      return &rows[ ds.get_cursor_row() ].cells[ ds.get_cursor_col() ];
+      return &unshare_row( ds.get_cursor_row() )->cells[ ds.get_cursor_col() ];
     }
 
     inline Cell *get_mutable_cell( int row, int col )
@@ -319,7 +396,13 @@ namespace Terminal {
       if ( row == -1 ) row = ds.get_cursor_row();
       if ( col == -1 ) col = ds.get_cursor_col();
 
-      return &rows[ row ].cells[ col ];
+      return &unshare_row( row )->cells[ col ];
+    }
+
+    /* Make row the same row as other_row of other, without copying it. */
+    void share_row( int row, const Framebuffer &other, int other_row )
+    {
+      rows[ row ] = other.rows[ other_row ];
     }
 
     Cell *get_combining_cell( void );
@@ -356,7 +439,9 @@ namespace Terminal {
 
     bool operator==( const Framebuffer &x ) const
     {
-      return ( rows == x.rows ) && ( window_title == x.window_title ) && ( bell_count == x.bell_count ) && ( ds == x.ds );
+      return ( window_title == x.window_title ) && ( bell_count == x.bell_count ) && ( ds == x.ds )
+        && ( alternate_screen == x.alternate_screen )
+        && same_rows( rows, x.rows ) && same_rows( other_rows, x.other_rows );
     }
   };
 }
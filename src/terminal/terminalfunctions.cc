@@ -284,6 +284,54 @@ static void set_if_available( bool *mode, bool value )
   if ( mode ) { *mode = value; }
 }
 
+/* Alternate screen modes, as in xterm. 47 only switches screens;
+   1047 clears the alternate screen on the way back; 1048 saves and
+   restores the cursor; 1049 saves the cursor and clears the
+   alternate screen on the way in, and restores the cursor on the way
+   back. */
+static bool set_screen_mode( int param, bool value, Framebuffer *fb )
+{
+  switch ( param ) {
+  case 47:
+  case 1047:
+  case 1049:
+    break;
+  case 1048:
+    if ( value ) {
+      fb->ds.save_cursor();
+    } else {
+      fb->ds.restore_cursor();
+    }
+    return true;
+  default:
+    return false;
+  }
+
+  if ( value == fb->is_alternate_screen() ) {
+    return true;
+  }
+
+  if ( value ) {
+    if ( param == 1049 ) {
+      fb->ds.save_cursor();
+    }
+    fb->swap_screens();
+    if ( param == 1049 ) {
+      fb->clear_screen();
+    }
+  } else {
+    if ( param == 1047 ) {
+      fb->clear_screen();
+    }
+    fb->swap_screens();
+    if ( param == 1049 ) {
+      fb->ds.restore_cursor();
+    }
+  }
+
+  return true;
+}
+
 /* set private mode */
 static void CSI_DECSM( Framebuffer *fb, Dispatcher *dispatch )
 {
@@ -293,7 +341,7 @@ static void CSI_DECSM( Framebuffer *fb, Dispatcher *dispatch )
       fb->ds.mouse_reporting_mode = (Terminal::DrawState::MouseReportingMode) param;
     } else if (param == 1005 || param == 1006 || param == 1015) {
       fb->ds.mouse_encoding_mode = (Terminal::DrawState::MouseEncodingMode) param;
-    } else {
+    } else if ( !set_screen_mode( param, true, fb ) ) {
       set_if_available( get_DEC_mode( param, fb ), true );
     }
   }
@@ -308,7 +356,7 @@ static void CSI_DECRM( Framebuffer *fb, Dispatcher *dispatch )
       fb->ds.mouse_reporting_mode = Terminal::DrawState::MOUSE_REPORTING_NONE;
     } else if (param == 1005 || param == 1006 || param == 1015) {
       fb->ds.mouse_encoding_mode = Terminal::DrawState::MOUSE_ENCODING_DEFAULT;
-    } else {
+    } else if ( !set_screen_mode( param, false, fb ) ) {
       set_if_available( get_DEC_mode( param, fb ), false );
     }
   }
@@ -395,6 +443,22 @@ static void CSI_SGR( Framebuffer *fb, Dispatcher *dispatch )
       i += 2;
       continue;
     }
+    /* likewise [34]8 ; 2 ; R ; G ; B for a true color */
+    if ((rendition == 38 || rendition == 48) &&
+	(dispatch->param_count() - i >= 5) &&
+	(dispatch->getparam( i+1, -1 ) == 2)) {
+      const int red = dispatch->getparam( i+2, 0 );
+      const int green = dispatch->getparam( i+3, 0 );
+      const int blue = dispatch->getparam( i+4, 0 );
+      if ( (red | green | blue) <= 255 ) {
+	const int color = Renditions::make_true_color( red, green, blue );
+	(rendition == 38) ?
+	  fb->ds.set_foreground_color( color ) :
+	  fb->ds.set_background_color( color );
+      }
+      i += 4;
+      continue;
+    }
     fb->ds.add_rendition( rendition );
   }
 }
@@ -0,0 +1,281 @@
+/*
+    Mosh: the mobile shell
+    Copyright 2012 Keith Winstein
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    In addition, as a special exception, the copyright holders give
+    permission to link the code of portions of this program with the
+    OpenSSL library under certain conditions as described in each
+    individual source file, and distribute linked combinations including
+    the two.
+
+    You must obey the GNU General Public License in all respects for all
+    of the code used other than OpenSSL. If you modify file(s) with this
+    exception, you may extend this exception to your version of the
+    file(s), but you are not obligated to do so. If you do not wish to do
+    so, delete this exception statement from your version. If you delete
+    this exception statement from all source files in the program, then
+    also delete it here.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+
+#include "terminalscrollback.h"
+#include "terminalframebuffer.h"
+#include "fatal_assert.h"
+
+using namespace Terminal;
+
+Scrollback::Scrollback( size_t s_memory_cap )
+  : memory_cap( s_memory_cap ),
+    blocks(), block_bytes( 0 ),
+    open_unique(), open_lines(), open_lookup( LOOKUP_SIZE, NO_LINE ), open_bytes( 0 ),
+    end_line( 0 ),
+    deflater(),
+    cached_first_line( uint64_t( -1 ) ), cached_lines()
+{
+  memset( &deflater, 0, sizeof( deflater ) );
+  fatal_assert( Z_OK == deflateInit( &deflater, Z_DEFAULT_COMPRESSION ) );
+}
+
+Scrollback::~Scrollback()
+{
+  deflateEnd( &deflater );
+}
+
+/* The text of a row, with the SGR sequences to draw it starting and
+   ending in the default rendition. Blank cells at the end that would
+   be drawn in the default rendition are left out. */
+std::string Scrollback::encode( const Row &row )
+{
+  const Renditions plain( 0 );
+
+  size_t len = row.cells.size();
+  while ( (len > 0)
+	  && row.cells[ len - 1 ].contents.empty()
+	  && (row.cells[ len - 1 ].renditions == plain) ) {
+    len--;
+  }
+
+  std::string line;
+  Renditions current( plain );
+
+  for ( size_t i = 0; i < len; ) {
+    const Cell &cell = row.cells[ i ];
+    i += (cell.width > 0) ? cell.width : 1;
+
+    if ( !(cell.renditions == current) ) {
+      line.append( cell.renditions.sgr() );
+      current = cell.renditions;
+    }
+
+    if ( cell.contents.empty() ) {
+      line.push_back( ' ' );
+      continue;
+    }
+
+    /* cells that begin with combining character get combiner attached to no-break space */
+    if ( cell.fallback ) {
+      line.append( "\xC2\xA0" );
+    }
+
+    for ( std::vector<wchar_t>::const_iterator c = cell.contents.begin();
+	  c != cell.contents.end();
+	  c++ ) {
+      if ( *c < 0x80 ) {
+	line.push_back( char( *c ) );
+      } else {
+	char tmp[ 64 ];
+	snprintf( tmp, 64, "%lc", (wint_t)*c );
+	line.append( tmp );
+      }
+    }
+  }
+
+  if ( !(current == plain) ) {
+    line.append( "\033[0m" );
+  }
+
+  return line;
+}
+
+static uint32_t hash_line( const std::string &line )
+{
+  uint32_t hash = 2166136261u; /* FNV-1a */
+  for ( std::string::const_iterator i = line.begin(); i != line.end(); i++ ) {
+    hash = (hash ^ (unsigned char)*i) * 16777619u;
+  }
+  return hash;
+}
+
+void Scrollback::push( const Row &row )
+{
+  std::string line( encode( row ) );
+
+  /* the table is never more than half full, so probing ends */
+  size_t slot = hash_line( line ) % LOOKUP_SIZE;
+  while ( (open_lookup[ slot ] != NO_LINE)
+	  && (open_unique[ open_lookup[ slot ] ] != line) ) {
+    slot = (slot + 1) % LOOKUP_SIZE;
+  }
+
+  if ( open_lookup[ slot ] == NO_LINE ) {
+    open_lookup[ slot ] = open_unique.size();
+    open_unique.push_back( std::string() );
+    open_unique.back().swap( line );
+    open_bytes += open_unique.back().size();
+  }
+  open_lines.push_back( open_lookup[ slot ] );
+
+  end_line++;
+
+  if ( open_lines.size() == LINES_PER_BLOCK ) {
+    seal();
+    trim();
+  }
+}
+
+static void append_u32( std::string &out, uint32_t x )
+{
+  for ( int i = 0; i < 4; i++ ) {
+    out.push_back( char( x >> (8 * i) ) );
+  }
+}
+
+static uint32_t read_u32( const std::string &in, size_t &pos )
+{
+  fatal_assert( pos + 4 <= in.size() );
+  uint32_t x = 0;
+  for ( int i = 0; i < 4; i++ ) {
+    x |= uint32_t( (unsigned char)in[ pos++ ] ) << (8 * i);
+  }
+  return x;
+}
+
+/* A block is the count of distinct lines, each of them with its
+   length, and then the index of every line in order. */
+void Scrollback::seal( void )
+{
+  std::string raw;
+  append_u32( raw, open_unique.size() );
+  for ( std::vector<std::string>::const_iterator i = open_unique.begin();
+	i != open_unique.end();
+	i++ ) {
+    append_u32( raw, i->size() );
+    raw.append( *i );
+  }
+  for ( std::vector<uint16_t>::const_iterator i = open_lines.begin();
+	i != open_lines.end();
+	i++ ) {
+    raw.push_back( char( *i ) );
+    raw.push_back( char( *i >> 8 ) );
+  }
+
+  std::vector<Bytef> compressed( deflateBound( &deflater, raw.size() ) );
+  fatal_assert( Z_OK == deflateReset( &deflater ) );
+  deflater.next_in = reinterpret_cast<Bytef *>( const_cast<char *>( raw.data() ) );
+  deflater.avail_in = raw.size();
+  deflater.next_out = &compressed[ 0 ];
+  deflater.avail_out = compressed.size();
+  fatal_assert( Z_STREAM_END == deflate( &deflater, Z_FINISH ) );
+
+  blocks.push_back( Block( end_line - open_lines.size(), raw.size(),
+			   std::string( compressed.begin(), compressed.begin() + deflater.total_out ) ) );
+  block_bytes += sizeof( Block ) + blocks.back().data.size();
+
+  open_unique.clear();
+  open_lines.clear();
+  std::fill( open_lookup.begin(), open_lookup.end(), NO_LINE );
+  open_bytes = 0;
+}
+
+void Scrollback::trim( void )
+{
+  while ( (memory_usage() > memory_cap) && (!blocks.empty()) ) {
+    block_bytes -= sizeof( Block ) + blocks.front().data.size();
+    blocks.pop_front();
+  }
+}
+
+void Scrollback::unpack( const Block &block ) const
+{
+  if ( cached_first_line == block.first_line ) {
+    return;
+  }
+
+  std::vector<Bytef> raw( block.raw_size );
+  uLongf raw_len = block.raw_size;
+  fatal_assert( Z_OK == uncompress( &raw[ 0 ], &raw_len,
+				    reinterpret_cast<const Bytef *>( block.data.data() ), block.data.size() ) );
+  fatal_assert( raw_len == block.raw_size );
+  const std::string in( raw.begin(), raw.end() );
+
+  size_t pos = 0;
+  std::vector<std::string> unique( read_u32( in, pos ) );
+  for ( std::vector<std::string>::iterator i = unique.begin();
+	i != unique.end();
+	i++ ) {
+    const uint32_t len = read_u32( in, pos );
+    fatal_assert( pos + len <= in.size() );
+    i->assign( in, pos, len );
+    pos += len;
+  }
+
+  cached_lines.clear();
+  while ( pos + 2 <= in.size() ) {
+    const uint16_t index = (unsigned char)in[ pos ] | ( (unsigned char)in[ pos + 1 ] << 8 );
+    fatal_assert( index < unique.size() );
+    cached_lines.push_back( unique[ index ] );
+    pos += 2;
+  }
+
+  cached_first_line = block.first_line;
+}
+
+uint64_t Scrollback::get_first_line( void ) const
+{
+  return blocks.empty() ? end_line - open_lines.size() : blocks.front().first_line;
+}
+
+std::vector<std::string> Scrollback::get_lines( uint64_t start, uint64_t end ) const
+{
+  start = std::max( start, get_first_line() );
+  end = std::min( end, end_line );
+
+  const uint64_t open_first_line = end_line - open_lines.size();
+
+  std::vector<std::string> ret;
+  for ( uint64_t line = start; line < end; line++ ) {
+    if ( line >= open_first_line ) {
+      ret.push_back( open_unique[ open_lines[ line - open_first_line ] ] );
+    } else {
+      /* every sealed block holds LINES_PER_BLOCK lines */
+      const Block &block = blocks[ (line - blocks.front().first_line) / LINES_PER_BLOCK ];
+      unpack( block );
+      ret.push_back( cached_lines[ line - block.first_line ] );
+    }
+  }
+
+  return ret;
+}
+
+/* Approximate bytes held: the compressed blocks, plus the open
+   block's distinct lines, its line indices and its hash table. */
+size_t Scrollback::memory_usage( void ) const
+{
+  return block_bytes + open_bytes + (open_lines.size() + LOOKUP_SIZE) * sizeof( uint16_t );
+}
@@ -0,0 +1,119 @@
+/*
+    Mosh: the mobile shell
+    Copyright 2012 Keith Winstein
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    In addition, as a special exception, the copyright holders give
+    permission to link the code of portions of this program with the
+    OpenSSL library under certain conditions as described in each
+    individual source file, and distribute linked combinations including
+    the two.
+
+    You must obey the GNU General Public License in all respects for all
+    of the code used other than OpenSSL. If you modify file(s) with this
+    exception, you may extend this exception to your version of the
+    file(s), but you are not obligated to do so. If you do not wish to do
+    so, delete this exception statement from your version. If you delete
+    this exception statement from all source files in the program, then
+    also delete it here.
+*/
+
+#ifndef TERMINALSCROLLBACK_HPP
+#define TERMINALSCROLLBACK_HPP
+
+#include <stdint.h>
+#include <zlib.h>
+#include <deque>
+#include <string>
+#include <vector>
+
+namespace Terminal {
+  class Row;
+
+  /* Lines that have scrolled off the top of the screen, kept on the
+     server for clients that want to look back at them.
+
+     Each line is stored as the text and SGR sequences needed to draw
+     it. Lines collect in an open block, where identical lines are
+     stored once; a full block is serialized and compressed. When the
+     store grows past its memory cap, the oldest blocks are dropped,
+     so it holds at most the cap plus one open block. Lines are
+     numbered from the first one ever pushed. */
+  class Scrollback {
+  private:
+    static const size_t LINES_PER_BLOCK = 256;
+
+    class Block {
+    public:
+      uint64_t first_line;
+      size_t raw_size;
+      std::string data; /* compressed */
+
+      Block( uint64_t s_first_line, size_t s_raw_size, const std::string &s_data )
+	: first_line( s_first_line ), raw_size( s_raw_size ), data( s_data )
+      {}
+    };
+
+    size_t memory_cap;
+
+    std::deque<Block> blocks;
+    size_t block_bytes;
+
+    /* the block being filled, and a hash table of its distinct
+       lines (indices into open_unique, with NO_LINE for empty slots) */
+    static const size_t LOOKUP_SIZE = 2 * LINES_PER_BLOCK;
+    static const uint16_t NO_LINE = 0xffff;
+    std::vector<std::string> open_unique;
+    std::vector<uint16_t> open_lines;
+    std::vector<uint16_t> open_lookup;
+    size_t open_bytes;
+
+    uint64_t end_line; /* number of lines ever pushed */
+
+    /* kept between blocks, since setting one up costs more than
+       compressing a block */
+    z_stream deflater;
+
+    /* the block most recently unpacked by get_lines() */
+    mutable uint64_t cached_first_line;
+    mutable std::vector<std::string> cached_lines;
+
+    void seal( void );
+    void trim( void );
+    void unpack( const Block &block ) const;
+
+  public:
+    Scrollback( size_t s_memory_cap );
+    ~Scrollback();
+
+    void push( const Row &row );
+
+    uint64_t get_first_line( void ) const;
+    uint64_t get_end_line( void ) const { return end_line; }
+
+    /* lines [start, end), clamped to those still stored */
+    std::vector<std::string> get_lines( uint64_t start, uint64_t end ) const;
+
+    size_t memory_usage( void ) const;
+
+    static std::string encode( const Row &row );
+
+    /* unused */
+    Scrollback( const Scrollback & );
+    Scrollback & operator=( const Scrollback & );
+  };
+}
+
+#endif
@@ -36,11 +36,10 @@
 using namespace Terminal;
 using namespace std;
 
-string UserInput::input( const Parser::UserByte *act,
-			 bool application_mode_cursor_keys )
+void UserInput::input( char c,
+			bool application_mode_cursor_keys,
+			string &to_host )
 {
-  act->handled = true;
-
   /* The user will always be in application mode. If stm is not in
      application mode, convert user's cursor control function to an
      ANSI cursor control sequence */
@@ -50,39 +49,36 @@ string UserInput::input( const Parser::UserByte *act,
 
   switch ( state ) {
   case Ground:
-    if ( act->c == 0x1b ) { /* ESC */
+    if ( c == 0x1b ) { /* ESC */
       state = ESC;
     }
-    return string( &act->c, 1 );
-    break;
+    to_host.push_back( c );
+    return;
 
   case ESC:
-    if ( act->c == 'O' ) { /* ESC O = 7-bit SS3 */
+    if ( c == 'O' ) { /* ESC O = 7-bit SS3 */
       state = SS3;
-      return string();
     } else {
       state = Ground;
-      return string( &act->c, 1 );
+      to_host.push_back( c );
     }
-    break;
+    return;
 
   case SS3:
     state = Ground;
     if ( (!application_mode_cursor_keys)
-	 && (act->c >= 'A')
-	 && (act->c <= 'D') ) {
-      char translated_cursor[ 2 ] = { '[', act->c };
-      return string( translated_cursor, 2 );
+	 && (c >= 'A')
+	 && (c <= 'D') ) {
+      to_host.push_back( '[' ); /* translated cursor */
     } else {
-      char original_cursor[ 2 ] = { 'O', act->c };
-      return string( original_cursor, 2 );
+      to_host.push_back( 'O' ); /* original cursor */
     }
-    break;
+    to_host.push_back( c );
+    return;
   }
 
   /* This doesn't handle the 8-bit SS3 C1 control, which would be
      two octets in UTF-8. Fortunately nobody seems to send this. */
 
   assert( false );
-  return string();
 }
@@ -53,8 +53,10 @@ namespace Terminal {
       : state( Ground )
     {}
 
-    std::string input( const Parser::UserByte *act,
-		       bool application_mode_cursor_keys );
+    /* translate one keystroke, appending the result to to_host */
+    void input( char c,
+		bool application_mode_cursor_keys,
+		std::string &to_host );
 
     bool operator==( const UserInput &x ) const { return state == x.state; }
   };
@@ -0,0 +1,241 @@
+/*
+    Mosh: the mobile shell
+    Copyright 2012 Keith Winstein
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    In addition, as a special exception, the copyright holders give
+    permission to link the code of portions of this program with the
+    OpenSSL library under certain conditions as described in each
+    individual source file, and distribute linked combinations including
+    the two.
+
+    You must obey the GNU General Public License in all respects for all
+    of the code used other than OpenSSL. If you modify file(s) with this
+    exception, you may extend this exception to your version of the
+    file(s), but you are not obligated to do so. If you do not wish to do
+    so, delete this exception statement from your version. If you delete
+    this exception statement from all source files in the program, then
+    also delete it here.
+*/
+
+
+/* The alternate screen modes 47, 1047, 1048 and 1049: which screen
+   is shown, which one is cleared, where the cursor ends up, and that
+   a client following the server through diffs sees the same two
+   screens at every step. */
+
+#include <stdio.h>
+#include <string>
+
+#include "completeterminal.h"
+#include "fatal_assert.h"
+#include "locale_utils.h"
+
+using namespace Terminal;
+
+/* the text of a row of the visible screen, without trailing blanks */
+static std::string row_text( const Framebuffer &fb, int row )
+{
+  std::string text;
+  for ( int col = 0; col < fb.ds.get_width(); col++ ) {
+    const Cell *cell = fb.get_cell( row, col );
+    if ( cell->contents.empty() ) {
+      text.push_back( ' ' );
+    } else {
+      for ( size_t i = 0; i < cell->contents.size(); i++ ) {
+	text.push_back( char( cell->contents[ i ] ) );
+      }
+    }
+  }
+  return text.substr( 0, text.find_last_not_of( ' ' ) + 1 );
+}
+
+static bool screen_is_blank( const Framebuffer &fb )
+{
+  for ( int row = 0; row < fb.ds.get_height(); row++ ) {
+    if ( !row_text( fb, row ).empty() ) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static void check_cursor( const Framebuffer &fb, int row, int col )
+{
+  fatal_assert( fb.ds.get_cursor_row() == row );
+  fatal_assert( fb.ds.get_cursor_col() == col );
+}
+
+/* A server terminal and a client that gets every change to it as a
+   diff, the way the transport sends them. */
+class Session {
+public:
+  Complete server, client;
+
+  Session( int width, int height ) : server( width, height ), client( width, height ) {}
+
+  const Framebuffer &fb( void ) const { return server.get_fb(); }
+
+  void act( const std::string &str )
+  {
+    server.act( str );
+    client.apply_string( server.diff_from( client ) );
+    fatal_assert( client.get_fb() == server.get_fb() );
+    check_cursor( client.get_fb(), fb().ds.get_cursor_row(), fb().ds.get_cursor_col() );
+  }
+};
+
+/* fill the normal screen and leave the cursor in the middle of it */
+static void draw_shell( Session &s )
+{
+  s.act( "shell 1\r\nshell 2\r\nshell 3\r\n$ ls" );
+  s.act( "\033[3;5H" );
+  check_cursor( s.fb(), 2, 4 );
+}
+
+static void draw_program( Session &s, const char *text )
+{
+  s.act( "\033[H" );
+  s.act( text );
+  s.act( "\033[10;20H" );
+}
+
+static void check_shell( const Session &s )
+{
+  fatal_assert( !s.fb().is_alternate_screen() );
+  fatal_assert( row_text( s.fb(), 0 ) == "shell 1" );
+  fatal_assert( row_text( s.fb(), 2 ) == "shell 3" );
+  fatal_assert( row_text( s.fb(), 3 ) == "$ ls" );
+}
+
+/* 47 swaps screens and nothing else: the alternate screen keeps its
+   text between visits and the cursor stays where it was left */
+static void test_mode_47( void )
+{
+  Session s( 80, 24 );
+  draw_shell( s );
+
+  s.act( "\033[?47h" );
+  fatal_assert( s.fb().is_alternate_screen() );
+  fatal_assert( screen_is_blank( s.fb() ) );
+  check_cursor( s.fb(), 2, 4 );
+  draw_program( s, "editor" );
+
+  s.act( "\033[?47l" );
+  check_shell( s );
+  check_cursor( s.fb(), 9, 19 );
+
+  s.act( "\033[?47h" );
+  fatal_assert( row_text( s.fb(), 0 ) == "editor" );
+  s.act( "\033[?47l" );
+  check_shell( s );
+}
+
+/* 1047 clears the alternate screen on the way out */
+static void test_mode_1047( void )
+{
+  Session s( 80, 24 );
+  draw_shell( s );
+
+  s.act( "\033[?1047h" );
+  fatal_assert( s.fb().is_alternate_screen() );
+  draw_program( s, "editor" );
+
+  s.act( "\033[?1047l" );
+  check_shell( s );
+  check_cursor( s.fb(), 9, 19 );
+
+  s.act( "\033[?1047h" );
+  fatal_assert( screen_is_blank( s.fb() ) );
+  s.act( "\033[?1047l" );
+  check_shell( s );
+}
+
+/* 1048 saves and restores the cursor without switching screens */
+static void test_mode_1048( void )
+{
+  Session s( 80, 24 );
+  draw_shell( s );
+
+  s.act( "\033[?1048h" );
+  fatal_assert( !s.fb().is_alternate_screen() );
+  s.act( "\033[20;30H" );
+  s.act( "\033[?1048l" );
+  fatal_assert( !s.fb().is_alternate_screen() );
+  check_cursor( s.fb(), 2, 4 );
+  check_shell( s );
+}
+
+/* 1049 saves the cursor, switches and clears on the way in, and
+   restores the cursor on the way out */
+static void test_mode_1049( void )
+{
+  Session s( 80, 24 );
+  draw_shell( s );
+
+  s.act( "\033[?1047h" );
+  draw_program( s, "stale" );
+  s.act( "\033[?47l" );
+  check_shell( s );
+  s.act( "\033[3;5H" );
+
+  s.act( "\033[?1049h" );
+  fatal_assert( s.fb().is_alternate_screen() );
+  fatal_assert( screen_is_blank( s.fb() ) );
+  draw_program( s, "editor" );
+
+  /* repeating the mode changes nothing */
+  s.act( "\033[?1049h" );
+  fatal_assert( row_text( s.fb(), 0 ) == "editor" );
+  check_cursor( s.fb(), 9, 19 );
+
+  s.act( "\033[?1049l" );
+  check_shell( s );
+  check_cursor( s.fb(), 2, 4 );
+
+  s.act( "\033[?1049l" );
+  check_shell( s );
+  check_cursor( s.fb(), 2, 4 );
+}
+
+/* a client that missed both switches catches up from one diff */
+static void test_missed_round_trip( void )
+{
+  Complete server( 80, 24 ), client( 80, 24 );
+  server.act( "shell 1\r\nshell 2\r\n" );
+  client.apply_string( server.diff_from( client ) );
+
+  server.act( "\033[?1049heditor\033[?1049l$ " );
+  client.apply_string( server.diff_from( client ) );
+  fatal_assert( client.get_fb() == server.get_fb() );
+
+  server.act( "\033[?1049heditor" );
+  client.apply_string( server.diff_from( client ) );
+  fatal_assert( client.get_fb() == server.get_fb() );
+  fatal_assert( client.get_fb().is_alternate_screen() );
+}
+
+int main( void )
+{
+  set_native_locale();
+
+  test_mode_47();
+  test_mode_1047();
+  test_mode_1048();
+  test_mode_1049();
+  test_missed_round_trip();
+
+  return 0;
+}
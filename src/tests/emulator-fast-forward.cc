@@ -0,0 +1,206 @@
+/*
+    Mosh: the mobile shell
+    Copyright 2012 Keith Winstein
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    In addition, as a special exception, the copyright holders give
+    permission to link the code of portions of this program with the
+    OpenSSL library under certain conditions as described in each
+    individual source file, and distribute linked combinations including
+    the two.
+
+    You must obey the GNU General Public License in all respects for all
+    of the code used other than OpenSSL. If you modify file(s) with this
+    exception, you may extend this exception to your version of the
+    file(s), but you are not obligated to do so. If you do not wish to do
+    so, delete this exception statement from your version. If you delete
+    this exception statement from all source files in the program, then
+    also delete it here.
+*/
+
+/* Differential test for the emulator's fast-forward mode: feeds the
+   same host output to one Complete with fast-forward on and one with
+   it off, and checks that the two always end up with the same
+   terminal. The output is either generated from a seeded random
+   mix of plain lines, escape sequences and UTF-8, or read from the
+   trace files named on the command line, and is cut into random
+   chunks as a pty read would. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <fstream>
+#include <sstream>
+
+#include "completeterminal.h"
+#include "fatal_assert.h"
+#include "locale_utils.h"
+
+using namespace Terminal;
+
+const unsigned int NUM_SEEDS = 200;
+
+bool verbose = false;
+
+/* small deterministic generator so that failures can be replayed */
+class Random {
+private:
+  uint64_t state;
+
+public:
+  Random( uint64_t s_seed ) : state( s_seed * 2654435761u + 1 ) {}
+
+  unsigned int next( unsigned int bound )
+  {
+    state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+    return (unsigned int)( state >> 33 ) % bound;
+  }
+};
+
+static std::string plain_line( Random &rnd, int width )
+{
+  static const char *endings[] = { "\r\n", "\r\n", "\r\n", "\n", "\r", "" };
+
+  std::string line;
+  const int len = rnd.next( 2 * width + 2 );
+  for ( int i = 0; i < len; i++ ) {
+    line.push_back( 0x20 + rnd.next( 0x5f ) );
+  }
+  return line + endings[ rnd.next( sizeof( endings ) / sizeof( endings[ 0 ] ) ) ];
+}
+
+static std::string escape( Random &rnd, int height )
+{
+  static const char *fixed[] = {
+    "\033[31m", "\033[44m", "\033[0m", "\033[7m",  /* renditions */
+    "\033[H", "\033[2J", "\033[K", "\033[5A",      /* cursor and erase */
+    "\033[4h", "\033[4l", "\033[?7l", "\033[?7h",  /* insert, autowrap */
+    "\033[r", "\0337", "\0338", "\033]0;title\007",
+    "\t", "\007", "\010", "\033[3@",
+    "\xc3\xa9", "\xcc\x81", "\xe4\xb8\xad",         /* UTF-8, combining, wide */
+    "\xe4\xb8",                                     /* truncated sequence */
+  };
+
+  if ( rnd.next( 4 ) == 0 ) {
+    char region[ 32 ];
+    const int top = 1 + rnd.next( height );
+    snprintf( region, sizeof( region ), "\033[%d;%dr", top, top + rnd.next( height ) );
+    return region;
+  }
+
+  return fixed[ rnd.next( sizeof( fixed ) / sizeof( fixed[ 0 ] ) ) ];
+}
+
+static std::string random_trace( Random &rnd, int width, int height )
+{
+  std::string trace;
+  const int pieces = 50 + rnd.next( 200 );
+  for ( int i = 0; i < pieces; i++ ) {
+    switch ( rnd.next( 3 ) ) {
+    case 0: /* a burst of output, long enough to scroll */
+      for ( int lines = rnd.next( 4 * height + 4 ); lines > 0; lines-- ) {
+	trace += plain_line( rnd, width );
+      }
+      break;
+    case 1:
+      trace += plain_line( rnd, width );
+      break;
+    default:
+      trace += escape( rnd, height );
+      break;
+    }
+  }
+  return trace;
+}
+
+static void check_same( const Complete &slow, const Complete &fast, const std::string &name )
+{
+  const DrawState &s = slow.get_fb().ds, &f = fast.get_fb().ds;
+
+  if ( (slow == fast)
+       && (s.get_combining_char_col() == f.get_combining_char_col())
+       && (s.get_combining_char_row() == f.get_combining_char_row())
+       && (s.next_print_will_wrap == f.next_print_will_wrap) ) {
+    return;
+  }
+
+  fprintf( stderr, "%s: fast-forward changed the terminal (cursor %d,%d vs. %d,%d)\n",
+	   name.c_str(), s.get_cursor_row(), s.get_cursor_col(),
+	   f.get_cursor_row(), f.get_cursor_col() );
+  fatal_assert( false );
+}
+
+static void run_trace( const std::string &trace, int width, int height,
+		       Random &rnd, const std::string &name )
+{
+  Complete slow( width, height ), fast( width, height );
+  fast.set_fast_forward( true );
+
+  size_t pos = 0;
+  while ( pos < trace.size() ) {
+    const size_t chunk = 1 + rnd.next( rnd.next( 2 ) ? 64 : 16384 );
+    const std::string piece( trace.substr( pos, chunk ) );
+    pos += piece.size();
+
+    fatal_assert( slow.act( piece ) == fast.act( piece ) );
+    check_same( slow, fast, name );
+  }
+
+  if ( verbose ) {
+    printf( "%s: %dx%d, %lu bytes\n", name.c_str(), width, height,
+	    (unsigned long)trace.size() );
+  }
+}
+
+int main( int argc, char *argv[] )
+{
+  int arg = 1;
+  if ( argc >= 2 && strcmp( argv[ 1 ], "-v" ) == 0 ) {
+    verbose = true;
+    arg++;
+  }
+
+  set_native_locale();
+
+  if ( arg < argc ) {
+    /* replay recorded traces at a few common sizes */
+    static const int sizes[][ 2 ] = { { 80, 24 }, { 132, 43 }, { 300, 100 } };
+    for ( ; arg < argc; arg++ ) {
+      std::ifstream file( argv[ arg ], std::ios::in | std::ios::binary );
+      fatal_assert( file.good() );
+      std::stringstream contents;
+      contents << file.rdbuf();
+
+      Random rnd( arg );
+      for ( size_t i = 0; i < sizeof( sizes ) / sizeof( sizes[ 0 ] ); i++ ) {
+	run_trace( contents.str(), sizes[ i ][ 0 ], sizes[ i ][ 1 ], rnd, argv[ arg ] );
+      }
+    }
+    return 0;
+  }
+
+  for ( unsigned int seed = 1; seed <= NUM_SEEDS; seed++ ) {
+    Random rnd( seed );
+    const int width = 1 + rnd.next( 100 );
+    const int height = 1 + rnd.next( 40 );
+
+    char name[ 32 ];
+    snprintf( name, sizeof( name ), "seed %u", seed );
+    run_trace( random_trace( rnd, width, height ), width, height, rnd, name );
+  }
+
+  return 0;
+}
@@ -0,0 +1,255 @@
+/*
+    Mosh: the mobile shell
+    Copyright 2012 Keith Winstein
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    In addition, as a special exception, the copyright holders give
+    permission to link the code of portions of this program with the
+    OpenSSL library under certain conditions as described in each
+    individual source file, and distribute linked combinations including
+    the two.
+
+    You must obey the GNU General Public License in all respects for all
+    of the code used other than OpenSSL. If you modify file(s) with this
+    exception, you may extend this exception to your version of the
+    file(s), but you are not obligated to do so. If you do not wish to do
+    so, delete this exception statement from your version. If you delete
+    this exception statement from all source files in the program, then
+    also delete it here.
+*/
+
+/* Reflow on resize: wrapped lines are rewrapped, the cursor and the
+   cursor saved for the hidden normal screen stay on their characters,
+   and a client that follows the server through diffs, reflowing on
+   its own, ends up with the same screens. */
+
+#include <stdio.h>
+#include <string>
+
+#include "completeterminal.h"
+#include "parseraction.h"
+#include "fatal_assert.h"
+#include "locale_utils.h"
+
+using namespace Terminal;
+
+/* the text of a row of the visible screen, without trailing blanks */
+static std::string row_text( const Framebuffer &fb, int row )
+{
+  std::string text;
+  for ( int col = 0; col < fb.ds.get_width(); col++ ) {
+    const Cell *cell = fb.get_cell( row, col );
+    if ( cell->contents.empty() ) {
+      text.push_back( ' ' );
+    } else {
+      for ( size_t i = 0; i < cell->contents.size(); i++ ) {
+	text.push_back( char( cell->contents[ i ] ) );
+      }
+    }
+  }
+  return text.substr( 0, text.find_last_not_of( ' ' ) + 1 );
+}
+
+static void check_rows( const Framebuffer &fb, const char *const *expected )
+{
+  int row = 0;
+  for ( ; expected[ row ]; row++ ) {
+    fatal_assert( row_text( fb, row ) == expected[ row ] );
+  }
+  for ( ; row < fb.ds.get_height(); row++ ) {
+    fatal_assert( row_text( fb, row ).empty() );
+  }
+}
+
+static void check_cursor( const Framebuffer &fb, int row, int col )
+{
+  fatal_assert( fb.ds.get_cursor_row() == row );
+  fatal_assert( fb.ds.get_cursor_col() == col );
+}
+
+/* the same text, renditions and wrap flags, however blanks are held */
+static void check_same_cells( const Framebuffer &a, const Framebuffer &b )
+{
+  fatal_assert( a.ds.get_width() == b.ds.get_width() );
+  fatal_assert( a.ds.get_height() == b.ds.get_height() );
+  for ( int row = 0; row < a.ds.get_height(); row++ ) {
+    for ( int col = 0; col < a.ds.get_width(); col++ ) {
+      fatal_assert( !a.get_cell( row, col )->compare( *b.get_cell( row, col ) ) );
+    }
+  }
+}
+
+static void check_same_screens( const Framebuffer &a, const Framebuffer &b )
+{
+  fatal_assert( a.is_alternate_screen() == b.is_alternate_screen() );
+  check_same_cells( a, b );
+  check_cursor( b, a.ds.get_cursor_row(), a.ds.get_cursor_col() );
+
+  Framebuffer hidden_a( a ), hidden_b( b );
+  hidden_a.swap_screens();
+  hidden_b.swap_screens();
+  check_same_cells( hidden_a, hidden_b );
+}
+
+static void resize( Complete &terminal, int width, int height )
+{
+  Parser::Resize resize( width, height );
+  terminal.act( &resize );
+}
+
+static void check_size( const Complete &terminal, int width, int height )
+{
+  const Framebuffer &fb = terminal.get_fb();
+  fatal_assert( fb.ds.get_width() == width );
+  fatal_assert( fb.ds.get_height() == height );
+  fatal_assert( fb.ds.get_cursor_row() < height );
+  fatal_assert( fb.ds.get_cursor_col() < width );
+}
+
+/* a blank normal screen, hidden behind the alternate screen, has no
+   rows left once its blank rows are trimmed */
+static void test_hidden_blank_screen( void )
+{
+  Complete terminal( 80, 24 );
+  terminal.act( "\033[?1049h" );
+
+  resize( terminal, 100, 30 );
+  check_size( terminal, 100, 30 );
+
+  terminal.act( "\033[?1049l" );
+  check_size( terminal, 100, 30 );
+}
+
+/* a wrapped line is joined and split again at each new width, and
+   the cursor stays after the prompt */
+static void test_rewrap( void )
+{
+  Complete terminal( 10, 6 );
+  terminal.act( "abcdefghijklmnopqrstuvwxy\r\n$ " );
+  static const char *const at_10[] = { "abcdefghij", "klmnopqrst", "uvwxy", "$", NULL };
+  check_rows( terminal.get_fb(), at_10 );
+  check_cursor( terminal.get_fb(), 3, 2 );
+
+  resize( terminal, 20, 6 );
+  static const char *const at_20[] = { "abcdefghijklmnopqrst", "uvwxy", "$", NULL };
+  check_rows( terminal.get_fb(), at_20 );
+  check_cursor( terminal.get_fb(), 2, 2 );
+
+  resize( terminal, 7, 6 );
+  static const char *const at_7[] = { "abcdefg", "hijklmn", "opqrstu", "vwxy", "$", NULL };
+  check_rows( terminal.get_fb(), at_7 );
+  check_cursor( terminal.get_fb(), 4, 2 );
+
+  resize( terminal, 10, 6 );
+  check_rows( terminal.get_fb(), at_10 );
+  check_cursor( terminal.get_fb(), 3, 2 );
+
+  /* going on typing continues the last line */
+  terminal.act( "ls" );
+  fatal_assert( row_text( terminal.get_fb(), 3 ) == "$ ls" );
+}
+
+/* a cursor inside a wrapped line stays on its character */
+static void test_cursor_in_wrapped_line( void )
+{
+  Complete terminal( 10, 8 );
+  terminal.act( "abcdefghijklmnopqrstuvwxy\033[2;3H" );
+  check_cursor( terminal.get_fb(), 1, 2 ); /* on the m */
+
+  resize( terminal, 20, 8 );
+  check_cursor( terminal.get_fb(), 0, 12 );
+
+  resize( terminal, 4, 8 );
+  check_cursor( terminal.get_fb(), 3, 0 );
+
+  /* too short for the text above the cursor: those rows scroll off */
+  resize( terminal, 4, 2 );
+  check_cursor( terminal.get_fb(), 0, 0 );
+  fatal_assert( row_text( terminal.get_fb(), 0 ) == "mnop" );
+}
+
+/* the cursor that 1049 saved follows its character on the hidden
+   normal screen, and is where the shell's prompt ends on return */
+static void test_saved_cursor_reflow( void )
+{
+  Complete terminal( 10, 6 );
+  terminal.act( "abcdefghijklmnopqrstuvwxy\r\n$ " );
+  terminal.act( "\033[?1049heditor\033[5;5H" );
+
+  resize( terminal, 20, 6 );
+  terminal.act( "\033[?1049l" );
+  static const char *const at_20[] = { "abcdefghijklmnopqrst", "uvwxy", "$", NULL };
+  check_rows( terminal.get_fb(), at_20 );
+  check_cursor( terminal.get_fb(), 2, 2 );
+
+  terminal.act( "\033[?1049h" );
+  resize( terminal, 7, 3 );
+  terminal.act( "\033[?1049l" );
+  static const char *const at_7[] = { "opqrstu", "vwxy", "$", NULL };
+  check_rows( terminal.get_fb(), at_7 );
+  check_cursor( terminal.get_fb(), 2, 2 );
+}
+
+/* small deterministic generator so that failures can be replayed */
+static unsigned int next_random( uint64_t &state, unsigned int bound )
+{
+  state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+  return (unsigned int)( state >> 33 ) % bound;
+}
+
+/* A client following a server through diffs must end up with the
+   same screens after every resize, growing and shrinking, with
+   wrapped lines on either screen. */
+static void test_client_agrees( void )
+{
+  static const char *const pieces[] = {
+    "\r\n", "\r\n", "$ ", "\033[31m", "\033[0m", "\033[7m",
+    "\xe4\xb8\xad", "\033[?1049h", "\033[?1049l", "\033[H", "\033[3;7H",
+  };
+
+  for ( uint64_t seed = 1; seed <= 50; seed++ ) {
+    uint64_t state = seed;
+    Complete server( 80, 24 ), client( 80, 24 );
+
+    for ( int step = 0; step < 40; step++ ) {
+      std::string output;
+      for ( int i = next_random( state, 6 ); i > 0; i-- ) {
+	const int len = next_random( state, 200 );
+	for ( int j = 0; j < len; j++ ) {
+	  output.push_back( 'a' + next_random( state, 26 ) );
+	}
+	output += pieces[ next_random( state, sizeof( pieces ) / sizeof( pieces[ 0 ] ) ) ];
+      }
+      server.act( output );
+      resize( server, 1 + next_random( state, 120 ), 1 + next_random( state, 40 ) );
+
+      client.apply_string( server.diff_from( client ) );
+      check_same_screens( server.get_fb(), client.get_fb() );
+    }
+  }
+}
+
+int main( void )
+{
+  set_native_locale();
+
+  test_hidden_blank_screen();
+  test_rewrap();
+  test_cursor_in_wrapped_line();
+  test_saved_cursor_reflow();
+  test_client_agrees();
+
+  return 0;
+}
@@ -0,0 +1,162 @@
+/*
+    Mosh: the mobile shell
+    Copyright 2012 Keith Winstein
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    In addition, as a special exception, the copyright holders give
+    permission to link the code of portions of this program with the
+    OpenSSL library under certain conditions as described in each
+    individual source file, and distribute linked combinations including
+    the two.
+
+    You must obey the GNU General Public License in all respects for all
+    of the code used other than OpenSSL. If you modify file(s) with this
+    exception, you may extend this exception to your version of the
+    file(s), but you are not obligated to do so. If you do not wish to do
+    so, delete this exception statement from your version. If you delete
+    this exception statement from all source files in the program, then
+    also delete it here.
+*/
+
+
+/* Reassembly of fragmented instructions. The sender paces a large
+   instruction out over time and may send a single-fragment ack in
+   the middle of it; the receiver must deliver the ack at once and
+   still complete the instruction it was assembling. A new instruction
+   in several fragments still replaces an unfinished one. */
+
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+#include "network.h"
+#include "transportfragment.h"
+#include "fatal_assert.h"
+
+using namespace Network;
+
+static const int MTU = 500;
+
+static Instruction make_instruction( uint64_t new_num, uint64_t ack_num, size_t diff_len )
+{
+  Instruction inst;
+  inst.set_protocol_version( MOSH_PROTOCOL_VERSION );
+  inst.set_old_num( 0 );
+  inst.set_new_num( new_num );
+  inst.set_ack_num( ack_num );
+  inst.set_throwaway_num( 0 );
+
+  /* incompressible, so that it really needs several fragments */
+  std::string diff;
+  uint32_t x = new_num + 1;
+  for ( size_t i = 0; i < diff_len; i++ ) {
+    x = x * 1103515245 + 12345;
+    diff.push_back( char( x >> 24 ) );
+  }
+  inst.set_diff( diff );
+  return inst;
+}
+
+/* through the wire format, as the receiver sees it */
+static bool receive( FragmentAssembly &assembly, Fragment &frag )
+{
+  std::string wire = frag.tostring();
+  Fragment received( wire );
+  return assembly.add_fragment( received );
+}
+
+static void check_same( const Instruction &a, const Instruction &b )
+{
+  fatal_assert( a.new_num() == b.new_num() );
+  fatal_assert( a.ack_num() == b.ack_num() );
+  fatal_assert( a.diff() == b.diff() );
+}
+
+/* an ack in one fragment, sent while a frame is paced out */
+static void test_ack_mid_frame( void )
+{
+  Fragmenter fragmenter;
+  FragmentAssembly assembly;
+
+  const Instruction frame = make_instruction( 1, 0, 4 * MTU );
+  std::vector<Fragment> frame_fragments = fragmenter.make_fragments( frame, MTU );
+  fatal_assert( frame_fragments.size() > 2 );
+
+  const Instruction ack = make_instruction( 0, 7, 0 );
+  std::vector<Fragment> ack_fragments = fragmenter.make_fragments( ack, MTU );
+  fatal_assert( ack_fragments.size() == 1 );
+  fatal_assert( ack_fragments[ 0 ].id != frame_fragments[ 0 ].id );
+
+  fatal_assert( !receive( assembly, frame_fragments[ 0 ] ) );
+  fatal_assert( !receive( assembly, frame_fragments[ 1 ] ) );
+
+  fatal_assert( receive( assembly, ack_fragments[ 0 ] ) );
+  check_same( assembly.get_assembly(), ack );
+
+  for ( size_t i = 2; i < frame_fragments.size(); i++ ) {
+    const bool complete = receive( assembly, frame_fragments[ i ] );
+    fatal_assert( complete == (i == frame_fragments.size() - 1) );
+  }
+  check_same( assembly.get_assembly(), frame );
+}
+
+/* an instruction in one fragment with nothing in progress */
+static void test_single_alone( void )
+{
+  Fragmenter fragmenter;
+  FragmentAssembly assembly;
+
+  for ( uint64_t n = 1; n <= 3; n++ ) {
+    const Instruction inst = make_instruction( n, n, 10 );
+    std::vector<Fragment> fragments = fragmenter.make_fragments( inst, MTU );
+    fatal_assert( fragments.size() == 1 );
+    fatal_assert( receive( assembly, fragments[ 0 ] ) );
+    check_same( assembly.get_assembly(), inst );
+  }
+}
+
+/* a newer frame in several fragments supersedes an unfinished one,
+   and the stale fragments that follow do not complete anything */
+static void test_new_frame_replaces( void )
+{
+  Fragmenter fragmenter;
+  FragmentAssembly assembly;
+
+  const Instruction old_frame = make_instruction( 1, 0, 4 * MTU );
+  std::vector<Fragment> old_fragments = fragmenter.make_fragments( old_frame, MTU );
+  const Instruction new_frame = make_instruction( 2, 0, 3 * MTU );
+  std::vector<Fragment> new_fragments = fragmenter.make_fragments( new_frame, MTU );
+  fatal_assert( new_fragments.size() > 1 );
+
+  fatal_assert( !receive( assembly, old_fragments[ 0 ] ) );
+  for ( size_t i = 0; i < new_fragments.size(); i++ ) {
+    const bool complete = receive( assembly, new_fragments[ i ] );
+    fatal_assert( complete == (i == new_fragments.size() - 1) );
+  }
+  check_same( assembly.get_assembly(), new_frame );
+
+  for ( size_t i = 1; i < old_fragments.size(); i++ ) {
+    fatal_assert( !receive( assembly, old_fragments[ i ] ) );
+  }
+}
+
+int main( void )
+{
+  test_ack_mid_frame();
+  test_single_alone();
+  test_new_frame_replaces();
+
+  return 0;
+}
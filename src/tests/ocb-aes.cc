@@ -55,6 +55,9 @@ using Crypto::AlignedBuffer;
 
 bool verbose = false;
 
+/* AES implementation the contexts below must be using. */
+static int expected_impl = AE_IMPL_GENERIC;
+
 static bool equal( const AlignedBuffer &a, const AlignedBuffer &b ) {
   return ( a.len() == b.len() )
     && !memcmp( a.data(), b.data(), a.len() );
@@ -64,6 +67,7 @@ static AlignedBuffer *get_ctx( const AlignedBuffer &key ) {
   AlignedBuffer *ctx_buf = new AlignedBuffer( ae_ctx_sizeof() );
   fatal_assert( ctx_buf );
   fatal_assert( AE_SUCCESS == ae_init( (ae_ctx *)ctx_buf->data(), key.data(), key.len(), NONCE_LEN, TAG_LEN ) );
+  fatal_assert( expected_impl == ae_get_impl( (ae_ctx *)ctx_buf->data() ) );
   return ctx_buf;
 }
 
@@ -538,14 +542,100 @@ static void test_iterative( void ) {
   }
 }
 
+/* ae_encrypt_batch() must produce exactly what ae_encrypt() does for each
+   message, whatever the mix of lengths, alignments and in-place items. */
+
+static void test_batch( void ) {
+  PRNG prng;
+  const int count = 41;
+  const size_t max_len = 300;
+
+  AlignedBuffer key( KEY_LEN );
+  prng.fill( key.data(), KEY_LEN );
+  AlignedBuffer *ctx_buf = get_ctx( key );
+  ae_ctx *ctx = (ae_ctx *)ctx_buf->data();
+
+  /* Room for each message and its tag, with an odd gap before each. */
+  const size_t stride = max_len + TAG_LEN + 16;
+  AlignedBuffer nonces( count * NONCE_LEN );
+  AlignedBuffer plaintexts( count * stride );
+  AlignedBuffer batch_out( count * stride );
+  AlignedBuffer single_out( max_len + TAG_LEN );
+  AlignedBuffer single_pt( max_len );
+  AlignedBuffer single_nonce( NONCE_LEN );
+  prng.fill( nonces.data(), nonces.len() );
+  prng.fill( plaintexts.data(), plaintexts.len() );
+  for ( int i = 1; i < count; i += 3 ) { /* some share the Top of the one before */
+    char *nonce = nonces.data() + i * NONCE_LEN;
+    memcpy( nonce, nonce - NONCE_LEN, NONCE_LEN );
+    nonce[ NONCE_LEN - 1 ] ^= 1 + i % 63;
+  }
+
+  ae_batch_item items[ count ];
+  for ( int i = 0; i < count; i++ ) {
+    size_t len = ( i < 34 ) ? i : prng.uint32() % max_len; /* every tail length */
+    size_t skew = i % 7;
+    items[ i ].nonce = nonces.data() + i * NONCE_LEN;
+    items[ i ].pt = plaintexts.data() + i * stride + skew;
+    items[ i ].pt_len = len;
+    if ( i % 3 == 0 ) { /* in place */
+      memcpy( batch_out.data() + i * stride + skew, items[ i ].pt, len );
+      items[ i ].pt = batch_out.data() + i * stride + skew;
+    }
+    items[ i ].ct = batch_out.data() + i * stride + skew;
+  }
+
+  /* Expected results, computed before in-place items get overwritten. */
+  AlignedBuffer expected( count * ( max_len + TAG_LEN ) );
+  for ( int i = 0; i < count; i++ ) {
+    memcpy( single_pt.data(), items[ i ].pt, items[ i ].pt_len );
+    memcpy( single_nonce.data(), items[ i ].nonce, NONCE_LEN );
+    fatal_assert( items[ i ].pt_len + TAG_LEN == ae_encrypt( ctx, single_nonce.data(),
+                                                            single_pt.data(), items[ i ].pt_len,
+                                                            NULL, 0,
+                                                            single_out.data(), NULL,
+                                                            AE_FINALIZE ) );
+    memcpy( expected.data() + i * ( max_len + TAG_LEN ), single_out.data(), items[ i ].pt_len + TAG_LEN );
+  }
+
+  fatal_assert( AE_SUCCESS == ae_encrypt_batch( ctx, items, count ) );
+
+  for ( int i = 0; i < count; i++ ) {
+    fatal_assert( !memcmp( items[ i ].ct, expected.data() + i * ( max_len + TAG_LEN ),
+                           items[ i ].pt_len + TAG_LEN ) );
+  }
+
+  scrap_ctx( ctx_buf );
+
+  if ( verbose ) {
+    printf( "batch PASSED\n\n" );
+  }
+}
+
 int main( int argc, char *argv[] )
 {
   if ( argc >= 2 && strcmp( argv[ 1 ], "-v" ) == 0 ) {
     verbose = true;
   }
 
-  test_all_vectors();
-  test_iterative();
+  /* Every AES implementation compiled in must agree with the vectors. */
+  const int impls[] = { AE_IMPL_GENERIC, AE_IMPL_AES_NI };
+  for ( size_t i = 0; i < sizeof( impls ) / sizeof( impls[ 0 ] ); i++ ) {
+    if ( AE_SUCCESS != ae_set_impl( impls[ i ] ) ) {
+      if ( verbose ) {
+        printf( "AES implementation %d not available, skipped\n\n", impls[ i ] );
+      }
+      continue;
+    }
+    if ( verbose ) {
+      printf( "testing AES implementation %d\n\n", impls[ i ] );
+    }
+    expected_impl = impls[ i ];
+
+    test_all_vectors();
+    test_iterative();
+    test_batch();
+  }
 
   return 0;
 }
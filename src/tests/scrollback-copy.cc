@@ -0,0 +1,87 @@
+/*
+    Mosh: the mobile shell
+    Copyright 2012 Keith Winstein
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    In addition, as a special exception, the copyright holders give
+    permission to link the code of portions of this program with the
+    OpenSSL library under certain conditions as described in each
+    individual source file, and distribute linked combinations including
+    the two.
+
+    You must obey the GNU General Public License in all respects for all
+    of the code used other than OpenSSL. If you modify file(s) with this
+    exception, you may extend this exception to your version of the
+    file(s), but you are not obligated to do so. If you do not wish to do
+    so, delete this exception statement from your version. If you delete
+    this exception statement from all source files in the program, then
+    also delete it here.
+*/
+
+/* Copies of a terminal share its scrollback. Applying a diff to a
+   copy, as the transport's verbose round-trip check does, must leave
+   the history of the original alone. */
+
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+#include "completeterminal.h"
+#include "terminalscrollback.h"
+#include "parseraction.h"
+#include "fatal_assert.h"
+#include "locale_utils.h"
+
+using namespace Terminal;
+
+static std::string numbered_lines( int first, int count )
+{
+  std::string out;
+  char line[ 32 ];
+  for ( int i = first; i < first + count; i++ ) {
+    snprintf( line, sizeof( line ), "line %d\r\n", i );
+    out += line;
+  }
+  return out;
+}
+
+int main( void )
+{
+  set_native_locale();
+
+  Complete live( 80, 24 );
+  live.set_scrollback( 1 << 20 );
+  live.act( numbered_lines( 0, 100 ) );
+
+  /* a shorter window makes the copy push its top rows out too */
+  const Complete sent( live );
+  live.act( numbered_lines( 100, 100 ) );
+  Parser::Resize resize( 80, 10 );
+  live.act( &resize );
+  const std::string diff( live.diff_from( sent ) );
+
+  const Scrollback &history = *live.get_fb().get_scrollback();
+  const uint64_t end_line = history.get_end_line();
+  const std::vector<std::string> lines( history.get_lines( history.get_first_line(), end_line ) );
+
+  Complete copy( sent );
+  copy.apply_string( diff );
+  fatal_assert( copy.get_fb() == live.get_fb() );
+
+  fatal_assert( history.get_end_line() == end_line );
+  fatal_assert( history.get_lines( history.get_first_line(), end_line ) == lines );
+
+  return 0;
+}
@@ -0,0 +1,247 @@
+/*
+    Mosh: the mobile shell
+    Copyright 2012 Keith Winstein
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    In addition, as a special exception, the copyright holders give
+    permission to link the code of portions of this program with the
+    OpenSSL library under certain conditions as described in each
+    individual source file, and distribute linked combinations including
+    the two.
+
+    You must obey the GNU General Public License in all respects for all
+    of the code used other than OpenSSL. If you modify file(s) with this
+    exception, you may extend this exception to your version of the
+    file(s), but you are not obligated to do so. If you do not wish to do
+    so, delete this exception statement from your version. If you delete
+    this exception statement from all source files in the program, then
+    also delete it here.
+*/
+
+/* The transport keeps the user's input as a UserStream and sends what
+   the server has not acknowledged as diff_from() the state it assumes
+   the server has, after subtract()ing what it knows the server has.
+   Check both against a plain model of the stream, on deterministic
+   pseudo-random sequences of keystrokes, pastes, resizes and history
+   requests, split at every point, so that a prefix may end just
+   before or just after a resize. */
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "user.h"
+#include "parseraction.h"
+#include "fatal_assert.h"
+
+using namespace Network;
+
+enum EventType { KEY, PASTE, RESIZE, HISTORY };
+
+struct Event {
+  EventType type;
+  std::string bytes;
+  int width, height;
+  UserHistoryRequest request;
+
+  Event( EventType s_type ) : type( s_type ), bytes(), width( 0 ), height( 0 ), request( 0, 0, 0 ) {}
+};
+
+/* The stream after each prefix of the events: what it holds in absolute
+   terms, and how much of it the first i events made. */
+struct Model {
+  std::string keys;
+  std::vector<UserResize> resizes;
+  std::vector<UserHistoryRequest> requests;
+  std::vector<size_t> keys_at, resizes_at, requests_at;
+};
+
+static uint64_t state;
+
+static unsigned int next_random( void )
+{
+  state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+  return (unsigned int)( state >> 33 );
+}
+
+static unsigned int dropped_resizes, resizes_at_one_offset;
+
+static std::vector<Event> make_events( size_t count )
+{
+  /* few sizes, so that a resize often repeats the one before it */
+  static const int sizes[][ 2 ] = { { 80, 24 }, { 132, 50 }, { 80, 25 } };
+
+  std::vector<Event> events;
+  unsigned int next_id = 1;
+  while ( events.size() < count ) {
+    const unsigned int r = next_random() % 10;
+    if ( r < 4 ) {
+      Event event( KEY );
+      event.bytes = std::string( 1, char( next_random() % 256 ) );
+      events.push_back( event );
+    } else if ( r < 5 ) {
+      Event event( PASTE );
+      const size_t len = 1 + next_random() % 20;
+      while ( event.bytes.size() < len ) {
+        event.bytes += char( next_random() % 256 );
+      }
+      events.push_back( event );
+    } else if ( r < 8 ) {
+      Event event( RESIZE );
+      const int *size = sizes[ next_random() % 3 ];
+      event.width = size[ 0 ];
+      event.height = size[ 1 ];
+      events.push_back( event );
+    } else {
+      Event event( HISTORY );
+      /* ends go past 32 bits */
+      event.request = UserHistoryRequest( next_id++, ( uint64_t( next_random() ) << 16 ) | next_random(),
+                                          next_random() % 1000 );
+      events.push_back( event );
+    }
+  }
+  return events;
+}
+
+static Model make_model( const std::vector<Event> &events )
+{
+  Model model;
+  for ( size_t i = 0; i <= events.size(); i++ ) {
+    model.keys_at.push_back( model.keys.size() );
+    model.resizes_at.push_back( model.resizes.size() );
+    model.requests_at.push_back( model.requests.size() );
+    if ( i == events.size() ) {
+      break;
+    }
+
+    const Event &event = events[ i ];
+    switch ( event.type ) {
+    case KEY:
+    case PASTE:
+      model.keys += event.bytes;
+      break;
+    case RESIZE: {
+      const UserResize resize( model.keys.size(), event.width, event.height );
+      if ( !model.resizes.empty() && model.resizes.back() == resize ) {
+        dropped_resizes++; /* repeats the one before, with no keystroke between */
+        break;
+      }
+      if ( !model.resizes.empty() && model.resizes.back().offset == resize.offset ) {
+        resizes_at_one_offset++;
+      }
+      model.resizes.push_back( resize );
+      break;
+    }
+    case HISTORY:
+      model.requests.push_back( event.request );
+      break;
+    }
+  }
+  return model;
+}
+
+static UserStream make_stream( const std::vector<Event> &events, size_t count )
+{
+  UserStream stream;
+  for ( size_t i = 0; i < count; i++ ) {
+    const Event &event = events[ i ];
+    switch ( event.type ) {
+    case KEY:
+      stream.push_back( Parser::UserByte( (unsigned char) event.bytes[ 0 ] ) );
+      break;
+    case PASTE:
+      stream.push_back( event.bytes.data(), event.bytes.size() );
+      break;
+    case RESIZE:
+      stream.push_back( Parser::Resize( event.width, event.height ) );
+      break;
+    case HISTORY:
+      stream.push_back( event.request );
+      break;
+    }
+  }
+  return stream;
+}
+
+/* Is stream what events [first, last) leave after those before first
+   have been subtracted? */
+static void check( const UserStream &stream, const Model &model, size_t first, size_t last )
+{
+  const size_t key_base = model.keys_at[ first ];
+  fatal_assert( stream.get_keys() == model.keys.substr( key_base, model.keys_at[ last ] - key_base ) );
+
+  fatal_assert( stream.resize_count() == model.resizes_at[ last ] - model.resizes_at[ first ] );
+  for ( size_t i = 0; i < stream.resize_count(); i++ ) {
+    const UserResize &expected = model.resizes[ model.resizes_at[ first ] + i ];
+    fatal_assert( stream.get_resize( i ) == UserResize( expected.offset - key_base, expected.width, expected.height ) );
+  }
+
+  fatal_assert( stream.history_request_count() == model.requests_at[ last ] - model.requests_at[ first ] );
+  for ( size_t i = 0; i < stream.history_request_count(); i++ ) {
+    fatal_assert( stream.get_history_request( i ) == model.requests[ model.requests_at[ first ] + i ] );
+  }
+}
+
+static void test_sequence( size_t length )
+{
+  const std::vector<Event> events( make_events( length ) );
+  const Model model( make_model( events ) );
+
+  std::vector<UserStream> streams;
+  for ( size_t i = 0; i <= length; i++ ) {
+    streams.push_back( make_stream( events, i ) );
+    check( streams.back(), model, 0, i );
+  }
+
+  for ( size_t acked = 0; acked <= length; acked++ ) {
+    for ( size_t current = acked; current <= length; current++ ) {
+      /* the server applies the diff to what it has */
+      UserStream server( streams[ acked ] );
+      server.apply_string( streams[ current ].diff_from( streams[ acked ] ) );
+      fatal_assert( server == streams[ current ] );
+
+      UserStream rest( streams[ current ] );
+      rest.subtract( &streams[ acked ] );
+      check( rest, model, acked, current );
+
+      /* as the sender does: drop what is acknowledged from both the
+         current state and the assumed one, then diff */
+      for ( size_t assumed = acked; assumed <= current; assumed++ ) {
+        UserStream assumed_rest( streams[ assumed ] );
+        assumed_rest.subtract( &streams[ acked ] );
+        UserStream receiver( assumed_rest );
+        receiver.apply_string( rest.diff_from( assumed_rest ) );
+        fatal_assert( receiver == rest );
+      }
+
+      rest.subtract( &rest );
+      fatal_assert( rest.empty() );
+    }
+  }
+}
+
+int main( void )
+{
+  for ( uint64_t seed = 1; seed <= 40; seed++ ) {
+    state = seed;
+    test_sequence( 30 );
+  }
+
+  /* the sequences covered the cases that matter at prefix boundaries */
+  fatal_assert( dropped_resizes > 0 );
+  fatal_assert( resizes_at_one_offset > 0 );
+
+  return 0;
+}
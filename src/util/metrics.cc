@@ -0,0 +1,88 @@
+/*
+    Mosh: the mobile shell
+    Copyright 2012 Keith Winstein
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    In addition, as a special exception, the copyright holders give
+    permission to link the code of portions of this program with the
+    OpenSSL library under certain conditions as described in each
+    individual source file, and distribute linked combinations including
+    the two.
+
+    You must obey the GNU General Public License in all respects for all
+    of the code used other than OpenSSL. If you modify file(s) with this
+    exception, you may extend this exception to your version of the
+    file(s), but you are not obligated to do so. If you do not wish to do
+    so, delete this exception statement from your version. If you delete
+    this exception statement from all source files in the program, then
+    also delete it here.
+*/
+
+#include "config.h"
+
+#include <stdio.h>
+
+#if HAVE_CLOCK_GETTIME
+ #include <time.h>
+#else
+ #include <sys/time.h>
+#endif
+
+#include "metrics.h"
+
+bool metrics_timing = false;
+uint64_t metrics_stage_ns[ STAGE_COUNT ];
+
+uint64_t metrics_clock_ns( void )
+{
+#if HAVE_CLOCK_GETTIME
+  struct timespec tp;
+  if ( clock_gettime( CLOCK_MONOTONIC, &tp ) < 0 ) {
+    return 0;
+  }
+  return uint64_t( tp.tv_sec ) * 1000000000 + tp.tv_nsec;
+#else
+  struct timeval tv;
+  gettimeofday( &tv, NULL );
+  return uint64_t( tv.tv_sec ) * 1000000000 + uint64_t( tv.tv_usec ) * 1000;
+#endif
+}
+
+void Metrics::family( const char *name, const char *type, const char *help )
+{
+  text.append( "# HELP " ).append( name ).append( " " ).append( help ).append( "\n" );
+  text.append( "# TYPE " ).append( name ).append( " " ).append( type ).append( "\n" );
+}
+
+void Metrics::sample( const char *name, double value )
+{
+  char buf[ 64 ];
+  snprintf( buf, sizeof( buf ), " %.15g\n", value );
+  text.append( name ).append( buf );
+}
+
+void Metrics::sample( const char *name, const char *label, const char *label_value, double value )
+{
+  char buf[ 64 ];
+  snprintf( buf, sizeof( buf ), "} %.15g\n", value );
+  text.append( name ).append( "{" ).append( label ).append( "=\"" ).append( label_value ).append( "\"" ).append( buf );
+}
+
+void Metrics::sample( const char *name, const char *label, unsigned int label_value, double value )
+{
+  char buf[ 16 ];
+  snprintf( buf, sizeof( buf ), "%u", label_value );
+  sample( name, label, buf, value );
+}
@@ -0,0 +1,94 @@
+/*
+    Mosh: the mobile shell
+    Copyright 2012 Keith Winstein
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    In addition, as a special exception, the copyright holders give
+    permission to link the code of portions of this program with the
+    OpenSSL library under certain conditions as described in each
+    individual source file, and distribute linked combinations including
+    the two.
+
+    You must obey the GNU General Public License in all respects for all
+    of the code used other than OpenSSL. If you modify file(s) with this
+    exception, you may extend this exception to your version of the
+    file(s), but you are not obligated to do so. If you do not wish to do
+    so, delete this exception statement from your version. If you delete
+    this exception statement from all source files in the program, then
+    also delete it here.
+*/
+
+#ifndef METRICS_HPP
+#define METRICS_HPP
+
+#include <stdint.h>
+#include <string>
+
+#include "utils.h"
+
+/* Time spent in each stage of the pipeline. Only accumulated once
+   metrics_timing is set, so that nobody pays for the clock reads
+   unless someone is reading the metrics. */
+enum metrics_stage { STAGE_PARSE, STAGE_DIFF, STAGE_COMPRESS, STAGE_CRYPTO, STAGE_COUNT };
+
+extern bool metrics_timing;
+extern uint64_t metrics_stage_ns[ STAGE_COUNT ];
+
+uint64_t metrics_clock_ns( void );
+
+class StageTimer {
+private:
+  metrics_stage stage;
+  uint64_t start;
+
+public:
+  StageTimer( metrics_stage s_stage )
+    : stage( s_stage ), start( UNLIKELY( metrics_timing ) ? metrics_clock_ns() : 0 )
+  {}
+
+  ~StageTimer() { stop(); }
+
+  /* end the stage before the end of the scope */
+  void stop( void )
+  {
+    if ( UNLIKELY( start ) ) {
+      metrics_stage_ns[ stage ] += metrics_clock_ns() - start;
+      start = 0;
+    }
+  }
+
+private:
+  StageTimer( const StageTimer & );
+  StageTimer & operator=( const StageTimer & );
+};
+
+/* Builds a page in the Prometheus text exposition format. All samples
+   of a metric must follow its family() line. */
+class Metrics {
+private:
+  std::string text;
+
+public:
+  Metrics() : text() {}
+
+  void family( const char *name, const char *type, const char *help );
+  void sample( const char *name, double value );
+  void sample( const char *name, const char *label, const char *label_value, double value );
+  void sample( const char *name, const char *label, unsigned int label_value, double value );
+
+  const std::string &str( void ) const { return text; }
+};
+
+#endif
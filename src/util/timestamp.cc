@@ -45,6 +45,7 @@
  #include <stdio.h>
 #endif
 
+static uint64_t micros_cache = -1;
 static uint64_t millis_cache = -1;
 
 uint64_t frozen_timestamp( void )
@@ -56,6 +57,15 @@ uint64_t frozen_timestamp( void )
   return millis_cache;
 }
 
+uint64_t frozen_timestamp_us( void )
+{
+  if ( micros_cache == uint64_t( -1 ) ) {
+    freeze_timestamp();
+  }
+
+  return micros_cache;
+}
+
 void freeze_timestamp( void )
 {
 #if HAVE_CLOCK_GETTIME
@@ -64,24 +74,26 @@ void freeze_timestamp( void )
   if ( clock_gettime( CLOCK_MONOTONIC, &tp ) < 0 ) {
     /* did not succeed */
   } else {
-    uint64_t millis = tp.tv_nsec / 1000000;
-    millis += uint64_t( tp.tv_sec ) * 1000;
+    uint64_t micros = tp.tv_nsec / 1000;
+    micros += uint64_t( tp.tv_sec ) * 1000000;
 
-    millis_cache = millis;
+    micros_cache = micros;
+    millis_cache = micros / 1000;
     return;
   }
 #elif HAVE_MACH_ABSOLUTE_TIME
   static mach_timebase_info_data_t s_timebase_info;
-  static double absolute_to_millis;
+  static double absolute_to_micros;
 
   if (s_timebase_info.denom == 0) {
     mach_timebase_info(&s_timebase_info);
-    absolute_to_millis = 1e-6 * s_timebase_info.numer / s_timebase_info.denom;
+    absolute_to_micros = 1e-3 * s_timebase_info.numer / s_timebase_info.denom;
   }
 
   // NB: mach_absolute_time() returns "absolute time units"
-  // We need to apply a conversion to get milliseconds.
-  millis_cache = mach_absolute_time() * absolute_to_millis;
+  // We need to apply a conversion to get microseconds.
+  micros_cache = mach_absolute_time() * absolute_to_micros;
+  millis_cache = micros_cache / 1000;
   return;								    
 #elif HAVE_GETTIMEOFDAY
   // NOTE: If time steps backwards, timeouts may be confused.
@@ -89,10 +101,11 @@ void freeze_timestamp( void )
   if ( gettimeofday(&tv, NULL) ) {
     perror( "gettimeofday" );
   } else {
-    uint64_t millis = tv.tv_usec / 1000;
-    millis += uint64_t( tv.tv_sec ) * 1000;
+    uint64_t micros = tv.tv_usec;
+    micros += uint64_t( tv.tv_sec ) * 1000000;
 
-    millis_cache = millis;
+    micros_cache = micros;
+    millis_cache = micros / 1000;
     return;
   }
 #else
@@ -36,6 +36,7 @@
 #include <stdint.h>
 
 void freeze_timestamp( void );
-uint64_t frozen_timestamp( void );
+uint64_t frozen_timestamp( void ); /* ms */
+uint64_t frozen_timestamp_us( void ); /* us */
 
 #endif
@@ -0,0 +1,101 @@
+/*
+    Mosh: the mobile shell
+    Copyright 2012 Keith Winstein
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    In addition, as a special exception, the copyright holders give
+    permission to link the code of portions of this program with the
+    OpenSSL library under certain conditions as described in each
+    individual source file, and distribute linked combinations including
+    the two.
+
+    You must obey the GNU General Public License in all respects for all
+    of the code used other than OpenSSL. If you modify file(s) with this
+    exception, you may extend this exception to your version of the
+    file(s), but you are not obligated to do so. If you do not wish to do
+    so, delete this exception statement from your version. If you delete
+    this exception statement from all source files in the program, then
+    also delete it here.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "trace.h"
+#include "swrite.h"
+
+trace_event *trace_ring = NULL;
+uint64_t trace_total = 0;
+
+static char *trace_path = NULL;
+
+static void trace_dump_at_exit( void )
+{
+  trace_dump();
+}
+
+bool trace_init( const char *path )
+{
+  if ( trace_ring ) {
+    return true;
+  }
+
+  trace_event *ring = static_cast<trace_event *>( calloc( TRACE_EVENTS, sizeof( trace_event ) ) );
+  char *path_copy = strdup( path );
+  if ( !ring || !path_copy ) {
+    free( ring );
+    free( path_copy );
+    return false;
+  }
+
+  trace_ring = ring;
+  trace_path = path_copy;
+  atexit( trace_dump_at_exit );
+  return true;
+}
+
+void trace_dump( void )
+{
+  if ( !trace_ring ) {
+    return;
+  }
+
+  int fd = open( trace_path, O_WRONLY | O_CREAT | O_TRUNC, 0600 );
+  if ( fd < 0 ) {
+    perror( trace_path );
+    return;
+  }
+
+  trace_header header;
+  memcpy( header.magic, TRACE_MAGIC, sizeof( header.magic ) );
+  header.event_size = sizeof( trace_event );
+  header.count = trace_total < TRACE_EVENTS ? trace_total : TRACE_EVENTS;
+  header.total = trace_total;
+
+  /* the oldest event is the one about to be overwritten */
+  const size_t start = ( trace_total - header.count ) & ( TRACE_EVENTS - 1 );
+  const size_t first = ( start + header.count > TRACE_EVENTS ) ? TRACE_EVENTS - start : header.count;
+
+  if ( ( swrite( fd, reinterpret_cast<char *>( &header ), sizeof( header ) ) < 0 )
+       || ( swrite( fd, reinterpret_cast<char *>( trace_ring + start ), first * sizeof( trace_event ) ) < 0 )
+       || ( swrite( fd, reinterpret_cast<char *>( trace_ring ), ( header.count - first ) * sizeof( trace_event ) ) < 0 ) ) {
+    fprintf( stderr, "Could not write trace to %s.\n", trace_path );
+  }
+
+  close( fd );
+}
@@ -0,0 +1,105 @@
+/*
+    Mosh: the mobile shell
+    Copyright 2012 Keith Winstein
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    In addition, as a special exception, the copyright holders give
+    permission to link the code of portions of this program with the
+    OpenSSL library under certain conditions as described in each
+    individual source file, and distribute linked combinations including
+    the two.
+
+    You must obey the GNU General Public License in all respects for all
+    of the code used other than OpenSSL. If you modify file(s) with this
+    exception, you may extend this exception to your version of the
+    file(s), but you are not obligated to do so. If you do not wish to do
+    so, delete this exception statement from your version. If you delete
+    this exception statement from all source files in the program, then
+    also delete it here.
+*/
+
+#ifndef TRACE_HPP
+#define TRACE_HPP
+
+#include <stdint.h>
+
+#include "utils.h"
+#include "timestamp.h"
+
+/* An in-memory ring of fixed-size transport events, for traces that
+   can stay on in production. Recording an event is a few stores; the
+   ring is written out only by trace_dump(), at exit or when the
+   frontend gets SIGUSR1. examples/trace-decode prints a dump. */
+
+enum trace_type {
+  TRACE_PACKET_SENT = 1,     /* flow, len; a = seq */
+  TRACE_PACKET_RECEIVED,     /* flow, len; a = seq */
+  TRACE_RTT,                 /* flow; a = rtt (us), b = srtt (us) */
+  TRACE_STATE_SENT,          /* len = fragments; a = old, b = new, c = ack, d = throwaway */
+  TRACE_FRAGMENT_SENT,       /* len; a = new, b = instruction id, c = fragment number */
+  TRACE_STATE_RECEIVED,      /* a = old, b = new, c = ack, d = throwaway */
+  TRACE_STATE_OUT_OF_ORDER,  /* a = old, b = new, c = ack, d = throwaway */
+  TRACE_STATE_DISCARDED,     /* a = old, b = new, c = ack, d = throwaway */
+  TRACE_ACK,                 /* a = acknowledged state */
+};
+
+struct trace_event {
+  uint64_t time; /* us, frozen at the top of the main loop */
+  uint16_t type;
+  uint16_t flow;
+  uint32_t len;
+  uint64_t a, b, c, d;
+};
+
+/* dump format: this header, then count events, oldest first */
+struct trace_header {
+  char magic[ 8 ]; /* TRACE_MAGIC */
+  uint32_t event_size;
+  uint32_t count;
+  uint64_t total; /* events recorded, including those overwritten */
+};
+
+#define TRACE_MAGIC "MOSHTRC1"
+#define TRACE_EVENTS ( 1 << 16 ) /* a power of two */
+
+extern trace_event *trace_ring;
+extern uint64_t trace_total;
+
+/* Start recording, to be dumped to path. Returns false if the ring
+   cannot be allocated. */
+bool trace_init( const char *path );
+
+/* Write the ring out, replacing any earlier dump. */
+void trace_dump( void );
+
+static inline void trace( uint16_t type, uint16_t flow, uint32_t len,
+			  uint64_t a = 0, uint64_t b = 0, uint64_t c = 0, uint64_t d = 0 )
+{
+  if ( LIKELY( trace_ring == NULL ) ) {
+    return;
+  }
+
+  trace_event *e = &trace_ring[ trace_total++ & ( TRACE_EVENTS - 1 ) ];
+  e->time = frozen_timestamp_us();
+  e->type = type;
+  e->flow = flow;
+  e->len = len;
+  e->a = a;
+  e->b = b;
+  e->c = c;
+  e->d = d;
+}
+
+#endif